@@ -0,0 +1,67 @@
+#pragma once
+
+#include <tracer/guider.h>
+
+TRACER_NAMESPACE_BEGIN
+
+/**
+ * \brief Russian roulette and splitting driven by the learned radiance
+ * (adjoint-driven, as in ADRRS)
+ *
+ * The expected contribution of a path continuing at a vertex is its
+ * throughput times the radiance the guider expects the vertex to reflect
+ * (see \ref Guider::reflected()), relative to the estimate of the pixel,
+ * taken the same way at the primary vertex. The weight window around 1
+ * spans a factor \c adrrsWindow. Paths below it survive with probability
+ * ratio / lower bound, but at least \c adrrsMinSurvival. Paths above it
+ * are split in ratio / upper bound continuations, at most \c
+ * adrrsMaxSplit.
+ *
+ * Without an estimate (or with \c adrrs off) the fixed rule applies: paths
+ * continue for 3 bounces and then survive with probability 0.95.
+ */
+class AdjointRoulette {
+public:
+    AdjointRoulette(const PropertyList &props);
+
+    bool isEnabled() const { return m_enabled; }
+
+    /// Estimate of a pixel from its primary vertex, or zero if the guider has none
+    Color3f pixelEstimate(Guider *guider, const GuiderCell &cell, const Color3f &emitted, Sampler *sampler) const;
+
+    /**
+     * \brief Number of continuations of the path at a located vertex: 0
+     * ends it, more than one splits it
+     *
+     * \param throughput
+     *    Throughput of the path up to the vertex
+     * \param pixel
+     *    The estimate of the pixel, see \ref pixelEstimate()
+     * \param allowSplit
+     *    Whether the integrator can follow more than one continuation
+     * \param weight
+     *    Return the factor of the throughput of every continuation
+     */
+    int continuations(Guider *guider, const GuiderCell &cell, const Color3f &throughput, const Color3f &pixel,
+        int depth, bool allowSplit, Sampler *sampler, float &weight) const;
+
+    std::string toString() const;
+
+private:
+    bool m_enabled;
+    float m_window;
+    int m_maxSplit;
+    float m_minSurvival;
+};
+
+/// State of a split path that a guided integrator follows later
+struct PathBranch {
+    Ray3f ray;
+    Intersection its, last_its;
+    GuiderCell last_cell;
+    Color3f alpha;
+    int k;
+    bool last_specular;
+};
+
+TRACER_NAMESPACE_END
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <tracer/proplist.h>
+#include <unordered_map>
+
+TRACER_NAMESPACE_BEGIN
+
+/**
+ * \brief Convergence metric of guider training
+ *
+ * Between passes the guider feeds every cell through \ref addCell(). The
+ * metric is the total variation (half the L1 distance) between the
+ * normalized distribution of each cell and the one of the previous pass,
+ * averaged over cells weighted by their visits; cells born during the pass
+ * count as fully changed. It lies in [0, 1].
+ *
+ * Training has converged once the metric stayed below \c
+ * convergenceThreshold for \c convergencePatience passes in a row, but not
+ * before \c convergenceMinPasses passes. The guider then stops learning and
+ * the renderer skips the remaining training passes.
+ *
+ * Disabled unless \c convergenceThreshold is set. Keeping the previous
+ * distributions doubles the memory of the Q-values.
+ */
+class ConvergenceMonitor {
+public:
+    ConvergenceMonitor(const PropertyList &props);
+
+    bool isEnabled() const { return m_threshold > 0; }
+
+    bool isConverged() const { return m_converged; }
+
+    /// Start comparing the cells of a pass
+    void beginCells();
+
+    /// Compare the n values q of the cell key, visited visits times, to the previous pass
+    void addCell(int key, const float *q, int n, int64_t visits);
+
+    /**
+     * \brief Finish the comparison, append the metric to the convergence
+     * curve, report it on the console and check the convergence criterion
+     *
+     * \param name
+     *    Name of the guider, used in the report
+     *
+     * \return the metric
+     */
+    float endCells(const std::string &name);
+
+    /// Metric of every pass so far
+    const std::vector<float> &getCurve() const { return m_curve; }
+
+    std::string toString() const;
+
+private:
+    float m_threshold;
+    int m_patience;
+    int m_minPasses;
+    std::unordered_map<int, std::vector<float>> m_previous;
+    std::unordered_map<int, std::vector<float>> m_current;
+    double m_change = 0.0;
+    double m_weight = 0.0;
+    std::vector<float> m_curve;
+    int m_below = 0;
+    bool m_converged = false;
+};
+
+TRACER_NAMESPACE_END
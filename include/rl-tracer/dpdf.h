@@ -195,4 +195,248 @@ private:
     bool m_normalized;
 };
 
+/**
+ * \brief Discrete probability distribution sampled with an alias table
+ *
+ * Same interface as \ref DiscretePDF, but \ref normalize() builds a
+ * table in the manner of Walker and Vose, so that samples cost a constant
+ * time rather than a binary search over the CDF. This pays off for large
+ * distributions that are sampled often, such as the triangles of emitters.
+ *
+ * Samples map to other entries than with \ref DiscretePDF, but the
+ * reused samples of \ref sampleReuse() are uniformly distributed as well.
+ *
+ * Sampling requires a normalized distribution with a positive sum.
+ *
+ * \ingroup libcore
+ */
+struct DiscreteAliasPDF {
+public:
+
+    /// Allocate memory for a distribution with the given number of entries
+    explicit DiscreteAliasPDF(size_t nEntries = 0) {
+        reserve(nEntries);
+        clear();
+    }
+
+    /// Clear all entries
+    void clear() {
+        m_pdf.clear();
+        m_table.clear();
+        m_normalized = false;
+    }
+
+    /// Reserve memory for a certain number of entries
+    void reserve(size_t nEntries) {
+        m_pdf.reserve(nEntries);
+    }
+
+    /// Append an entry with the specified discrete probability
+    void append(float pdfValue) {
+        m_pdf.push_back(pdfValue);
+    }
+
+    /// Replace all entries, e.g. with probabilities that were computed in parallel
+    void assign(std::vector<float> &&pdfValues) {
+        m_pdf = std::move(pdfValues);
+        m_table.clear();
+        m_normalized = false;
+    }
+
+    /// Return the number of entries so far
+    size_t size() const {
+        return m_pdf.size();
+    }
+
+    /// Access an entry by its index
+    float operator[](size_t entry) const {
+        return m_pdf[entry];
+    }
+
+    /// Have the probability densities been normalized?
+    bool isNormalized() const {
+        return m_normalized;
+    }
+
+    /**
+     * \brief Return the original (unnormalized) sum of all PDF entries
+     *
+     * This assumes that \ref normalize() has previously been called
+     */
+    float getSum() const {
+        return m_sum;
+    }
+
+    /**
+     * \brief Return the normalization factor (i.e. the inverse of \ref getSum())
+     *
+     * This assumes that \ref normalize() has previously been called
+     */
+    float getNormalization() const {
+        return m_normalization;
+    }
+
+    /**
+     * \brief Normalize the distribution and build the alias table
+     *
+     * \return Sum of the (previously unnormalized) entries
+     */
+    float normalize() {
+        double sum = 0.0;
+        for (float value : m_pdf)
+            sum += value;
+        m_sum = (float) sum;
+        m_table.clear();
+        if (m_sum <= 0) {
+            m_normalization = 0.0f;
+            return m_sum;
+        }
+        m_normalization = 1.0f / m_sum;
+        size_t n = m_pdf.size();
+        m_table.resize(n);
+        /* Entries scaled so that the mean is one; an entry below one is topped up by an alias above one */
+        std::vector<double> scaled(n);
+        std::vector<uint32_t> small, large;
+        for (size_t i = 0; i < n; ++i) {
+            scaled[i] = m_pdf[i] / sum * n;
+            m_pdf[i] *= m_normalization;
+            (scaled[i] < 1.0 ? small : large).push_back((uint32_t) i);
+        }
+        while (!small.empty() && !large.empty()) {
+            uint32_t s = small.back(), l = large.back();
+            small.pop_back();
+            m_table[s].prob = (float) scaled[s];
+            m_table[s].alias = l;
+            scaled[l] -= 1.0 - scaled[s];
+            if (scaled[l] < 1.0) {
+                large.pop_back();
+                small.push_back(l);
+            }
+        }
+        /* The rest is one up to rounding errors */
+        for (uint32_t i : small)
+            m_table[i] = Entry { 1.0f, i };
+        for (uint32_t i : large)
+            m_table[i] = Entry { 1.0f, i };
+        m_normalized = true;
+        return m_sum;
+    }
+
+    /**
+     * \brief %Transform a uniformly distributed sample to the stored distribution
+     *
+     * \param[in] sampleValue
+     *     An uniformly distributed sample on [0,1]
+     * \return
+     *     The discrete index associated with the sample
+     */
+    size_t sample(float sampleValue) const {
+        float offset;
+        size_t index = column(sampleValue, offset);
+        return offset < m_table[index].prob ? index : m_table[index].alias;
+    }
+
+    /**
+     * \brief %Transform a uniformly distributed sample to the stored distribution
+     *
+     * \param[in] sampleValue
+     *     An uniformly distributed sample on [0,1]
+     * \param[out] pdf
+     *     Probability value of the sample
+     * \return
+     *     The discrete index associated with the sample
+     */
+    size_t sample(float sampleValue, float &pdf) const {
+        size_t index = sample(sampleValue);
+        pdf = m_pdf[index];
+        return index;
+    }
+
+    /**
+     * \brief %Transform a uniformly distributed sample to the stored distribution
+     *
+     * The original sample is value adjusted so that it can be "reused".
+     *
+     * \param[in, out] sampleValue
+     *     An uniformly distributed sample on [0,1]
+     * \return
+     *     The discrete index associated with the sample
+     */
+    size_t sampleReuse(float &sampleValue) const {
+        float offset;
+        size_t index = column(sampleValue, offset);
+        const Entry &entry = m_table[index];
+        if (offset < entry.prob) {
+            sampleValue = offset / entry.prob;
+        }
+        else {
+            sampleValue = (offset - entry.prob) / (1.0f - entry.prob);
+            index = entry.alias;
+        }
+        sampleValue = std::min(sampleValue, oneMinusEpsilon());
+        return index;
+    }
+
+    /**
+     * \brief %Transform a uniformly distributed sample.
+     *
+     * The original sample is value adjusted so that it can be "reused".
+     *
+     * \param[in,out]
+     *     An uniformly distributed sample on [0,1]
+     * \param[out] pdf
+     *     Probability value of the sample
+     * \return
+     *     The discrete index associated with the sample
+     */
+    size_t sampleReuse(float &sampleValue, float &pdf) const {
+        size_t index = sampleReuse(sampleValue);
+        pdf = m_pdf[index];
+        return index;
+    }
+
+    /**
+     * \brief Turn the underlying distribution into a
+     * human-readable string format
+     */
+    std::string toString() const {
+        std::string result = tfm::format("DiscreteAliasPDF[sum=%f, "
+            "normalized=%f, pdf = {", m_sum, m_normalized);
+
+        for (size_t i=0; i<m_pdf.size(); ++i) {
+            result += std::to_string(m_pdf[i]);
+            if (i != m_pdf.size()-1)
+                result += ", ";
+        }
+        return result + "}]";
+    }
+private:
+    struct Entry {
+        /// Probability of keeping the column rather than taking its alias
+        float prob;
+        uint32_t alias;
+    };
+
+    /// Largest float below one, to keep offsets and reused samples on [0,1)
+    static float oneMinusEpsilon() { return 0.99999994f; }
+
+    /**
+     * Column of the table that a sample falls in, and the offset of the
+     * sample within it. There is no table to sample before \ref normalize()
+     * or when the entries sum to zero.
+     */
+    size_t column(float sampleValue, float &offset) const {
+        assert(!m_table.empty());
+        float scaled = sampleValue * m_table.size();
+        size_t index = std::min((size_t) std::max(scaled, 0.0f), m_table.size() - 1);
+        offset = std::min(scaled - index, oneMinusEpsilon());
+        return index;
+    }
+
+    std::vector<float> m_pdf;
+    std::vector<Entry> m_table;
+    float m_sum, m_normalization;
+    bool m_normalized;
+};
+
 TRACER_NAMESPACE_END
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <tracer/vector.h>
+
+TRACER_NAMESPACE_BEGIN
+
+/**
+ * \brief Equal-area octahedral parameterization of directions
+ * (Clarberg, "Fast Equal-Area Mapping of the (Hemi)Sphere using SIMD")
+ *
+ * The upper hemisphere is mapped onto [0, 1]^2 so that a uniform grid over
+ * the square gives bins of equal solid angle. The inverse mapping, used to
+ * bin directions, needs a square root and a polynomial arctangent but no
+ * trigonometric calls, and is free of data-dependent branches apart from
+ * selects, so it vectorizes well.
+ *
+ * A sphere is binned as two such hemispheres: first the bins with z >= 0,
+ * then the mirrored bins with z < 0.
+ */
+class EqualAreaMap {
+public:
+    /// Map a point of [0, 1]^2 to a direction of the upper hemisphere
+    static Vector3f squareToHemisphere(const Point2f &p) {
+        /* Rotate the unit square onto the diamond |u| + |v| <= 1 */
+        float u = p.x() - p.y(), v = p.x() + p.y() - 1.0f;
+        float up = std::abs(u), vp = std::abs(v);
+        float r = std::min(1.0f, up + vp);
+        float phi = (r == 0.0f ? 1.0f : (vp - up) / r + 1.0f) * (float)(M_PI / 4.0);
+        float z = 1.0f - r * r;
+        float s = r * std::sqrt(std::max(0.0f, 2.0f - r * r));
+        return Vector3f(std::copysign(std::cos(phi), u) * s, std::copysign(std::sin(phi), v) * s, z);
+    }
+
+    /// Inverse of \ref squareToHemisphere(); the sign of z is ignored
+    static Point2f hemisphereToSquare(const Vector3f &d) {
+        float x = std::abs(d.x()), y = std::abs(d.y()), z = std::abs(d.z());
+        float r = std::sqrt(std::max(0.0f, 1.0f - z));
+        float a = std::max(x, y), b = std::min(x, y);
+        b = a == 0.0f ? 0.0f : b / a;
+        float phi = atanScaled(b);
+        phi = x < y ? 1.0f - phi : phi;
+        float v = phi * r, u = r - v;
+        u = std::copysign(u, d.x());
+        v = std::copysign(v, d.y());
+        /* Undo the rotation of squareToHemisphere() */
+        return Point2f(0.5f * (u + v + 1.0f), 0.5f * (v - u + 1.0f));
+    }
+
+    /// Bin of a direction (sign of z ignored) on a resolution x resolution grid
+    static int hemisphereBin(const Vector3f &d, int resolution, int &ix, int &iy) {
+        Point2f p = hemisphereToSquare(d);
+        ix = std::min((int)(p.x() * resolution), resolution - 1);
+        iy = std::min((int)(p.y() * resolution), resolution - 1);
+        return ix * resolution + iy;
+    }
+
+    static int hemisphereBin(const Vector3f &d, int resolution) {
+        int ix, iy;
+        return hemisphereBin(d, resolution, ix, iy);
+    }
+
+    /// Bin of a direction among 2 * resolution^2 bins covering the sphere
+    static int sphereBin(const Vector3f &d, int resolution) {
+        return hemisphereBin(d, resolution) + (d.z() < 0.0f ? resolution * resolution : 0);
+    }
+
+    /// Map a point of [0, 1]^2 into sphere bin b, see \ref sphereBin()
+    static Vector3f squareToSphereBin(const Point2f &p, int b, int resolution) {
+        int n = resolution * resolution, i = (b % n) / resolution, j = b % resolution;
+        Vector3f d = squareToHemisphere(Point2f((i + p.x()) / resolution, (j + p.y()) / resolution));
+        if (b >= n)
+            d.z() = -d.z();
+        return d;
+    }
+
+protected:
+    /* atan(b) * 2 / pi for b in [0, 1], max. error about 1e-6 */
+    static float atanScaled(float b) {
+        const float t1 = 0.406758566246788489601959989e-5f,
+                    t2 = 0.636226545274016134946890922156f,
+                    t3 = 0.61572017898280213493197203466e-2f,
+                    t4 = -0.247333733281268944196501420480f,
+                    t5 = 0.881770664775316294736387951347e-1f,
+                    t6 = 0.419038818029165735901852432784e-1f,
+                    t7 = -0.251390972343483509333252996350e-1f;
+        return t1 + b * (t2 + b * (t3 + b * (t4 + b * (t5 + b * (t6 + b * t7)))));
+    }
+};
+
+TRACER_NAMESPACE_END
@@ -2,9 +2,52 @@
 
 #include <tracer/object.h>
 #include <tracer/mesh.h>
+#include <tracer/bsdf.h>
+#include <tracer/warp.h>
+#include <tracer/equalarea.h>
+#include <tracer/guiderkernels.h>
 
 TRACER_NAMESPACE_BEGIN
 
+class GuiderTelemetry;
+
+/**
+ * \brief Guider state resolved once for a path vertex
+ *
+ * Filled by \ref Guider::locate() and passed to the handle variants of
+ * \ref Guider::sample(), \ref Guider::pdf() and \ref Guider::update(), so
+ * that a vertex costs a single cell lookup. The layout of the cached values
+ * is private to the guider that filled it. Integrators should keep handles
+ * alive across vertices (e.g. swap two of them) to reuse their buffers.
+ */
+struct GuiderCell {
+    /// The vertex
+    Intersection its;
+    /// Incident direction in local coordinate
+    Vector3f wi;
+    /// Spatial cell of the vertex, or -1
+    int block = -1;
+    /// Direction bin of the shading normal, or -1
+    int normalBin = -1;
+    /// Visits of the cell, or -1 if the guider does not count them
+    int64_t visits = -1;
+    /// Q-values of the cell, copied at lookup time
+    std::vector<float> values;
+    /// Guiding weights over the local hemisphere bins
+    std::vector<float> weights;
+    /// Sum of \ref weights
+    float total = 0.0f;
+    /// Whether \ref weights include the BSDF lobe
+    bool product = false;
+    /**
+     * Set by the integrator if it passes the NEE samples of the vertex to
+     * a guider with a direct table (\ref Guider::updateDirect()). The
+     * guider then leaves the emission of the next vertex out of the targets
+     * of this one, so that it is not counted twice.
+     */
+    bool direct = false;
+};
+
 /**
  * \brief Ray guider interface
  * 
@@ -72,9 +115,328 @@ public:
     */
     virtual float pdf(const Vector3f& di, const Intersection& origin) = 0;
 
+    /**
+    * \brief Sample a direction proportional to the product of the guider
+    * distribution and the BSDF lobe at the intersection. Guiders without
+    * product support fall back to \ref sample().
+    *
+    * \param sample
+    *    A random uniform [0, 1)^2 sample
+    *
+    * \param its
+    *    The current intersection
+    *
+    * \param wi
+    *    The incident direction in local coordinate
+    *
+    * \param pdf
+    *    Return the pdf of the point
+    *
+    * \return the sampled direction
+    */
+    virtual Vector3f sampleProduct(const Point2f& sample, const Intersection& its, const Vector3f& wi, float& pdf) {
+        return this->sample(sample, its, pdf);
+    }
+
+    /**
+    * \brief Return the pdf of a direction drawn by \ref sampleProduct()
+    *
+    * \param di
+    *    The action taken in local coordinate
+    *
+    * \param origin
+    *    The original state point
+    *
+    * \param wi
+    *    The incident direction in local coordinate
+    *
+    * \return the pdf of the direction
+    */
+    virtual float pdfProduct(const Vector3f& di, const Intersection& origin, const Vector3f& wi) {
+        return pdf(di, origin);
+    }
+
+    /**
+    * \brief Resolve the guider state at a vertex into a handle
+    *
+    * \param its
+    *    The current intersection
+    *
+    * \param wi
+    *    The incident direction in local coordinate
+    *
+    * \param cell
+    *    The handle to fill
+    */
+    virtual void locate(const Intersection& its, const Vector3f& wi, GuiderCell& cell) {
+        cell.its = its;
+        cell.wi = wi;
+    }
+
+    /// Same as \ref sampleProduct(), for a handle returned by \ref locate()
+    virtual Vector3f sample(const Point2f& sample, const GuiderCell& cell, float& pdf) {
+        return sampleProduct(sample, cell.its, cell.wi, pdf);
+    }
+
+    /// Same as \ref pdfProduct(), for a handle returned by \ref locate()
+    virtual float pdf(const Vector3f& di, const GuiderCell& cell) {
+        return pdfProduct(di, cell.its, cell.wi);
+    }
+
+    /// Same as \ref update(), for handles returned by \ref locate()
+    virtual void update(const GuiderCell& origin, const GuiderCell& dest, Sampler* sampler) {
+        update(origin.its, dest.its, sampler);
+    }
+
+    /**
+    * \brief Update the guider with a next event estimation sample taken at
+    * a vertex whose handle has \ref GuiderCell::direct set. Every sample
+    * must be passed, including those that were occluded or found no
+    * emitter (with zero radiance), so that the guider can average them.
+    * Guiders without a direct table (see \ref hasDirectTable()) ignore it,
+    * and only learn direct light from paths that happen to hit an emitter.
+    *
+    * \param cell
+    *    The handle of the shaded vertex
+    *
+    * \param di
+    *    The direction towards the emitter in local coordinate
+    *
+    * \param radiance
+    *    The emitted radiance arriving at the vertex along di, zero if the
+    *    sample brought no light
+    *
+    * \param pdf
+    *    Solid angle density with which di was sampled
+    *
+    * \param sampler
+    *    Provide a random number generator for the method
+    */
+    virtual void updateDirect(const GuiderCell& cell, const Vector3f& di, const Color3f& radiance, float pdf, Sampler* sampler) { }
+
+    /// Whether \ref updateDirect() keeps a direct table, see \ref GuiderCell::direct
+    virtual bool hasDirectTable() const { return false; }
+
+    /**
+    * \brief Return the bootstrapped estimate of the value of origin
+    * towards dest that \ref update() would blend in
+    */
+    virtual float target(const GuiderCell& origin, const GuiderCell& dest, Sampler* sampler) { return 0.0f; }
+
+    /**
+    * \brief Blend an estimate of the radiance arriving along a direction
+    * into the guider. Guiders that do not learn such values ignore it.
+    *
+    * \param cell
+    *    The handle of the vertex
+    *
+    * \param di
+    *    The direction in local coordinate
+    *
+    * \param value
+    *    The estimate, summed over the color channels
+    *
+    * \param sampler
+    *    Provide a random number generator for the method
+    */
+    virtual void updateTarget(const GuiderCell& cell, const Vector3f& di, float value, Sampler* sampler) { }
+
+    /**
+    * \brief Estimate the radiance that a located vertex reflects towards
+    * its incident direction, from the learned incident radiance and the
+    * BSDF. Guiders without such an estimate return false.
+    *
+    * \param cell
+    *    The handle of the vertex
+    *
+    * \param sampler
+    *    Provide a random number generator for the method
+    *
+    * \param result
+    *    Return the reflected radiance
+    */
+    virtual bool reflected(const GuiderCell& cell, Sampler* sampler, Color3f& result) { return false; }
+
+    /**
+    * \brief Called before each rendering pass, when no thread is using the
+    * guider. Maintenance that only makes room for the coming pass belongs
+    * here rather than in \ref endPass(), since no pass follows the last one.
+    */
+    virtual void beginPass() { }
+
+    /**
+    * \brief Called between rendering passes, when no thread is using the
+    * guider. Maintenance that is not thread safe should happen here.
+    */
+    virtual void endPass() { }
+
+    /**
+    * \brief Whether training has converged. The guider then no longer
+    * learns, and further training passes can be skipped.
+    */
+    virtual bool converged() const { return false; }
+
+    /// Telemetry the integrator can add its own counters to, or nullptr if disabled
+    virtual GuiderTelemetry* getTelemetry() const { return nullptr; }
+
     virtual void  done() { }
 
     EClassType getClassType() const { return EGuider; }
+
+protected:
+    /**
+    * \brief Reflect the incident radiance q, given in the A x A bins over
+    * the local hemisphere and summed over color channels, off a diffuse
+    * BSDF towards wi, with one jittered direction per bin. The BSDF
+    * gives the color, so the channels get a third of q each.
+    */
+    static Color3f reflectBins(const BSDF* bsdf, const Vector3f& wi, const float* q, int resolution, Sampler* sampler) {
+        BSDFQueryRecord brec(wi, Vector3f(0.0f), ESolidAngle);
+        Color3f result(0.0f);
+        for (int i = 0; i < resolution; i++) {
+            for (int j = 0; j < resolution; j++) {
+                brec.wo = EqualAreaMap::squareToHemisphere((sampler->next2D() + Point2f(i, j)) / resolution);
+                result += bsdf->eval(brec) * (q[i * resolution + j] * Frame::cosTheta(brec.wo));
+            }
+        }
+        return result * (2.0f * M_PI / (3.0f * resolution * resolution));
+    }
+};
+
+/**
+ * \brief Helper for guiders that store a A x A grid of bins over the local
+ * hemisphere, laid out by \ref EqualAreaMap.
+ *
+ * It multiplies per-bin guider weights with the BSDF lobe integrated over
+ * each bin (estimated on a fixed stratified pattern, so that \ref pdf()
+ * exactly matches \ref sample()), and draws a bin from the resulting
+ * discrete distribution.
+ */
+class BSDFProduct {
+public:
+    /// Precompute the evaluation directions for every bin
+    void init(int resolution, int subdivision) {
+        m_resolution = resolution;
+        m_subdivision = subdivision;
+        m_kernels = &GuiderKernels::get(resolution);
+        m_dirs.clear();
+        m_dirs.reserve(resolution * resolution * subdivision * subdivision);
+        float step = 1.0f / (resolution * subdivision);
+        for (int i = 0; i < resolution; i++) {
+            for (int j = 0; j < resolution; j++) {
+                for (int k = 0; k < subdivision; k++) {
+                    for (int l = 0; l < subdivision; l++) {
+                        Point2f s((i * subdivision + k + 0.5f) * step, (j * subdivision + l + 0.5f) * step);
+                        m_dirs.push_back(EqualAreaMap::squareToHemisphere(s));
+                    }
+                }
+            }
+        }
+    }
+
+    /// Whether the product can be formed for this BSDF and incident direction
+    static bool applicable(const BSDF* bsdf, const Vector3f& wi) {
+        return bsdf && bsdf->isDiffuse() && Frame::cosTheta(wi) > 0;
+    }
+
+    /**
+     * \brief Multiply the per-bin guider weights in \c weights (laid out
+     * as i * resolution + j) by the BSDF lobe, in place.
+     *
+     * \return the sum of the products
+     */
+    float multiply(const BSDF* bsdf, const Vector3f& wi, float* weights) const {
+        int n = m_resolution * m_resolution;
+        const float *lobe = evalLobe(bsdf, wi);
+        float total = 0.0f;
+        for (int b = 0; b < n; b++) {
+            weights[b] *= lobe[b];
+            total += weights[b];
+        }
+        return total;
+    }
+
+    /**
+     * \brief Sample a local direction from the products computed by \ref
+     * multiply(). Without any weight (total = 0), fall back to a cosine
+     * distribution.
+     */
+    Vector3f sample(const float* products, float total, const Point2f& _sample, float& pdf) const {
+        if (!(total > 0)) {
+            Vector3f di = Warp::squareToCosineHemisphere(_sample);
+            pdf = Warp::squareToCosineHemispherePdf(di);
+            return di;
+        }
+        int n = m_resolution * m_resolution;
+        float t = _sample.x() * total, acc;
+        int b = m_kernels->select(products, m_resolution, t, acc);
+        float u = products[b] > 0 ? std::min((t - acc) / products[b], 1.0f - 1e-6f) : 0.5f;
+        int i = b / m_resolution, j = b % m_resolution;
+        pdf = products[b] / total * n * INV_TWOPI;
+        return EqualAreaMap::squareToHemisphere(Point2f((i + u) / m_resolution, (j + _sample.y()) / m_resolution));
+    }
+
+    /// Density of \ref sample() for a local direction
+    float pdf(const float* products, float total, const Vector3f& di) const {
+        if (Frame::cosTheta(di) <= 0)
+            return 0.0f;
+        if (!(total > 0))
+            return Warp::squareToCosineHemispherePdf(di);
+        return products[locate(di)] / total * m_resolution * m_resolution * INV_TWOPI;
+    }
+
+    /// Locate the hemisphere bin of a local direction
+    int locate(const Vector3f& di) const {
+        return EqualAreaMap::hemisphereBin(di, m_resolution);
+    }
+
+protected:
+    /**
+     * \brief BSDF lobe integrated over each bin, plus a floor. The last
+     * lobe of each thread is kept, since the same vertex is usually
+     * queried several times in a row (sample, pdf, update).
+     */
+    const float *evalLobe(const BSDF* bsdf, const Vector3f& wi) const {
+        struct Cache {
+            const BSDFProduct *owner = nullptr;
+            const BSDF *bsdf = nullptr;
+            int subdivision = 0;
+            Vector3f wi;
+            std::vector<float> lobe;
+        };
+        static thread_local Cache cache;
+        int n = m_resolution * m_resolution, s2 = m_subdivision * m_subdivision;
+        if (cache.owner == this && cache.bsdf == bsdf && cache.subdivision == m_subdivision && cache.wi == wi && (int) cache.lobe.size() == n)
+            return cache.lobe.data();
+        cache.lobe.resize(n);
+        BSDFQueryRecord brec(wi, Vector3f(0.0f), ESolidAngle);
+        float lobe_sum = 0.0f;
+        for (int b = 0; b < n; b++) {
+            float acc = 0.0f;
+            for (int k = 0; k < s2; k++) {
+                brec.wo = m_dirs[b * s2 + k];
+                acc += bsdf->eval(brec).maxCoeff() * Frame::cosTheta(brec.wo);
+            }
+            cache.lobe[b] = acc;
+            lobe_sum += acc;
+        }
+        /* Keep every bin reachable so that narrow lobes falling between
+           evaluation points are not assigned a zero density */
+        float floor = lobe_sum / n * LOBE_FLOOR;
+        for (int b = 0; b < n; b++)
+            cache.lobe[b] += floor;
+        cache.owner = this;
+        cache.bsdf = bsdf;
+        cache.subdivision = m_subdivision;
+        cache.wi = wi;
+        return cache.lobe.data();
+    }
+
+    int m_resolution = 0;
+    int m_subdivision = 0;
+    const GuiderKernels *m_kernels = nullptr;
+    std::vector<Vector3f> m_dirs;
+    const float LOBE_FLOOR = 0.01f;
 };
 
 TRACER_NAMESPACE_END
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <tracer/equalarea.h>
+#include <tracer/frame.h>
+
+TRACER_NAMESPACE_BEGIN
+
+/**
+ * \brief Per-bin loops of the Q-table guiders
+ *
+ * The loops are instantiated for the common angular resolutions
+ * A = 4, 8, 16 and 32, so that their trip counts are compile time constants
+ * and the compiler can unroll and vectorize them; \ref get() picks the
+ * instantiation once, when the guider is created, and falls back to
+ * generic loops for other resolutions.
+ */
+struct GuiderKernels {
+    /// Sum of the A^2 hemisphere weights
+    float (*sum)(const float *weights, int resolution);
+
+    /**
+     * \brief Find the hemisphere bin in which the running sum of the
+     * weights exceeds t. \c acc receives the running sum before that bin.
+     */
+    int (*select)(const float *weights, int resolution, float t, float &acc);
+
+    /// Set the 2 A^2 sphere bins of map to value
+    void (*fill)(float *map, float value, int resolution);
+
+    /// Add value to the 2 A^2 sphere bins of map
+    void (*add)(float *map, float value, int resolution);
+
+    /**
+     * \brief Gather the sphere bins of map onto the A^2 hemisphere bins
+     * around frame, whose local centers are given. Returns the sum.
+     */
+    float (*gather)(const Frame &frame, const Vector3f *centers, const float *map, float *weights, int resolution);
+
+    /// Kernels for an angular resolution
+    static const GuiderKernels &get(int resolution);
+
+    /// Largest resolution with specialized kernels
+    static const int MAX_SPECIALIZED = 32;
+};
+
+/**
+ * \brief Array of \c N elements on the stack, or on the heap when more
+ * are needed. Holds the per-call scratch maps of the guiders.
+ */
+template <typename T, int N> class ScratchBuffer {
+public:
+    ScratchBuffer(int size) : m_data(size <= N ? m_local : new T[size]) { }
+
+    ~ScratchBuffer() {
+        if (m_data != m_local)
+            delete[] m_data;
+    }
+
+    T *data() { return m_data; }
+    const T *data() const { return m_data; }
+    T &operator[](int i) { return m_data[i]; }
+    const T &operator[](int i) const { return m_data[i]; }
+
+private:
+    ScratchBuffer(const ScratchBuffer &) = delete;
+    ScratchBuffer &operator=(const ScratchBuffer &) = delete;
+
+    T m_local[N];
+    T *m_data;
+};
+
+/// Scratch buffer holding a sphere map up to \ref GuiderKernels::MAX_SPECIALIZED
+typedef ScratchBuffer<float, 2 * GuiderKernels::MAX_SPECIALIZED * GuiderKernels::MAX_SPECIALIZED> SphereScratch;
+
+TRACER_NAMESPACE_END
@@ -53,6 +53,15 @@ public:
      */
     virtual Color3f Li(const Scene *scene, Sampler *sampler, const Ray3f &ray) const = 0;
 
+    /// Called before each (progressive) rendering pass starts
+    virtual void beginPass() { }
+
+    /// Called after each (progressive) rendering pass has finished
+    virtual void endPass() { }
+
+    /// Whether the remaining progressive passes before the final one can be skipped
+    virtual bool converged() const { return false; }
+
     virtual void done() { }
 
     /**
@@ -0,0 +1,119 @@
+#pragma once
+
+#include <tracer/guider.h>
+#include <tbb/enumerable_thread_specific.h>
+#include <unordered_map>
+
+TRACER_NAMESPACE_BEGIN
+
+/**
+ * \brief Selects the emitter of a next event estimation sample from the
+ * contributions learned at the shaded state
+ *
+ * Every state keeps, for each emitter, a running average of the direct
+ * light it delivered to NEE samples taken there, shadow test included,
+ * so occluded and dim emitters lose weight. Emitters are selected in
+ * proportion to these averages, mixed with a uniform distribution of
+ * weight \c lightSelectionFloor so that every emitter stays reachable.
+ *
+ * The state is the cell the guider located (\ref GuiderCell::block);
+ * vertices of guiders without one fall in a grid of \c
+ * lightSelectionResolution cubes along the largest extent of the scene.
+ * Averages use the sample mean until \c lightSelectionRate takes over as
+ * the blending rate.
+ *
+ * Selection during a pass uses the averages as of the end of the previous
+ * one, so that the NEE sample and the pdf evaluated when a BSDF sample
+ * hits the emitter agree and neither takes a lock. Each thread collects
+ * the samples of the pass, which \ref endPass() blends into the averages;
+ * the first pass selects uniformly.
+ *
+ * With \c lightSelection = "uniform" (the default) this is the uniform
+ * selection of \ref Scene::sampleEmitter(), and points are sampled with
+ * \ref Scene::sampleLight() (the light tree of the scene, if any).
+ */
+class LightSelector {
+public:
+    LightSelector(const PropertyList &props);
+
+    bool isEnabled() const { return m_enabled; }
+
+    /// Index the emitters of the scene
+    void init(const Scene *scene);
+
+    /**
+     * \brief Select an emitter for a NEE sample at a located vertex
+     *
+     * \param pdf
+     *    Return the probability of the selection
+     * \return the emitter, or nullptr if the scene has none
+     */
+    const Emitter *sample(const Scene *scene, const GuiderCell &cell, float sample, float &pdf) const;
+
+    /// Probability that \ref sample() selects an emitter at a located vertex
+    float pdf(const Scene *scene, const GuiderCell &cell, const Emitter *emitter) const;
+
+    /**
+     * \brief Sample a point on the emitters for a NEE sample at a located
+     * vertex, like \ref Scene::sampleLight()
+     *
+     * \param pdf
+     *    Return the density of the point per unit area, selection included
+     */
+    const Emitter *samplePosition(const Scene *scene, const GuiderCell &cell, float sample, const Point2f &sample2,
+        Point3f &p, Frame &nFrame, float &pdf) const;
+
+    /// Density per unit area with which \ref samplePosition() at a located vertex returns the emitter point its
+    float pdfPosition(const Scene *scene, const GuiderCell &cell, const Intersection &its) const;
+
+    /**
+     * \brief Learn from a NEE sample of an emitter at a located vertex;
+     * thread safe, takes effect at the end of the pass
+     *
+     * \param estimate
+     *    The estimate of the reflected direct light of the sample, as drawn
+     *    by \ref samplePosition(); zero if it was occluded
+     */
+    void update(const GuiderCell &cell, const Emitter *emitter, const Color3f &estimate) const;
+
+    /// Blend the samples of the pass into the averages; not thread safe
+    void endPass();
+
+    std::string toString() const;
+
+private:
+    struct State {
+        std::vector<float> values;
+        std::vector<uint32_t> counts;
+        float total = 0.0f;
+    };
+    /// Samples of a pass at a state: sums and counts per emitter
+    struct Samples {
+        std::vector<float> sums;
+        std::vector<uint32_t> counts;
+    };
+    typedef std::unordered_map<int64_t, State> StateMap;
+    typedef std::unordered_map<int64_t, Samples> SampleMap;
+
+    int64_t key(const GuiderCell &cell) const;
+
+    /// Selection probability of emitter i in a state
+    float probability(const State &state, int i) const;
+
+    /// Selection probability of emitter i at a key, uniform for states without samples
+    float probability(int64_t key, int i) const;
+
+    bool m_enabled;
+    float m_floor;
+    float m_rate;
+    int m_resolution;
+    Point3f m_origin;
+    float m_cellSize = 1.0f;
+    std::unordered_map<const Emitter *, int> m_indices;
+    /* Only changed by endPass(), so read without locks during a pass */
+    StateMap m_states;
+    /* Filled from the const render loop, like the guider */
+    mutable tbb::enumerable_thread_specific<SampleMap> m_samples;
+};
+
+TRACER_NAMESPACE_END
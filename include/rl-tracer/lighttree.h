@@ -0,0 +1,90 @@
+#pragma once
+
+#include <tracer/mesh.h>
+#include <unordered_map>
+
+TRACER_NAMESPACE_BEGIN
+
+/**
+ * \brief Light tree over the triangles of all emitters
+ *
+ * A binary tree in the spirit of the light BVHs of production renderers:
+ * each node stores the emitted power of the triangles below it, their
+ * bounding box and a cone bounding their normals. A triangle is selected
+ * for a shading point by descending from the root and picking a child in
+ * proportion to its importance, an estimate of the power it delivers to
+ * the point from the distance to the box and the angle between the cone
+ * and the point. The importance is only zero for nodes whose triangles
+ * all face away from the point, so selection stays unbiased.
+ *
+ * Leaves hold single triangles, so scenes with many emitters as well as
+ * emitters made of many triangles are sampled in time logarithmic in the
+ * number of triangles.
+ */
+class LightTree {
+public:
+    /// Build the tree over the triangles of the emitting meshes
+    void build(const std::vector<Mesh *> &meshes);
+
+    bool isEmpty() const { return m_nodes.empty(); }
+
+    /**
+     * \brief Select an emitter triangle for a shading point
+     *
+     * \param ref
+     *    The shading point
+     * \param sample
+     *    A uniformly distributed sample on [0,1]
+     * \param face
+     *    Return the index of the triangle within its mesh
+     * \param pdf
+     *    Return the probability of the selection
+     * \return the mesh of the triangle, or nullptr if no triangle faces ref
+     */
+    const Mesh *sample(const Point3f &ref, float sample, uint32_t &face, float &pdf) const;
+
+    /// Probability that \ref sample() selects a triangle of a mesh for a shading point
+    float pdf(const Point3f &ref, const Mesh *mesh, uint32_t face) const;
+
+    std::string toString() const;
+
+private:
+    struct Node {
+        BoundingBox3f bbox;
+        /// Axis and half angle of the cone bounding the normals
+        Vector3f axis;
+        float spread;
+        float power;
+        uint32_t parent;
+        /// Index of the second child (the first follows the node), or of the triangle of a leaf
+        uint32_t index;
+        bool leaf;
+    };
+
+    struct Triangle {
+        const Mesh *mesh;
+        uint32_t face;
+        BoundingBox3f bbox;
+        Point3f centroid;
+        Vector3f axis;
+        float spread;
+        float power;
+    };
+
+    uint32_t buildNode(uint32_t begin, uint32_t end, uint32_t parent);
+
+    /// Estimate of the power a node delivers to ref
+    float importance(const Node &node, const Point3f &ref) const;
+
+    /// Smallest cone containing two cones
+    static void mergeCones(const Vector3f &a, float spreadA, const Vector3f &b, float spreadB,
+        Vector3f &axis, float &spread);
+
+    std::vector<Node> m_nodes;
+    std::vector<Triangle> m_triangles;
+    /// Leaf of each triangle, from the offset of the first triangle of each mesh
+    std::vector<uint32_t> m_leaves;
+    std::unordered_map<const Mesh *, uint32_t> m_offsets;
+};
+
+TRACER_NAMESPACE_END
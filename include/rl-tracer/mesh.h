@@ -46,9 +46,11 @@ struct Intersection {
     Frame geoFrame;
     /// Pointer to the associated mesh
     const Mesh *mesh;
+    /// Index of the triangle within the mesh
+    uint32_t face;
 
     /// Create an uninitialized intersection record
-    Intersection() : mesh(nullptr) { }
+    Intersection() : mesh(nullptr), face(0) { }
 
     /// Transform a direction vector into the local shading frame
     Vector3f toLocal(const Vector3f &d) const {
@@ -95,6 +97,12 @@ public:
      */
     void samplePosition(const Point2f &sample, Point3f &p, Frame &nFrame, float &pdf) const;
 
+    /**
+     * \brief Uniformly sample a position on the given triangle with
+     * respect to surface area. Returns position and normal
+     */
+    void sampleTriangle(uint32_t index, const Point2f &sample, Point3f &p, Frame &nFrame) const;
+
     /// Return the surface area of the given triangle
     float surfaceArea(uint32_t index) const;
 
@@ -187,7 +195,7 @@ protected:
     Emitter    *m_emitter = nullptr;     ///< Associated emitter, if any
     BoundingBox3f m_bbox;                ///< Bounding box of the mesh
     float         m_area;                ///< Total surface area of the mesh
-    DiscretePDF   m_facepdf;             ///< PDF of choosing a face uniformly
+    DiscreteAliasPDF m_facepdf;          ///< PDF of choosing a face uniformly
 };
 
 TRACER_NAMESPACE_END
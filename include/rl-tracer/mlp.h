@@ -0,0 +1,70 @@
+#pragma once
+
+#include <tracer/common.h>
+
+TRACER_NAMESPACE_BEGIN
+
+/**
+ * \brief Small fully connected network with ReLU hidden layers
+ *
+ * Inference of a single input runs on activations of a bounded size that
+ * live on the stack, so it does not allocate; Eigen vectorizes the matrix
+ * products. Training takes a mini-batch (one input per column) and
+ * minimizes the mean squared error of one output per input with Adam.
+ * Memory depends only on the layer sizes.
+ */
+class TinyMLP {
+public:
+    typedef Eigen::Matrix<float, Eigen::Dynamic, Eigen::Dynamic> Matrix;
+
+    /// Largest input and hidden layer width supported by \ref evaluate()
+    static const int MAX_WIDTH = 256;
+
+    /**
+     * \param inputs, width, layers, outputs
+     *    Input size, and width and number of the hidden layers
+     * \param seed
+     *    Seed of the He initialization of the weights; biases start at 0
+     */
+    TinyMLP(int inputs, int width, int layers, int outputs, uint64_t seed);
+
+    /// Evaluate the network for one input, writing \ref getOutputs() values
+    void evaluate(const float *input, float *output) const;
+
+    /**
+     * \brief One Adam step on the mean over the batch of
+     * (output[bins[i]] - targets[i])^2
+     *
+     * \return the loss before the step
+     */
+    float train(const Matrix &input, const int *bins, const float *targets, float learningRate);
+
+    /// Copy the weights of a network with the same layer sizes, leaving the Adam state alone
+    void assignWeights(const TinyMLP &other);
+
+    /// Write the weights to a file, or read them from a file written for the same layer sizes
+    void save(const std::string &filename) const;
+    void load(const std::string &filename);
+
+    int getInputs() const { return m_inputs; }
+    int getOutputs() const { return m_outputs; }
+    size_t getParameterCount() const;
+    int getSteps() const { return m_steps; }
+
+    std::string toString() const;
+
+private:
+    struct Layer {
+        Matrix weights;
+        Eigen::VectorXf bias;
+        /* Adam moments */
+        Matrix mWeights, vWeights;
+        Eigen::VectorXf mBias, vBias;
+    };
+
+    int m_inputs, m_width, m_outputs;
+    std::vector<Layer> m_layers;
+    int m_steps = 0;
+};
+
+TRACER_NAMESPACE_END
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <tracer/guider.h>
+
+TRACER_NAMESPACE_BEGIN
+
+/**
+ * \brief Monte Carlo return updates of a guider
+ *
+ * Instead of updating the guider at every bounce towards a bootstrapped
+ * (TD) target, a guided integrator records the vertices of its path and,
+ * once the path has ended, blends the radiance that actually arrived at
+ * each vertex from the next one into the guider. With lambda < 1 the
+ * return is mixed with the TD target taken when the next vertex was
+ * located, as (1 - lambda) * TD + lambda * return; with lambda = 1 no TD
+ * integral is computed at all.
+ *
+ * Contributions are given per unit of throughput arriving at the current
+ * vertex. The vertices are kept in per-thread storage reused across paths.
+ */
+class PathReturns {
+public:
+    /**
+     * \param guider
+     *    The guider to update, or nullptr to disable recording
+     * \param lambda
+     *    Weight of the Monte Carlo return against the TD target
+     */
+    PathReturns(Guider *guider, float lambda);
+
+    bool isEnabled() const { return m_guider != nullptr; }
+
+    /// Start a new vertex, located in cell
+    void addVertex(const GuiderCell &cell, Sampler *sampler);
+
+    /**
+     * \brief Emission of the current vertex towards the previous one.
+     * All of it arrives at the previous vertex; \c counted is the part the
+     * integrator added to its estimate (e.g. MIS weighted, or none).
+     */
+    void addEmission(const Color3f &emitted, const Color3f &counted);
+
+    /// Radiance added by next event estimation at the current vertex
+    void addDirect(const Color3f &direct);
+
+    /// The path continues from the current vertex with this throughput weight
+    void scatter(const Color3f &weight);
+
+    /// The path has ended: update the guider at every vertex followed by another
+    void finish(Sampler *sampler);
+
+private:
+    struct Vertex {
+        GuiderCell cell;
+        Color3f emitted, counted, direct, weight, reflected;
+        float td;
+    };
+
+    /* Per-thread vertex storage */
+    static std::vector<Vertex> &storage();
+
+    Guider *m_guider;
+    float m_lambda;
+    std::vector<Vertex> *m_vertices = nullptr;
+};
+
+TRACER_NAMESPACE_END
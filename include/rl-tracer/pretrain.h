@@ -0,0 +1,46 @@
+#pragma once
+
+#include <tracer/guider.h>
+
+TRACER_NAMESPACE_BEGIN
+
+/**
+ * \brief Seeds a guider with light paths before rendering
+ *
+ * Light paths start on a point of an emitter chosen with
+ * \ref Scene::sampleEmitter(), leave it in a cosine-distributed direction
+ * and bounce by BSDF sampling. Each segment updates the guider at its far
+ * vertex towards its near vertex, from the light outwards, so that emission
+ * propagates along the whole path in a single sweep. The paths are traced
+ * in parallel; the guider must support concurrent updates.
+ *
+ * Reads the integrator properties \c pretrainPaths (number of light paths,
+ * 0 disables pretraining) and \c pretrainDepth (maximum number of segments).
+ */
+class LightPathPretrainer {
+public:
+    LightPathPretrainer(const PropertyList &props);
+
+    /**
+     * \brief Trace the light paths into guider
+     *
+     * \param direct
+     *    Whether the guider learns the direct light of diffuse vertices
+     *    from NEE samples (see \ref GuiderCell::direct); the segments
+     *    leaving an emitter then do not update diffuse vertices
+     */
+    void run(const Scene *scene, Guider *guider, bool direct = false) const;
+
+    bool isEnabled() const { return m_paths > 0; }
+
+    std::string toString() const;
+
+private:
+    /* Trace one light path */
+    void trace(const Scene *scene, Guider *guider, Sampler *sampler, bool direct) const;
+
+    int m_paths;
+    int m_depth;
+};
+
+TRACER_NAMESPACE_END
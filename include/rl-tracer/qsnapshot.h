@@ -0,0 +1,150 @@
+#pragma once
+
+#include <tracer/bbox.h>
+#include <tracer/qvalue.h>
+
+TRACER_NAMESPACE_BEGIN
+
+/**
+ * \brief Versioned on-disk snapshot of a Q-table guider
+ *
+ * A snapshot consists of a fixed size header, a sorted array of cell keys,
+ * and a contiguous payload holding one fixed size record per cell (encoded
+ * Q-values followed by visit counts, see \ref QValueCodec). Sections are
+ * 64 byte aligned so the file can be memory mapped and used in place as
+ * read-only guider storage: opening a snapshot only validates the header
+ * and the index, cells are paged in on first access.
+ */
+class QSnapshot {
+public:
+    enum EGuiderType {
+        /// \ref QTableGuider: A x A bins over the local hemisphere
+        EHemisphere = 0,
+        /// \ref QTableSphereGuider: 2 A^2 bins over the world sphere
+        ESphere = 1,
+        /// As \ref EHemisphere, keyed by \ref StateHash instead of the grid index
+        EHemisphereHashed = 2,
+        /// As \ref ESphere, keyed by \ref StateHash instead of the grid index
+        ESphereHashed = 3
+    };
+
+    struct Header {
+        /// Always "RLQTABLE"
+        char magic[8];
+        /// Format version, see \ref VERSION
+        uint32_t version;
+        /// One of \ref EGuiderType
+        uint32_t guiderType;
+        /// One of \ref QValueCodec::EPrecision
+        uint32_t precision;
+        int32_t sceneResolution;
+        int32_t angleResolution;
+        /// Number of bins in a cell
+        uint32_t binCount;
+        uint64_t cellCount;
+        /// Stride of one cell record in the payload
+        uint64_t recordBytes;
+        /// Scene bounds: min x, y, z followed by max x, y, z
+        float bounds[6];
+        uint64_t indexOffset;
+        uint64_t payloadOffset;
+        /// FNV-1a hash of the header (up to this field) and the index
+        uint64_t indexChecksum;
+        /// FNV-1a hash of the payload
+        uint64_t payloadChecksum;
+    };
+
+    /// Bumped when the layout or the direction binning changes (2: \ref EqualAreaMap bins)
+    static const uint32_t VERSION = 2;
+
+    /// Map a snapshot file. Throws a \ref TracerException if it is invalid.
+    QSnapshot(const std::string &filename);
+
+    /// Unmap the file
+    ~QSnapshot();
+
+    const Header &getHeader() const { return *m_header; }
+
+    /// Return the scene bounds stored in the snapshot
+    BoundingBox3f getBounds() const;
+
+    /// Return the codec matching the stored precision
+    const QValueCodec &getCodec() const { return m_codec; }
+
+    size_t getCellCount() const { return (size_t)m_header->cellCount; }
+
+    /// Key of the i-th cell, in ascending order
+    int32_t getKey(size_t i) const { return m_index[i]; }
+
+    /// Encoded Q-values of the i-th cell
+    const uint8_t *getValues(size_t i) const {
+        return m_payload + i * m_header->recordBytes;
+    }
+
+    /// Encoded visit counts of the i-th cell
+    const uint8_t *getVisits(size_t i) const {
+        return getValues(i) + visitOffset(m_header->binCount, m_codec);
+    }
+
+    /// Binary search for a cell; returns its position or -1
+    ptrdiff_t find(int32_t key) const;
+
+    /// Check the payload checksum (reads the whole file)
+    bool verify() const;
+
+    /// Offset of the visit counts within a record
+    static size_t visitOffset(uint32_t binCount, const QValueCodec &codec) {
+        return (binCount * codec.valueBytes() + 3) & ~(size_t)3;
+    }
+
+    /// Size of a record, padded to 8 bytes
+    static size_t recordBytes(uint32_t binCount, const QValueCodec &codec) {
+        return (visitOffset(binCount, codec) + binCount * codec.visitBytes() + 7) & ~(size_t)7;
+    }
+
+    /// FNV-1a hash, optionally continuing from a previous value
+    static uint64_t checksum(const void *data, size_t size, uint64_t hash = 0xcbf29ce484222325ull);
+
+private:
+    void unmap();
+
+    const Header *m_header = nullptr;
+    const int32_t *m_index = nullptr;
+    const uint8_t *m_payload = nullptr;
+    QValueCodec m_codec;
+    void *m_data = nullptr;
+    size_t m_size = 0;
+#if defined(_WIN32)
+    void *m_file = nullptr;
+    void *m_mapping = nullptr;
+#endif
+};
+
+/**
+ * \brief Writes a \ref QSnapshot
+ *
+ * Cells can be added in any order and are copied, so the guider storage
+ * may be released before \ref write() is called.
+ */
+class QSnapshotWriter {
+public:
+    QSnapshotWriter(QSnapshot::EGuiderType type, const QValueCodec &codec,
+        int sceneResolution, int angleResolution, uint32_t binCount,
+        const BoundingBox3f &bounds);
+
+    /// Add a cell from its encoded Q-values and visit counts
+    void add(int32_t key, const uint8_t *values, const uint8_t *visits);
+
+    size_t getCellCount() const { return m_keys.size(); }
+
+    /// Sort the cells and write the snapshot
+    void write(const std::string &filename);
+
+private:
+    QSnapshot::Header m_header;
+    QValueCodec m_codec;
+    std::vector<int32_t> m_keys;
+    std::vector<uint8_t> m_records;
+};
+
+TRACER_NAMESPACE_END
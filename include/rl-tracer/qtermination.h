@@ -0,0 +1,51 @@
+#pragma once
+
+#include <tracer/guider.h>
+
+TRACER_NAMESPACE_BEGIN
+
+/**
+ * \brief Ends guided paths with the radiance the guider has learned
+ *
+ * At a diffuse vertex whose cell has at least \c qTerminationVisits visits
+ * and at least \c qTerminationDepth bounces from the camera, the radiance
+ * the vertex reflects is estimated from the Q-values (see
+ * \ref Guider::reflected()) instead of tracing the rest of the path.
+ *
+ * With \c qTermination = "biased" every such path ends there. With
+ * "unbiased", the path ends with probability \c qTerminationProbability p,
+ * and the estimate serves as a control variate: it is always added, and a
+ * path that continues adds (continuation - estimate) / (1 - p), so that
+ * the expectation is that of the full path.
+ */
+class QTermination {
+public:
+    QTermination(const PropertyList &props);
+
+    bool isEnabled() const { return m_mode != ENone; }
+
+    /**
+     * \brief Decide whether the path ends at a located vertex
+     *
+     * \param estimate
+     *    Return the radiance to add at the vertex, times the throughput
+     * \return the factor of the throughput of the continuing path, 0 if it ends
+     */
+    float decide(Guider *guider, const GuiderCell &cell, int depth, Sampler *sampler, Color3f &estimate) const;
+
+    std::string toString() const;
+
+private:
+    enum EMode {
+        ENone = 0,
+        EBiased,
+        EUnbiased
+    };
+
+    EMode m_mode;
+    int64_t m_visits;
+    int m_depth;
+    float m_probability;
+};
+
+TRACER_NAMESPACE_END
@@ -0,0 +1,246 @@
+#pragma once
+
+#include <tracer/common.h>
+#include <cstring>
+#include <cmath>
+
+TRACER_NAMESPACE_BEGIN
+
+/**
+ * \brief Storage format of Q-values and visit counts in a Q-table cell
+ *
+ * Q-values are kept either as 32 bit floats, IEEE half floats, or as
+ * 16/8 bit codes of log2(Q) over [LOG_MIN, LOG_MIN + LOG_RANGE). Every
+ * compact format stores visit counts as 16 bit integers that saturate.
+ * Decoding works on whole cells so it can be vectorized: half floats
+ * with F16C when the CPU has it (checked at run time), log codes with
+ * lookup tables instead of exp2. Encoding happens per bin on update.
+ */
+class QValueCodec {
+public:
+    enum EPrecision {
+        EFloat32 = 0,
+        EFloat16,
+        ELog16,
+        ELog8
+    };
+
+    QValueCodec(EPrecision precision = EFloat32) : m_precision(precision) {
+        if (m_precision == ELog8) {
+            for (int i = 0; i < 256; i++)
+                m_log8Table[i] = std::exp2(LOG_MIN + i * (LOG_RANGE / 256.0f));
+        }
+        else if (m_precision == ELog16) {
+            /* 2^(LOG_MIN + code * step) split into the factors of the high and the low byte of the code */
+            for (int i = 0; i < 256; i++) {
+                m_log16High[i] = std::exp2(LOG_MIN + i * (LOG_RANGE / 256.0f));
+                m_log16Low[i] = std::exp2(i * (LOG_RANGE / 65536.0f));
+            }
+        }
+    }
+
+    /// Parse the "precision" property of a guider
+    static EPrecision fromString(const std::string& name) {
+        if (name == "float32")
+            return EFloat32;
+        else if (name == "float16")
+            return EFloat16;
+        else if (name == "log16")
+            return ELog16;
+        else if (name == "log8")
+            return ELog8;
+        throw TracerException("Unknown Q-value precision \"%s\"", name);
+    }
+
+    static std::string toString(EPrecision precision) {
+        switch (precision) {
+            case EFloat16: return "float16";
+            case ELog16:   return "log16";
+            case ELog8:    return "log8";
+            default:       return "float32";
+        }
+    }
+
+    EPrecision getPrecision() const { return m_precision; }
+
+    /// Bytes used by one Q-value
+    size_t valueBytes() const {
+        switch (m_precision) {
+            case EFloat16:
+            case ELog16: return 2;
+            case ELog8:  return 1;
+            default:     return 4;
+        }
+    }
+
+    /// Bytes used by one visit count
+    size_t visitBytes() const {
+        return m_precision == EFloat32 ? sizeof(int32_t) : sizeof(uint16_t);
+    }
+
+    /// Largest visit count that can be stored
+    int maxVisit() const {
+        return m_precision == EFloat32 ? 0x7fffffff : 0xffff;
+    }
+
+    /**
+     * \brief Accumulate weight * Q for n encoded values into dst
+     */
+    void decode(const uint8_t* src, float* dst, int n, float weight = 1.0f) const {
+        switch (m_precision) {
+            case EFloat32: {
+                    const float* q = (const float*)src;
+                    for (int i = 0; i < n; i++)
+                        dst[i] += weight * q[i];
+                }
+                break;
+            case EFloat16:
+                decodeHalf((const uint16_t*)src, dst, n, weight);
+                break;
+            case ELog16: {
+                    const uint16_t* q = (const uint16_t*)src;
+                    for (int i = 0; i < n; i++)
+                        dst[i] += weight * log16(q[i]);
+                }
+                break;
+            case ELog8:
+                for (int i = 0; i < n; i++)
+                    dst[i] += weight * m_log8Table[src[i]];
+                break;
+        }
+    }
+
+    /// Decode a single value
+    float get(const uint8_t* src, int i) const {
+        switch (m_precision) {
+            case EFloat16: return halfToFloat(((const uint16_t*)src)[i]);
+            case ELog16:   return log16(((const uint16_t*)src)[i]);
+            case ELog8:    return m_log8Table[src[i]];
+            default:       return ((const float*)src)[i];
+        }
+    }
+
+    /**
+     * \brief Encode a single value
+     *
+     * \param u
+     *    Uniform number used for stochastic rounding, so that small TD
+     *    updates are preserved in expectation. Pass 0.5 to round to nearest.
+     */
+    void set(uint8_t* dst, int i, float value, float u = 0.5f) const {
+        switch (m_precision) {
+            case EFloat32:
+                ((float*)dst)[i] = value;
+                break;
+            case EFloat16: {
+                    uint16_t lo = floatToHalf(value), hi = lo;
+                    float flo = halfToFloat(lo);
+                    if (flo < value && lo < HALF_MAX) hi = lo + 1;
+                    else if (flo > value && lo > 0) lo = lo - 1;
+                    float a = halfToFloat(lo), b = halfToFloat(hi);
+                    ((uint16_t*)dst)[i] = (b > a && u < (value - a) / (b - a)) ? hi : lo;
+                }
+                break;
+            case ELog16:
+                ((uint16_t*)dst)[i] = (uint16_t)quantize(value, 65536, u);
+                break;
+            case ELog8:
+                dst[i] = (uint8_t)quantize(value, 256, u);
+                break;
+        }
+    }
+
+    /// Read a visit count
+    int getVisit(const uint8_t* visits, int i) const {
+        return m_precision == EFloat32 ? ((const int32_t*)visits)[i] : ((const uint16_t*)visits)[i];
+    }
+
+    /// Write a visit count, saturating at \ref maxVisit()
+    void setVisit(uint8_t* visits, int i, int64_t count) const {
+        int v = (int)std::min<int64_t>(count, maxVisit());
+        if (m_precision == EFloat32)
+            ((int32_t*)visits)[i] = v;
+        else
+            ((uint16_t*)visits)[i] = (uint16_t)v;
+    }
+
+    /// Fill n values with a constant
+    void fill(uint8_t* dst, int n, float value) const {
+        for (int i = 0; i < n; i++)
+            set(dst, i, value);
+    }
+
+    static float halfToFloat(uint16_t h) {
+        uint32_t sign = (h & 0x8000u) << 16, exp = (h >> 10) & 0x1f, mant = h & 0x3ffu, bits;
+        if (exp == 0) {
+            /* Zero or subnormal */
+            float f = mant * (1.0f / (1 << 24));
+            return sign ? -f : f;
+        }
+        else if (exp == 31) {
+            bits = sign | 0x7f800000u | (mant << 13);
+        }
+        else {
+            bits = sign | ((exp + 112) << 23) | (mant << 13);
+        }
+        float f;
+        memcpy(&f, &bits, sizeof(float));
+        return f;
+    }
+
+    static uint16_t floatToHalf(float f) {
+        f = std::min(f, 65504.0f);
+        uint32_t bits;
+        memcpy(&bits, &f, sizeof(float));
+        uint32_t sign = (bits >> 16) & 0x8000u;
+        int exp = (int)((bits >> 23) & 0xff) - 112;
+        uint32_t mant = bits & 0x7fffffu;
+        if (exp <= 0) {
+            /* Subnormal or zero */
+            if (exp < -10)
+                return (uint16_t)sign;
+            mant |= 0x800000u;
+            return (uint16_t)(sign | ((mant >> (14 - exp)) + ((mant >> (13 - exp)) & 1)));
+        }
+        uint32_t h = sign | (exp << 10) | (mant >> 13);
+        /* Round to nearest; a carry correctly bumps the exponent */
+        return (uint16_t)(h + ((mant >> 12) & 1));
+    }
+
+    static constexpr float LOG_MIN = -4.0f;
+    static constexpr float LOG_RANGE = 32.0f;
+
+protected:
+    /* Round between the two enclosing codes so that the decoded value is right in expectation */
+    int quantize(float value, int levels, float u) const {
+        float step = LOG_RANGE / levels;
+        float x = (std::log2(std::max(value, 1e-30f)) - LOG_MIN) / step;
+        int code = (int)std::floor(x);
+        if (code < 0)
+            return 0;
+        if (code >= levels - 1)
+            return levels - 1;
+        /* The bounds as decoded, so that rounding is unbiased for the values actually read back */
+        float a = logValue(code, levels), b = logValue(code + 1, levels);
+        return u < (value - a) / (b - a) ? code + 1 : code;
+    }
+
+    float log16(uint16_t code) const {
+        return m_log16High[code >> 8] * m_log16Low[code & 0xff];
+    }
+
+    float logValue(int code, int levels) const {
+        return levels == 256 ? m_log8Table[code] : log16((uint16_t)code);
+    }
+
+    /// Accumulate weight * half float for n values, with F16C if the CPU supports it
+    static void decodeHalf(const uint16_t* q, float* dst, int n, float weight);
+
+    static const uint16_t HALF_MAX = 0x7bff;
+
+    EPrecision m_precision;
+    float m_log8Table[256];
+    float m_log16High[256], m_log16Low[256];
+};
+
+TRACER_NAMESPACE_END
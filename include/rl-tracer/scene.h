@@ -19,6 +19,7 @@
 #pragma once
 
 #include <tracer/accel.h>
+#include <tracer/lighttree.h>
 
 TRACER_NAMESPACE_BEGIN
 
@@ -112,6 +113,30 @@ public:
 
 	const Emitter* sampleEmitter(const float& sample, float &pdf) const;
 
+    /**
+     * \brief Sample a point on the emitters for next event estimation at
+     * a shading point
+     *
+     * With the light tree (the \c lightTree property, on by default) a
+     * triangle is selected in proportion to the power it likely delivers
+     * to ref, otherwise an emitter is selected uniformly.
+     *
+     * \param ref
+     *    The shading point
+     * \param sample
+     *    A uniformly distributed sample on [0,1] for the selection
+     * \param sample2
+     *    A uniformly distributed sample on [0,1]^2 for the point
+     * \param pdf
+     *    Return the density of the point per unit area, selection included
+     * \return the emitter, or nullptr if there is none to sample
+     */
+    const Emitter *sampleLight(const Point3f &ref, float sample, const Point2f &sample2,
+        Point3f &p, Frame &nFrame, float &pdf) const;
+
+    /// Density per unit area with which \ref sampleLight() for ref returns the emitter point its
+    float pdfLight(const Point3f &ref, const Intersection &its) const;
+
     /**
      * \brief Inherited from \ref TracerObject::activate()
      *
@@ -134,7 +159,9 @@ private:
     Sampler *m_sampler = nullptr;
     Camera *m_camera = nullptr;
     Accel *m_accel = nullptr;
-    DiscretePDF m_emitterpdf;
+    DiscreteAliasPDF m_emitterpdf;
+    LightTree m_lightTree;
+    bool m_uselighttree = true;
     bool m_isprogressive = false;
 };
 
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <tracer/equalarea.h>
+#include <tracer/bbox.h>
+#include <tracer/proplist.h>
+
+TRACER_NAMESPACE_BEGIN
+
+/**
+ * \brief Hashed guider state keys over quantized (position, normal)
+ *
+ * As in hashed radiance caches, a state is the cell of a uniform grid of
+ * cubes that contains a position, together with the equal-area bin of the
+ * surface normal, at one of several levels of detail, each twice as coarse
+ * as the previous one. The key is a hash of these coordinates, so storage
+ * only grows with the surfaces that are actually hit, and opposite faces
+ * of thin geometry get different states. Distinct states may collide on a
+ * key; with 31 bits this is rare and only merges two estimates.
+ *
+ * Guiders update a state at every level and read the finest level whose
+ * cell has at least \c lodVisits visits (see \ref lookup()).
+ *
+ * Properties: \c stateLevels (levels of detail, at most \ref MAX_LEVELS),
+ * \c normalResolution (normals fall in 2 * normalResolution^2 bins, 0
+ * ignores normals) and \c lodVisits.
+ */
+class StateHash {
+public:
+    StateHash(const PropertyList &props) {
+        m_levels = props.getInteger("stateLevels", 3);
+        m_normalResolution = props.getInteger("normalResolution", 2);
+        m_lodVisits = props.getInteger("lodVisits", 32);
+        if (m_levels < 1 || m_levels > MAX_LEVELS || m_normalResolution < 0 || m_lodVisits < 0)
+            throw TracerException("StateHash: stateLevels must be in [1, %d], normalResolution and lodVisits >= 0",
+                (int)MAX_LEVELS);
+    }
+
+    /// Use cubes of the size of the largest extent of box over resolution at the finest level
+    void init(const BoundingBox3f &box, int resolution) {
+        m_origin = box.min;
+        m_cellSize = (box.max - box.min).maxCoeff() / resolution;
+    }
+
+    /// Key of the state of a position and normal at a level of detail
+    int key(const Point3f &p, const Vector3f &n, int level) const {
+        float size = m_cellSize * (float)(1 << level);
+        int64_t x = (int64_t)std::floor((p.x() - m_origin.x()) / size),
+                y = (int64_t)std::floor((p.y() - m_origin.y()) / size),
+                z = (int64_t)std::floor((p.z() - m_origin.z()) / size);
+        int64_t nb = m_normalResolution > 0 ? EqualAreaMap::sphereBin(n, m_normalResolution) : 0;
+        /* The normal resolution is hashed too, so that snapshots taken with another one miss rather than alias */
+        uint64_t h = mix((uint64_t)x * 0x9E3779B97F4A7C15ULL);
+        h = mix(h ^ ((uint64_t)y * 0xC2B2AE3D27D4EB4FULL));
+        h = mix(h ^ ((uint64_t)z * 0x165667B19E3779F9ULL));
+        h = mix(h ^ ((uint64_t)nb << 32) ^ ((uint64_t)level << 56) ^ ((uint64_t)m_normalResolution << 48));
+        return (int)(h & 0x7fffffff);
+    }
+
+    /**
+     * \brief Key to read the state of a position and normal: the finest
+     * level with at least \c lodVisits visits, else the coarsest level that
+     * exists, else the finest level.
+     *
+     * \param visits
+     *    Returns the total visits of the cell with a key, or -1 if it does not exist
+     */
+    template <typename Visits> int lookup(const Point3f &p, const Vector3f &n, const Visits &visits) const {
+        int found = -1;
+        for (int level = 0; level < m_levels; level++) {
+            int k = key(p, n, level);
+            int64_t v = visits(k);
+            if (v >= m_lodVisits)
+                return k;
+            if (v >= 0)
+                found = k;
+        }
+        return found >= 0 ? found : key(p, n, 0);
+    }
+
+    int getLevels() const { return m_levels; }
+
+    std::string toString() const {
+        return tfm::format("StateHash[levels = %d, normalResolution = %d, lodVisits = %d]",
+            m_levels, m_normalResolution, m_lodVisits);
+    }
+
+    static const int MAX_LEVELS = 8;
+
+private:
+    /* Finalizer of splitmix64 */
+    static uint64_t mix(uint64_t h) {
+        h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        h = (h ^ (h >> 27)) * 0x94D049BB133111EBULL;
+        return h ^ (h >> 31);
+    }
+
+    int m_levels;
+    int m_normalResolution;
+    int m_lodVisits;
+    Point3f m_origin;
+    float m_cellSize = 1.0f;
+};
+
+TRACER_NAMESPACE_END
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <tracer/timer.h>
+#include <atomic>
+
+TRACER_NAMESPACE_BEGIN
+
+/**
+ * \brief Opt-in statistics of a Q-table guider
+ *
+ * Counters for updates, guided samples and time spent waiting on cell
+ * accessors are collected on the render threads with relaxed atomics, as
+ * are the traced paths and their vertices, which the guided integrators
+ * report through \ref Guider::getTelemetry().
+ * Per-cell statistics (visits, Q-values, entropy) are gathered by the guider
+ * between passes, when iterating its storage is safe, and a record is then
+ * written to a JSON (array of records) or CSV file, chosen by the extension.
+ */
+class GuiderTelemetry {
+public:
+    /// Measures the time until it goes out of scope as accessor wait time
+    class WaitTimer {
+    public:
+        WaitTimer(GuiderTelemetry *telemetry) : m_telemetry(telemetry) {
+            if (m_telemetry)
+                m_start = std::chrono::steady_clock::now();
+        }
+
+        ~WaitTimer() {
+            if (m_telemetry) {
+                auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now() - m_start).count();
+                m_telemetry->m_waitNs.fetch_add((uint64_t)ns, std::memory_order_relaxed);
+            }
+        }
+
+    private:
+        GuiderTelemetry *m_telemetry;
+        std::chrono::steady_clock::time_point m_start;
+    };
+
+    /**
+     * \param filename
+     *    Output file; ".csv" writes one row per record, anything else JSON
+     * \param interval
+     *    Minimum number of seconds between two records written by \ref due()
+     */
+    GuiderTelemetry(const std::string &filename, float interval);
+
+    void recordUpdate() { m_updates.fetch_add(1, std::memory_order_relaxed); }
+
+    /// Record the pdf of a guided direction
+    void recordSample(float pdf);
+
+    /// Record a path traced by a guided integrator, with its vertex count over all branches
+    void recordPath(int vertices) {
+        m_paths.fetch_add(1, std::memory_order_relaxed);
+        m_vertices.fetch_add((uint64_t)vertices, std::memory_order_relaxed);
+    }
+
+    /// Whether a periodic record should be written now
+    bool due() const { return m_sinceRecord.elapsed() >= m_interval * 1000.0; }
+
+    /// Start collecting per-cell statistics for the next record
+    void beginCells();
+
+    /// Add a cell with n decoded Q-values and its total visit count
+    void addCell(const float *q, int n, int64_t visits);
+
+    /**
+     * \brief Write a record with the counters since the last one and the
+     * cells added since \ref beginCells()
+     */
+    void record(const std::string &event, int pass, size_t memory);
+
+    const std::string &getFilename() const { return m_filename; }
+
+    static const int HISTOGRAM_BINS = 24;
+
+private:
+    static int histogramBin(double value, int offset);
+
+    std::string m_filename;
+    bool m_csv;
+    float m_interval;
+    Timer m_total, m_sinceRecord;
+    std::vector<std::string> m_records;
+
+    std::atomic<uint64_t> m_updates{0};
+    std::atomic<uint64_t> m_samples{0};
+    std::atomic<uint64_t> m_waitNs{0};
+    std::atomic<uint64_t> m_paths{0};
+    std::atomic<uint64_t> m_vertices{0};
+    /* Guided-sample pdfs, bin k counts pdfs in [2^(k - PDF_OFFSET), 2^(k + 1 - PDF_OFFSET)) */
+    std::atomic<uint64_t> m_pdfHistogram[HISTOGRAM_BINS];
+
+    size_t m_cells = 0;
+    double m_qSum = 0.0, m_qMax = 0.0, m_entropySum = 0.0;
+    /* Total visits per cell, bin k counts cells with visits in [2^(k - 1), 2^k), bin 0 unvisited cells */
+    uint64_t m_visitHistogram[HISTOGRAM_BINS];
+};
+
+TRACER_NAMESPACE_END
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <tracer/proplist.h>
+#include <atomic>
+
+TRACER_NAMESPACE_BEGIN
+
+/**
+ * \brief Acceptance policy for guider updates
+ *
+ * Once a bin has been visited more than \c thinVisits times, an update of
+ * it is accepted with probability thinVisits / visits, but never less than
+ * \c thinMinProbability, so learning slows down without stopping. An
+ * accepted update carries the importance weight 1 / probability: the
+ * guider blends it in as that many identical updates, which keeps the
+ * learned value unbiased in expectation. \c maxUpdateRate additionally caps
+ * the number of accepted updates per second over all threads: the updates
+ * left by the visit test are accepted with probability maxUpdateRate over
+ * their rate in the previous window, and weighted accordingly. A window
+ * lasts a second, or less once it has seen maxUpdateRate updates.
+ *
+ * Thinning is disabled unless \c thinVisits or \c maxUpdateRate is set.
+ */
+class UpdateThinning {
+public:
+    UpdateThinning(const PropertyList &props);
+
+    bool isEnabled() const { return m_visits > 0 || m_maxRate > 0; }
+
+    /**
+     * \brief Decide on an update of a bin with the given visit count
+     *
+     * \param u
+     *    A uniform [0, 1) sample
+     *
+     * \return the importance weight of the update, or 0 if it is rejected
+     */
+    float accept(int64_t visits, float u);
+
+    std::string toString() const;
+
+private:
+    /// Measure the rate of the window that is ending, and start the next one
+    void endWindow();
+
+    int64_t m_visits;
+    float m_minProbability;
+    float m_maxRate;
+    std::atomic<int64_t> m_windowStart{0};
+    std::atomic<int64_t> m_windowCount{0};
+    /* Acceptance probability that keeps the rate of the previous window below m_maxRate */
+    std::atomic<float> m_rateProbability{1.0f};
+    const int64_t WINDOW_MS = 1000;
+    const int64_t CLOCK_INTERVAL = 256;
+};
+
+TRACER_NAMESPACE_END
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <tracer/mesh.h>
+#include <tbb/enumerable_thread_specific.h>
+#include <tbb/mutex.h>
+#include <fstream>
+#include <atomic>
+#include <map>
+
+TRACER_NAMESPACE_BEGIN
+
+/**
+ * \brief One guider training transition, as stored in a transition log
+ *
+ * The origin and destination vertex of a path segment with their shading
+ * normals, and the indices of the meshes hit (which determine the BSDFs
+ * and emitters; the guiders evaluate emission at the destination from its
+ * mesh). The direction of the segment and the incident direction at the
+ * destination follow from the positions. Shading frames are rebuilt from
+ * the normals, as the acceleration structure does.
+ */
+struct TransitionRecord {
+    float origin[3], originNormal[3];
+    float dest[3], destNormal[3];
+    int32_t originMesh, destMesh;
+};
+
+/**
+ * \brief Streams the transitions of guided integrators to a log file
+ *
+ * Each thread fills its own buffer, which is appended to the file under a
+ * lock once it is full, so that recording barely slows down rendering.
+ * Records of different threads are interleaved in blocks.
+ */
+class TransitionRecorder {
+public:
+    /// Open the log; the scene gives the mesh indices
+    TransitionRecorder(const std::string &filename, const Scene *scene);
+
+    ~TransitionRecorder() { close(); }
+
+    /// Record the segment from origin to dest
+    void record(const Intersection &origin, const Intersection &dest);
+
+    /// Flush all buffers and close the file; not thread safe
+    void close();
+
+    const std::string &getFilename() const { return m_filename; }
+
+    /// Number of transitions recorded so far
+    size_t getCount() const { return m_count; }
+
+private:
+    void flush(std::vector<TransitionRecord> &buffer);
+
+    std::string m_filename;
+    std::ofstream m_file;
+    std::map<const Mesh *, int32_t> m_meshes;
+    tbb::enumerable_thread_specific<std::vector<TransitionRecord>> m_buffers;
+    tbb::mutex m_mutex;
+    std::atomic<size_t> m_count{0};
+};
+
+/**
+ * \brief Reads a transition log written by \ref TransitionRecorder
+ *
+ * The whole log is loaded into memory, 56 bytes per transition, so that
+ * training epochs replay it without touching the disk; a log of 100M
+ * transitions takes 5.6 GB of RAM.
+ */
+class TransitionLog {
+public:
+    /// Load the whole log into memory; the scene must be the one it was recorded in
+    TransitionLog(const std::string &filename, const Scene *scene);
+
+    size_t getCount() const { return m_records.size(); }
+
+    /// Rebuild the vertices of transition i
+    void get(size_t i, Intersection &origin, Intersection &dest) const;
+
+    const TransitionRecord &getRecord(size_t i) const { return m_records[i]; }
+
+private:
+    const Scene *m_scene;
+    std::vector<TransitionRecord> m_records;
+};
+
+TRACER_NAMESPACE_END
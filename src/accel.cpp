@@ -461,6 +461,7 @@ bool Accel::rayIntersect(const Ray3f &_ray, Intersection &its, bool shadowRay) c
 
         /* References to all relevant mesh buffers */
         const Mesh *mesh   = its.mesh;
+        its.face = f;
         const MatrixXf &V  = mesh->getVertexPositions();
         const MatrixXf &N  = mesh->getVertexNormals();
         const MatrixXf &UV = mesh->getVertexTexCoords();
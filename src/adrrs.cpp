@@ -0,0 +1,61 @@
+#include <tracer/adrrs.h>
+#include <tracer/sampler.h>
+
+TRACER_NAMESPACE_BEGIN
+
+AdjointRoulette::AdjointRoulette(const PropertyList &props) {
+    m_enabled = props.getBoolean("adrrs", false);
+    m_window = props.getFloat("adrrsWindow", 5.0f);
+    m_maxSplit = props.getInteger("adrrsMaxSplit", 8);
+    m_minSurvival = props.getFloat("adrrsMinSurvival", 0.05f);
+    if (m_window <= 1.0f || m_maxSplit < 1 || m_minSurvival <= 0.0f || m_minSurvival > 1.0f)
+        throw TracerException("AdjointRoulette: adrrsWindow must be > 1, adrrsMaxSplit >= 1, adrrsMinSurvival in (0, 1]");
+}
+
+Color3f AdjointRoulette::pixelEstimate(Guider *guider, const GuiderCell &cell, const Color3f &emitted, Sampler *sampler) const {
+    Color3f reflected;
+    if (!m_enabled || !guider->reflected(cell, sampler, reflected))
+        return Color3f(0.0f);
+    return emitted + reflected;
+}
+
+int AdjointRoulette::continuations(Guider *guider, const GuiderCell &cell, const Color3f &throughput, const Color3f &pixel,
+        int depth, bool allowSplit, Sampler *sampler, float &weight) const {
+    weight = 1.0f;
+    Color3f reflected;
+    float estimate = pixel.sum();
+    if (!m_enabled || estimate <= 0.0f || !guider->reflected(cell, sampler, reflected)) {
+        if (depth <= 2)
+            return 1;
+        if (sampler->next1D() >= 0.95f)
+            return 0;
+        weight = 1.0f / 0.95f;
+        return 1;
+    }
+
+    /* Weight window of relative width m_window centered (in the mean) on 1 */
+    float ratio = (throughput * reflected).sum() / estimate;
+    float lower = 2.0f / (1.0f + m_window), upper = m_window * lower;
+    if (ratio < lower) {
+        float survival = std::max(ratio / lower, m_minSurvival);
+        if (sampler->next1D() >= survival)
+            return 0;
+        weight = 1.0f / survival;
+        return 1;
+    }
+    if (ratio > upper && allowSplit) {
+        int count = std::min(m_maxSplit, (int)(ratio / upper));
+        weight = 1.0f / count;
+        return count;
+    }
+    return 1;
+}
+
+std::string AdjointRoulette::toString() const {
+    if (!m_enabled)
+        return "fixed";
+    return tfm::format("AdjointRoulette[window = %f, maxSplit = %d, minSurvival = %f]",
+        m_window, m_maxSplit, m_minSurvival);
+}
+
+TRACER_NAMESPACE_END
@@ -0,0 +1,131 @@
+#include <tracer/object.h>
+#include <tracer/dpdf.h>
+#include <pcg32.h>
+#include <hypothesis.h>
+#include <memory>
+
+TRACER_NAMESPACE_BEGIN
+
+/**
+ * \brief Statistical test of the alias table: the entries that \ref
+ * DiscreteAliasPDF::sample() draws must follow the normalized
+ * probabilities, with which it must also return them, and the samples
+ * that \ref DiscreteAliasPDF::sampleReuse() hands back must be uniformly
+ * distributed.
+ *
+ * Each test builds a distribution of \c entries random values spanning
+ * a few orders of magnitude, a tenth of them zero, like the face areas of
+ * an emitter.
+ */
+class DiscretePDFChiSquareTest : public TracerObject {
+public:
+    DiscretePDFChiSquareTest(const PropertyList &propList) {
+        m_significanceLevel = propList.getFloat("significanceLevel", 0.01f);
+        /* Cells expected to get fewer samples are merged, see ChiSquareTest */
+        m_minExpFrequency = propList.getInteger("minExpFrequency", 5);
+        m_entries = propList.getInteger("entries", 1000);
+        /* Number of samples per test (-1: 1000 per entry) */
+        m_sampleCount = propList.getInteger("sampleCount", -1);
+        m_testCount = propList.getInteger("testCount", 5);
+        /* Cells of the histogram of reused samples */
+        m_reuseResolution = propList.getInteger("reuseResolution", 100);
+        if (m_entries < 2 || m_reuseResolution < 1)
+            throw TracerException("DiscretePDFChiSquareTest: entries must be >= 2 and reuseResolution >= 1");
+        if (m_sampleCount < 0)
+            m_sampleCount = 1000 * m_entries;
+    }
+
+    /// Execute the chi-square tests
+    void activate() {
+        int passed = 0, total = 0;
+        pcg32 random;
+        std::unique_ptr<double[]> obsFrequencies(new double[m_entries]), expFrequencies(new double[m_entries]);
+        std::unique_ptr<double[]> obsReuse(new double[m_reuseResolution]), expReuse(new double[m_reuseResolution]);
+
+        for (int l = 0; l < m_testCount; ++l) {
+            memset(obsFrequencies.get(), 0, m_entries * sizeof(double));
+            memset(obsReuse.get(), 0, m_reuseResolution * sizeof(double));
+            for (int i = 0; i < m_reuseResolution; ++i)
+                expReuse[i] = (double) m_sampleCount / m_reuseResolution;
+
+            /* The first entry is never zero, so that there is a table to sample */
+            DiscreteAliasPDF dpdf(m_entries);
+            for (int i = 0; i < m_entries; ++i)
+                dpdf.append(i > 0 && random.nextFloat() < 0.1f ? 0.0f : std::exp(4.0f * random.nextFloat()));
+            dpdf.normalize();
+
+            cout << "------------------------------------------------------" << endl;
+            cout << "Testing an alias table of " << m_entries << " entries: accumulating " << m_sampleCount
+                 << " samples .. ";
+            cout.flush();
+
+            /* Samples returned with a probability other than that of their entry */
+            int mismatches = 0;
+            for (int i = 0; i < m_sampleCount; ++i) {
+                float pdf, sample = random.nextFloat();
+                size_t index = dpdf.sample(sample, pdf);
+                if (pdf != dpdf[index])
+                    mismatches++;
+                obsFrequencies[index] += 1;
+
+                dpdf.sampleReuse(sample);
+                int cell = std::min((int) (sample * m_reuseResolution), m_reuseResolution - 1);
+                obsReuse[cell] += 1;
+            }
+            cout << "done." << endl;
+
+            for (int i = 0; i < m_entries; ++i)
+                expFrequencies[i] = dpdf[i] * (double) m_sampleCount;
+
+            hypothesis::chi2_dump(1, m_entries, obsFrequencies.get(), expFrequencies.get(),
+                tfm::format("chi2test_dpdf_%i.m", total + 1));
+
+            /* The entries, then the reused samples */
+            std::pair<bool, std::string> entries =
+                hypothesis::chi2_test(m_entries, obsFrequencies.get(), expFrequencies.get(),
+                    m_sampleCount, m_minExpFrequency, m_significanceLevel, 2 * m_testCount);
+            std::pair<bool, std::string> reuse =
+                hypothesis::chi2_test(m_reuseResolution, obsReuse.get(), expReuse.get(),
+                    m_sampleCount, m_minExpFrequency, m_significanceLevel, 2 * m_testCount);
+            cout << "Entries: " << entries.second << endl;
+            cout << "Reused samples: " << reuse.second << endl;
+            if (mismatches > 0)
+                cout << mismatches << " samples returned a probability other than that of their entry." << endl;
+
+            total += 2;
+            passed += (entries.first && mismatches == 0) + reuse.first;
+        }
+
+        cout << "Passed " << passed << "/" << total << " tests." << endl;
+    }
+
+    std::string toString() const {
+        return tfm::format("DiscretePDFChiSquareTest[\n"
+            "  entries = %i,\n"
+            "  minExpFrequency = %i,\n"
+            "  sampleCount = %i,\n"
+            "  testCount = %i,\n"
+            "  reuseResolution = %i,\n"
+            "  significanceLevel = %f\n"
+            "]",
+            m_entries,
+            m_minExpFrequency,
+            m_sampleCount,
+            m_testCount,
+            m_reuseResolution,
+            m_significanceLevel
+        );
+    }
+
+    EClassType getClassType() const { return ETest; }
+private:
+    int m_entries;
+    int m_minExpFrequency;
+    int m_sampleCount;
+    int m_testCount;
+    int m_reuseResolution;
+    float m_significanceLevel;
+};
+
+TRACER_REGISTER_CLASS(DiscretePDFChiSquareTest, "chi2test_dpdf");
+TRACER_NAMESPACE_END
@@ -0,0 +1,148 @@
+#include <tracer/lighttree.h>
+#include <pcg32.h>
+#include <hypothesis.h>
+#include <memory>
+
+TRACER_NAMESPACE_BEGIN
+
+/**
+ * \brief Statistical test of the light tree: the triangles that \ref
+ * LightTree::sample() selects for a shading point must follow the
+ * probabilities of \ref LightTree::pdf(), and the probability it returns
+ * with each selection must be that of \ref LightTree::pdf().
+ *
+ * The tree is built over the emitting meshes given as children, and
+ * tested at \c testCount random points in a box three times the size of
+ * their bounds. The contingency table has one cell per triangle.
+ */
+class LightTreeChiSquareTest : public TracerObject {
+public:
+    LightTreeChiSquareTest(const PropertyList &propList) {
+        m_significanceLevel = propList.getFloat("significanceLevel", 0.01f);
+        /* Cells expected to get fewer samples are merged, see ChiSquareTest */
+        m_minExpFrequency = propList.getInteger("minExpFrequency", 5);
+        /* Number of samples per test point (-1: 1000 per triangle) */
+        m_sampleCount = propList.getInteger("sampleCount", -1);
+        m_testCount = propList.getInteger("testCount", 5);
+    }
+
+    virtual ~LightTreeChiSquareTest() {
+        for (auto mesh : m_meshes)
+            delete mesh;
+    }
+
+    void addChild(TracerObject *obj) {
+        switch (obj->getClassType()) {
+            case EMesh:
+                m_meshes.push_back(static_cast<Mesh *>(obj));
+                break;
+
+            default:
+                throw TracerException("LightTreeChiSquareTest::addChild(<%s>) is not supported!",
+                    classTypeName(obj->getClassType()));
+        }
+    }
+
+    /// Execute the chi-square test
+    void activate() {
+        LightTree tree;
+        tree.build(m_meshes);
+
+        /* Cell of the first triangle of each emitting mesh */
+        std::unordered_map<const Mesh *, int> offsets;
+        BoundingBox3f bounds;
+        int cells = 0;
+        for (const Mesh *mesh : m_meshes) {
+            if (!mesh->isEmitter())
+                continue;
+            offsets[mesh] = cells;
+            cells += (int) mesh->getTriangleCount();
+            bounds.expandBy(mesh->getBoundingBox());
+        }
+        if (cells == 0)
+            throw TracerException("LightTreeChiSquareTest: no emitting mesh to test");
+        int sampleCount = m_sampleCount < 0 ? 1000 * cells : m_sampleCount;
+        Vector3f extent = bounds.getExtents();
+
+        int passed = 0, total = 0;
+        pcg32 random;
+        std::unique_ptr<double[]> obsFrequencies(new double[cells]);
+        std::unique_ptr<double[]> expFrequencies(new double[cells]);
+
+        cout << "Testing: " << tree.toString() << endl;
+        for (int l = 0; l < m_testCount; ++l) {
+            memset(obsFrequencies.get(), 0, cells * sizeof(double));
+            memset(expFrequencies.get(), 0, cells * sizeof(double));
+            ++total;
+
+            Point3f ref;
+            for (int c = 0; c < 3; c++)
+                ref[c] = bounds.min[c] + (3.0f * random.nextFloat() - 1.0f) * extent[c];
+
+            cout << "------------------------------------------------------" << endl;
+            cout << "Shading point " << ref.toString() << ": accumulating " << sampleCount
+                 << " samples into " << cells << " cells .. ";
+            cout.flush();
+
+            /* Selections whose probability disagrees with pdf() */
+            int mismatches = 0;
+            for (int i = 0; i < sampleCount; ++i) {
+                uint32_t face;
+                float pdf;
+                const Mesh *mesh = tree.sample(ref, random.nextFloat(), face, pdf);
+                if (!mesh)
+                    continue;
+                float expected = tree.pdf(ref, mesh, face);
+                if (std::abs(pdf - expected) > 1e-3f * expected)
+                    mismatches++;
+                obsFrequencies[offsets[mesh] + face] += 1;
+            }
+            cout << "done." << endl;
+
+            for (const auto &entry : offsets) {
+                for (uint32_t face = 0; face < entry.first->getTriangleCount(); face++)
+                    expFrequencies[entry.second + face] = tree.pdf(ref, entry.first, face) * (double) sampleCount;
+            }
+
+            hypothesis::chi2_dump(1, cells, obsFrequencies.get(), expFrequencies.get(),
+                tfm::format("chi2test_lighttree_%i.m", total));
+
+            std::pair<bool, std::string> result =
+                hypothesis::chi2_test(cells, obsFrequencies.get(), expFrequencies.get(),
+                    sampleCount, m_minExpFrequency, m_significanceLevel, m_testCount);
+            cout << result.second << endl;
+            if (mismatches > 0)
+                cout << mismatches << " selections returned a probability other than pdf()." << endl;
+
+            if (result.first && mismatches == 0)
+                ++passed;
+        }
+
+        cout << "Passed " << passed << "/" << total << " tests." << endl;
+    }
+
+    std::string toString() const {
+        return tfm::format("LightTreeChiSquareTest[\n"
+            "  minExpFrequency = %i,\n"
+            "  sampleCount = %i,\n"
+            "  testCount = %i,\n"
+            "  significanceLevel = %f\n"
+            "]",
+            m_minExpFrequency,
+            m_sampleCount,
+            m_testCount,
+            m_significanceLevel
+        );
+    }
+
+    EClassType getClassType() const { return ETest; }
+private:
+    int m_minExpFrequency;
+    int m_sampleCount;
+    int m_testCount;
+    float m_significanceLevel;
+    std::vector<Mesh *> m_meshes;
+};
+
+TRACER_REGISTER_CLASS(LightTreeChiSquareTest, "chi2test_lighttree");
+TRACER_NAMESPACE_END
@@ -17,6 +17,7 @@
 */
 
 #include <tracer/bsdf.h>
+#include <tracer/guider.h>
 #include <tracer/warp.h>
 #include <pcg32.h>
 #include <hypothesis.h>
@@ -66,6 +67,13 @@ public:
            how many tests will be executed per BSDF */
         m_testCount = propList.getInteger("testCount", 5);
 
+        /* Test the product of each BSDF with random guider weights over
+           productResolution^2 hemisphere bins (see BSDFProduct) instead
+           of the BSDF itself; 0 tests the BSDF */
+        m_productResolution = propList.getInteger("productResolution", 0);
+        if (m_productResolution > 0)
+            m_product.init(m_productResolution, propList.getInteger("productSubdivision", 2));
+
         m_phiResolution = 2 * m_cosThetaResolution;
 
         if (m_sampleCount < 0) // ~5K samples per bin
@@ -115,6 +123,15 @@ public:
                 sincosf(2.0f * M_PI * random.nextFloat(), &sinPhi, &cosPhi);
                 Vector3f wi(cosPhi * sinTheta, sinPhi * sinTheta, cosTheta);
 
+                /* Random guider weights, a few of them zero */
+                std::vector<float> products(m_productResolution * m_productResolution);
+                float productTotal = 0.0f;
+                if (m_productResolution > 0) {
+                    for (float &w : products)
+                        w = random.nextFloat() < 0.2f ? 0.0f : random.nextFloat();
+                    productTotal = m_product.multiply(bsdf, wi, products.data());
+                }
+
                 cout << "Accumulating " << m_sampleCount << " samples into a " << m_cosThetaResolution
                      << "x" << m_phiResolution << " contingency table .. ";
                 cout.flush();
@@ -124,10 +141,18 @@ public:
                 BSDFQueryRecord bRec(wi);
                 for (int i=0; i<m_sampleCount; ++i) {
                     Point2f sample(random.nextFloat(), random.nextFloat());
-                    Color3f result = bsdf->sample(bRec, sample);
+                    if (m_productResolution > 0) {
+                        float pdf;
+                        bRec.wo = m_product.sample(products.data(), productTotal, sample, pdf);
+                        if (pdf == 0)
+                            continue;
+                    }
+                    else {
+                        Color3f result = bsdf->sample(bRec, sample);
 
-                    if ((result.array() == 0).all())
-                        continue;
+                        if ((result.array() == 0).all())
+                            continue;
+                    }
 
                     int cosThetaBin = std::min(std::max(0, (int) std::floor((bRec.wo.z()*0.5f+0.5f)
                             * m_cosThetaResolution)), m_cosThetaResolution-1);
@@ -162,6 +187,8 @@ public:
                                         (float) (sinTheta * sinPhi),
                                         (float) cosTheta);
 
+                            if (m_productResolution > 0)
+                                return m_product.pdf(products.data(), productTotal, wo);
                             BSDFQueryRecord bRec(wi, wo, ESolidAngle);
                             return bsdf->pdf(bRec);
                         };
@@ -201,6 +228,7 @@ public:
             "  minExpFrequency = %i,\n"
             "  sampleCount = %i,\n"
             "  testCount = %i,\n"
+            "  productResolution = %i,\n"
             "  significanceLevel = %f\n"
             "]",
             m_cosThetaResolution,
@@ -208,6 +236,7 @@ public:
             m_minExpFrequency,
             m_sampleCount,
             m_testCount,
+            m_productResolution,
             m_significanceLevel
         );
     }
@@ -219,6 +248,8 @@ private:
     int m_minExpFrequency;
     int m_sampleCount;
     int m_testCount;
+    int m_productResolution;
+    BSDFProduct m_product;
     float m_significanceLevel;
     std::vector<BSDF *> m_bsdfs;
 };
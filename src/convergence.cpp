@@ -0,0 +1,72 @@
+#include <tracer/convergence.h>
+
+TRACER_NAMESPACE_BEGIN
+
+ConvergenceMonitor::ConvergenceMonitor(const PropertyList &props) {
+    m_threshold = props.getFloat("convergenceThreshold", 0.0f);
+    m_patience = props.getInteger("convergencePatience", 2);
+    m_minPasses = props.getInteger("convergenceMinPasses", 3);
+    if (m_threshold < 0.0f || m_patience < 1 || m_minPasses < 1)
+        throw TracerException("ConvergenceMonitor: convergenceThreshold must be >= 0, convergencePatience and convergenceMinPasses >= 1");
+}
+
+void ConvergenceMonitor::beginCells() {
+    m_current.clear();
+    m_change = 0.0;
+    m_weight = 0.0;
+}
+
+void ConvergenceMonitor::addCell(int key, const float *q, int n, int64_t visits) {
+    float total = 0.0f;
+    for (int i = 0; i < n; i++)
+        total += q[i];
+    if (total <= 0.0f)
+        return;
+    std::vector<float> &dist = m_current[key];
+    dist.resize(n);
+    for (int i = 0; i < n; i++)
+        dist[i] = q[i] / total;
+    if (visits <= 0)
+        return;
+
+    float change = 1.0f;
+    auto it = m_previous.find(key);
+    if (it != m_previous.end() && (int)it->second.size() == n) {
+        change = 0.0f;
+        for (int i = 0; i < n; i++)
+            change += std::abs(dist[i] - it->second[i]);
+        change *= 0.5f;
+    }
+    m_change += (double)visits * change;
+    m_weight += (double)visits;
+}
+
+float ConvergenceMonitor::endCells(const std::string &name) {
+    m_previous.swap(m_current);
+    m_current.clear();
+    float metric = m_weight > 0 ? (float)(m_change / m_weight) : 0.0f;
+    m_curve.push_back(metric);
+    if (metric < m_threshold)
+        m_below++;
+    else
+        m_below = 0;
+    if (!m_converged && m_below >= m_patience && (int)m_curve.size() >= m_minPasses) {
+        m_converged = true;
+        m_previous.clear();
+    }
+    cout << tfm::format("%s: pass %d, distribution change %f%s", name, m_curve.size(), metric,
+        m_converged ? " (converged, training stops)" : "") << endl;
+    return metric;
+}
+
+std::string ConvergenceMonitor::toString() const {
+    if (!isEnabled())
+        return "none";
+    std::string curve;
+    for (size_t i = 0; i < m_curve.size(); i++)
+        curve += tfm::format(i == 0 ? "%.4f" : ", %.4f", m_curve[i]);
+    return tfm::format("ConvergenceMonitor[threshold = %f, patience = %d, minPasses = %d, curve = {%s}%s]",
+        m_threshold, m_patience, m_minPasses, curve, m_converged ? ", converged" : "");
+}
+
+TRACER_NAMESPACE_END
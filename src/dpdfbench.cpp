@@ -0,0 +1,62 @@
+/*
+    Compares the cost of sampling a discrete distribution by binary search
+    over its CDF (DiscretePDF) and with an alias table (DiscreteAliasPDF),
+    for distributions the size of the face area distributions of large
+    emitting meshes.
+*/
+
+#include <tracer/dpdf.h>
+#include <tracer/timer.h>
+#include <pcg32.h>
+
+using namespace tracer;
+
+/* Keeps the sampling loops from being optimized away */
+static volatile float sink;
+
+/// Time count reused samples of a distribution, in milliseconds
+template <typename PDF> static double run(const PDF &pdf, int count) {
+    pcg32 rng;
+    Timer timer;
+    float sum = 0.0f;
+    for (int i = 0; i < count; i++) {
+        float sample = rng.nextFloat();
+        sum += pdf.sampleReuse(sample) + sample;
+    }
+    sink = sum;
+    return timer.elapsed();
+}
+
+int main(int argc, char **argv) {
+    int count = 10000000;
+    if (argc > 1)
+        count = std::atoi(argv[1]);
+    if (count <= 0) {
+        cerr << "Syntax: " << argv[0] << " [<samples per distribution>]" << endl;
+        return -1;
+    }
+
+    cout << tfm::format("%10s %12s %12s %12s %9s", "faces", "build alias", "cdf", "alias", "speedup") << endl;
+    for (int faces : { 1000, 100000, 1000000, 4000000 }) {
+        /* Triangle areas of a tessellated surface vary over a few orders of magnitude */
+        pcg32 rng;
+        rng.seed(faces);
+        DiscretePDF cdf(faces);
+        std::vector<float> areas(faces);
+        for (int i = 0; i < faces; i++) {
+            areas[i] = std::exp(4.0f * rng.nextFloat());
+            cdf.append(areas[i]);
+        }
+        cdf.normalize();
+        Timer timer;
+        DiscreteAliasPDF alias;
+        alias.assign(std::move(areas));
+        alias.normalize();
+        double build = timer.elapsed();
+
+        double tcdf = run(cdf, count), talias = run(alias, count);
+        cout << tfm::format("%10d %10.0fms %10.0fms %10.0fms %8.1fx", faces, build, tcdf, talias,
+            tcdf / std::max(talias, 1.0)) << endl;
+    }
+    return 0;
+}
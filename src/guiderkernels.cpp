@@ -0,0 +1,96 @@
+#include <tracer/guiderkernels.h>
+
+TRACER_NAMESPACE_BEGIN
+
+/* A = 0 instantiates the generic loops, which read the resolution at run time */
+template <int A> struct BinLoops {
+    static int resolution(int runtime) { return A > 0 ? A : runtime; }
+
+    static float sum(const float *weights, int res) {
+        const int n = resolution(res) * resolution(res);
+        float total = 0.0f;
+        for (int i = 0; i < n; i++)
+            total += weights[i];
+        return total;
+    }
+
+    static int select(const float *weights, int res, float t, float &acc) {
+        const int a = resolution(res), n = a * a;
+        acc = 0.0f;
+        if (A == 0) {
+            int b = 0;
+            for (; b < n - 1; b++) {
+                if (t < acc + weights[b])
+                    break;
+                acc += weights[b];
+            }
+            return b;
+        }
+        /* Row sums vectorize; the scalar search then only visits 2A entries */
+        float rows[A > 0 ? A : 1];
+        for (int i = 0; i < a; i++) {
+            float s = 0.0f;
+            for (int j = 0; j < a; j++)
+                s += weights[i * a + j];
+            rows[i] = s;
+        }
+        int i = 0;
+        for (; i < a - 1; i++) {
+            if (t < acc + rows[i])
+                break;
+            acc += rows[i];
+        }
+        int j = 0;
+        for (; j < a - 1; j++) {
+            if (t < acc + weights[i * a + j])
+                break;
+            acc += weights[i * a + j];
+        }
+        return i * a + j;
+    }
+
+    static void fill(float *map, float value, int res) {
+        const int n = 2 * resolution(res) * resolution(res);
+        for (int i = 0; i < n; i++)
+            map[i] = value;
+    }
+
+    static void add(float *map, float value, int res) {
+        const int n = 2 * resolution(res) * resolution(res);
+        for (int i = 0; i < n; i++)
+            map[i] += value;
+    }
+
+    static float gather(const Frame &frame, const Vector3f *centers, const float *map, float *weights, int res) {
+        const int a = resolution(res), n = a * a;
+        int bins[A > 0 ? A * A : 1];
+        int *idx = A > 0 ? bins : new int[n];
+        for (int b = 0; b < n; b++)
+            idx[b] = EqualAreaMap::sphereBin(frame.toWorld(centers[b]), a);
+        float total = 0.0f;
+        for (int b = 0; b < n; b++) {
+            weights[b] = map[idx[b]];
+            total += weights[b];
+        }
+        if (A == 0)
+            delete[] idx;
+        return total;
+    }
+
+    static const GuiderKernels &kernels() {
+        static const GuiderKernels k = { &sum, &select, &fill, &add, &gather };
+        return k;
+    }
+};
+
+const GuiderKernels &GuiderKernels::get(int resolution) {
+    switch (resolution) {
+        case 4:  return BinLoops<4>::kernels();
+        case 8:  return BinLoops<8>::kernels();
+        case 16: return BinLoops<16>::kernels();
+        case 32: return BinLoops<32>::kernels();
+        default: return BinLoops<0>::kernels();
+    }
+}
+
+TRACER_NAMESPACE_END
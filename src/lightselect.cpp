@@ -0,0 +1,181 @@
+#include <tracer/lightselect.h>
+#include <tracer/scene.h>
+#include <tracer/emitter.h>
+
+TRACER_NAMESPACE_BEGIN
+
+LightSelector::LightSelector(const PropertyList &props) {
+    std::string mode = props.getString("lightSelection", "uniform");
+    if (mode == "uniform")
+        m_enabled = false;
+    else if (mode == "learned")
+        m_enabled = true;
+    else
+        throw TracerException("LightSelector: unknown mode \"%s\"", mode);
+    m_floor = props.getFloat("lightSelectionFloor", 0.2f);
+    m_rate = props.getFloat("lightSelectionRate", 0.05f);
+    m_resolution = props.getInteger("lightSelectionResolution", 32);
+    if (m_floor <= 0.0f || m_floor > 1.0f || m_rate <= 0.0f || m_rate > 1.0f || m_resolution < 1)
+        throw TracerException("LightSelector: lightSelectionFloor and lightSelectionRate must be in (0, 1], "
+            "lightSelectionResolution >= 1");
+}
+
+void LightSelector::init(const Scene *scene) {
+    const std::vector<Emitter *> &emitters = scene->getEmitters();
+    m_indices.clear();
+    for (size_t i = 0; i < emitters.size(); i++)
+        m_indices[emitters[i]] = (int)i;
+    const BoundingBox3f &box = scene->getBoundingBox();
+    m_origin = box.min;
+    m_cellSize = std::max((box.max - box.min).maxCoeff() / m_resolution, Epsilon);
+    m_states.clear();
+    m_samples.clear();
+}
+
+int64_t LightSelector::key(const GuiderCell &cell) const {
+    if (cell.block >= 0)
+        return cell.block;
+    /* Grid cells come after the range of guider cells */
+    int64_t x = (int64_t)std::floor((cell.its.p.x() - m_origin.x()) / m_cellSize),
+            y = (int64_t)std::floor((cell.its.p.y() - m_origin.y()) / m_cellSize),
+            z = (int64_t)std::floor((cell.its.p.z() - m_origin.z()) / m_cellSize);
+    int64_t r = m_resolution + 1;
+    x = std::min(std::max(x, (int64_t)0), r - 1);
+    y = std::min(std::max(y, (int64_t)0), r - 1);
+    z = std::min(std::max(z, (int64_t)0), r - 1);
+    return (int64_t(1) << 32) + (x * r + y) * r + z;
+}
+
+float LightSelector::probability(const State &state, int i) const {
+    float uniform = 1.0f / state.values.size();
+    if (state.total <= 0.0f)
+        return uniform;
+    return m_floor * uniform + (1.0f - m_floor) * state.values[i] / state.total;
+}
+
+float LightSelector::probability(int64_t key, int i) const {
+    auto it = m_states.find(key);
+    return it == m_states.end() ? 1.0f / m_indices.size() : probability(it->second, i);
+}
+
+const Emitter *LightSelector::sample(const Scene *scene, const GuiderCell &cell, float sample, float &pdf) const {
+    if (!m_enabled)
+        return scene->sampleEmitter(sample, pdf);
+    const std::vector<Emitter *> &emitters = scene->getEmitters();
+    if (emitters.size() == 0)
+        return nullptr;
+    auto it = m_states.find(key(cell));
+    if (it == m_states.end())
+        return scene->sampleEmitter(sample, pdf);
+    const State &state = it->second;
+    int n = (int)emitters.size();
+    for (int i = 0; i < n - 1; i++) {
+        pdf = probability(state, i);
+        if (sample < pdf)
+            return emitters[i];
+        sample -= pdf;
+    }
+    pdf = probability(state, n - 1);
+    return emitters[n - 1];
+}
+
+float LightSelector::pdf(const Scene *scene, const GuiderCell &cell, const Emitter *emitter) const {
+    size_t n = scene->getEmitters().size();
+    if (n == 0)
+        return 0.0f;
+    if (!m_enabled)
+        return 1.0f / n;
+    auto it = m_indices.find(emitter);
+    return it == m_indices.end() ? 0.0f : probability(key(cell), it->second);
+}
+
+const Emitter *LightSelector::samplePosition(const Scene *scene, const GuiderCell &cell, float sample,
+        const Point2f &sample2, Point3f &p, Frame &nFrame, float &pdf) const {
+    if (!m_enabled)
+        return scene->sampleLight(cell.its.p, sample, sample2, p, nFrame, pdf);
+    float emitter_pdf, surface_pdf;
+    const Emitter *emitter = this->sample(scene, cell, sample, emitter_pdf);
+    if (!emitter)
+        return nullptr;
+    emitter->sample(cell.its.p, sample2, p, nFrame, surface_pdf);
+    pdf = emitter_pdf * surface_pdf;
+    return emitter;
+}
+
+float LightSelector::pdfPosition(const Scene *scene, const GuiderCell &cell, const Intersection &its) const {
+    if (!m_enabled)
+        return scene->pdfLight(cell.its.p, its);
+    if (!its.mesh->isEmitter())
+        return 0.0f;
+    const Emitter *emitter = its.mesh->getEmitter();
+    return pdf(scene, cell, emitter) * emitter->pdf(its.p);
+}
+
+void LightSelector::update(const GuiderCell &cell, const Emitter *emitter, const Color3f &estimate) const {
+    auto it = m_indices.find(emitter);
+    if (!m_enabled || it == m_indices.end())
+        return;
+    float value = estimate.isValid() ? estimate.sum() : 0.0f;
+    int64_t k = key(cell);
+    int i = it->second;
+    /* The contribution of the emitter is the estimate times the probability of selecting it */
+    value *= probability(k, i);
+    Samples &samples = m_samples.local()[k];
+    if (samples.sums.empty()) {
+        samples.sums.assign(m_indices.size(), 0.0f);
+        samples.counts.assign(m_indices.size(), 0);
+    }
+    samples.sums[i] += std::max(value, 0.0f);
+    samples.counts[i]++;
+}
+
+void LightSelector::endPass() {
+    if (!m_enabled)
+        return;
+    /* Gather the samples of all threads, then blend the mean of the pass in once per state */
+    SampleMap pass;
+    for (SampleMap &samples : m_samples) {
+        for (auto &entry : samples) {
+            Samples &merged = pass[entry.first];
+            if (merged.sums.empty()) {
+                merged = std::move(entry.second);
+                continue;
+            }
+            for (size_t i = 0; i < merged.sums.size(); i++) {
+                merged.sums[i] += entry.second.sums[i];
+                merged.counts[i] += entry.second.counts[i];
+            }
+        }
+        samples.clear();
+    }
+    for (const auto &entry : pass) {
+        State &state = m_states[entry.first];
+        if (state.values.empty()) {
+            state.values.assign(m_indices.size(), 0.0f);
+            state.counts.assign(m_indices.size(), 0);
+        }
+        const Samples &samples = entry.second;
+        for (size_t i = 0; i < state.values.size(); i++) {
+            uint32_t count = samples.counts[i];
+            if (count == 0)
+                continue;
+            state.counts[i] += count;
+            /* The sample mean while it moves faster than blending each sample at lightSelectionRate would */
+            float rate = std::max((float)count / state.counts[i], 1.0f - std::pow(1.0f - m_rate, (float)count));
+            state.values[i] += rate * (samples.sums[i] / count - state.values[i]);
+        }
+        /* Summed anew rather than adjusted, so that the probabilities keep summing to one */
+        state.total = 0.0f;
+        for (float v : state.values)
+            state.total += v;
+    }
+}
+
+std::string LightSelector::toString() const {
+    if (!m_enabled)
+        return "uniform";
+    return tfm::format("LightSelector[floor = %f, rate = %f, resolution = %d]",
+        m_floor, m_rate, m_resolution);
+}
+
+TRACER_NAMESPACE_END
@@ -0,0 +1,188 @@
+#include <tracer/lighttree.h>
+#include <tracer/emitter.h>
+#include <Eigen/Geometry>
+
+TRACER_NAMESPACE_BEGIN
+
+void LightTree::build(const std::vector<Mesh *> &meshes) {
+    m_nodes.clear();
+    m_triangles.clear();
+    m_leaves.clear();
+    m_offsets.clear();
+    for (const Mesh *mesh : meshes) {
+        if (!mesh->isEmitter())
+            continue;
+        m_offsets[mesh] = (uint32_t) m_leaves.size();
+        m_leaves.resize(m_leaves.size() + mesh->getTriangleCount(), (uint32_t) -1);
+        const MatrixXf &V = mesh->getVertexPositions(), &N = mesh->getVertexNormals();
+        const MatrixXu &F = mesh->getIndices();
+        for (uint32_t i = 0; i < mesh->getTriangleCount(); i++) {
+            Triangle tri;
+            tri.mesh = mesh;
+            tri.face = i;
+            tri.bbox = mesh->getBoundingBox(i);
+            tri.centroid = mesh->getCentroid(i);
+            const Point3f p0 = V.col(F(0, i)), p1 = V.col(F(1, i)), p2 = V.col(F(2, i));
+            Vector3f n = (p1 - p0).cross(p2 - p0);
+            if (n.squaredNorm() == 0.0f)
+                continue;
+            tri.axis = n.normalized();
+            /* Sampled points take interpolated normals, which lie in the cone of the vertex normals */
+            tri.spread = 0.0f;
+            for (int k = 0; k < 3 && N.cols() > 0; k++) {
+                Vector3f vn = Vector3f(N.col(F(k, i))).normalized();
+                tri.spread = std::max(tri.spread, std::acos(clamp(tri.axis.dot(vn), -1.0f, 1.0f)));
+            }
+            /* Radiance along the normal, as area lights emit uniformly over their front side */
+            Color3f radiance = mesh->getEmitter()->getRadiance(tri.centroid, Vector3f(0.0f, 0.0f, 1.0f));
+            tri.power = radiance.sum() * mesh->surfaceArea(i);
+            if (tri.power > 0.0f)
+                m_triangles.push_back(tri);
+        }
+    }
+    if (m_triangles.empty())
+        return;
+    m_nodes.reserve(2 * m_triangles.size() - 1);
+    buildNode(0, (uint32_t) m_triangles.size(), (uint32_t) -1);
+    for (uint32_t i = 0; i < m_nodes.size(); i++) {
+        if (m_nodes[i].leaf) {
+            const Triangle &tri = m_triangles[m_nodes[i].index];
+            m_leaves[m_offsets[tri.mesh] + tri.face] = i;
+        }
+    }
+}
+
+uint32_t LightTree::buildNode(uint32_t begin, uint32_t end, uint32_t parent) {
+    uint32_t index = (uint32_t) m_nodes.size();
+    m_nodes.emplace_back();
+    m_nodes[index].parent = parent;
+    if (end - begin == 1) {
+        const Triangle &tri = m_triangles[begin];
+        Node &node = m_nodes[index];
+        node.bbox = tri.bbox;
+        node.axis = tri.axis;
+        node.spread = tri.spread;
+        node.power = tri.power;
+        node.index = begin;
+        node.leaf = true;
+        return index;
+    }
+
+    /* Median split of the centroids along the largest axis of their bounds */
+    BoundingBox3f centroids;
+    for (uint32_t i = begin; i < end; i++)
+        centroids.expandBy(m_triangles[i].centroid);
+    int axis = centroids.getLargestAxis();
+    uint32_t mid = begin + (end - begin) / 2;
+    std::nth_element(m_triangles.begin() + begin, m_triangles.begin() + mid, m_triangles.begin() + end,
+        [axis](const Triangle &a, const Triangle &b) { return a.centroid[axis] < b.centroid[axis]; });
+
+    uint32_t left = buildNode(begin, mid, index);
+    uint32_t right = buildNode(mid, end, index);
+    const Node &l = m_nodes[left], &r = m_nodes[right];
+    Node &node = m_nodes[index];
+    node.bbox = BoundingBox3f::merge(l.bbox, r.bbox);
+    mergeCones(l.axis, l.spread, r.axis, r.spread, node.axis, node.spread);
+    node.power = l.power + r.power;
+    node.index = right;
+    node.leaf = false;
+    return index;
+}
+
+float LightTree::importance(const Node &node, const Point3f &ref) const {
+    Point3f center = node.bbox.getCenter();
+    Vector3f d = ref - center;
+    /* Bound the distance from below by the radius of the box, so that nearby nodes do not blow up */
+    float radius2 = 0.25f * node.bbox.getExtents().squaredNorm();
+    float dist2 = std::max(d.squaredNorm(), radius2);
+    if (d.squaredNorm() == 0.0f)
+        return node.power / dist2;
+    float cosAxis = clamp(node.axis.dot(d.normalized()), -1.0f, 1.0f);
+    /* Half angle under which the bounding sphere of the box is seen from ref */
+    float bound = node.bbox.contains(ref) || d.squaredNorm() <= radius2
+        ? M_PI : std::asin(std::sqrt(radius2 / d.squaredNorm()));
+    float angle = std::max(0.0f, std::acos(cosAxis) - node.spread - bound);
+    if (angle >= 0.5f * M_PI)
+        return 0.0f;
+    return node.power * std::cos(angle) / dist2;
+}
+
+const Mesh *LightTree::sample(const Point3f &ref, float sample, uint32_t &face, float &pdf) const {
+    if (m_nodes.empty())
+        return nullptr;
+    uint32_t index = 0;
+    pdf = 1.0f;
+    while (!m_nodes[index].leaf) {
+        uint32_t left = index + 1, right = m_nodes[index].index;
+        float il = importance(m_nodes[left], ref), ir = importance(m_nodes[right], ref);
+        if (il + ir <= 0.0f)
+            return nullptr;
+        float pl = il / (il + ir);
+        /* Reuse the sample for the next level */
+        if (sample < pl) {
+            sample = std::min(sample / pl, 1.0f - Epsilon);
+            pdf *= pl;
+            index = left;
+        }
+        else {
+            sample = std::min((sample - pl) / (1.0f - pl), 1.0f - Epsilon);
+            pdf *= 1.0f - pl;
+            index = right;
+        }
+    }
+    const Triangle &tri = m_triangles[m_nodes[index].index];
+    face = tri.face;
+    return tri.mesh;
+}
+
+float LightTree::pdf(const Point3f &ref, const Mesh *mesh, uint32_t face) const {
+    auto it = m_offsets.find(mesh);
+    if (it == m_offsets.end())
+        return 0.0f;
+    uint32_t index = m_leaves[it->second + face];
+    if (index == (uint32_t) -1)
+        return 0.0f;
+    /* Product of the child probabilities on the path from the root */
+    float pdf = 1.0f;
+    while (index != 0) {
+        uint32_t parent = m_nodes[index].parent;
+        uint32_t left = parent + 1, right = m_nodes[parent].index;
+        float il = importance(m_nodes[left], ref), ir = importance(m_nodes[right], ref);
+        if (il + ir <= 0.0f)
+            return 0.0f;
+        pdf *= (index == left ? il : ir) / (il + ir);
+        index = parent;
+    }
+    return pdf;
+}
+
+void LightTree::mergeCones(const Vector3f &a, float spreadA, const Vector3f &b, float spreadB,
+        Vector3f &axis, float &spread) {
+    if (spreadB > spreadA) {
+        mergeCones(b, spreadB, a, spreadA, axis, spread);
+        return;
+    }
+    float between = std::acos(clamp(a.dot(b), -1.0f, 1.0f));
+    if (std::min(between + spreadB, (float) M_PI) <= spreadA) {
+        axis = a;
+        spread = spreadA;
+        return;
+    }
+    spread = 0.5f * (spreadA + between + spreadB);
+    Vector3f rotation = a.cross(b);
+    if (spread >= M_PI || rotation.squaredNorm() == 0.0f) {
+        axis = a;
+        spread = M_PI;
+        return;
+    }
+    /* Rotate a towards b until the cone reaches both */
+    float turn = spread - spreadA;
+    rotation.normalize();
+    axis = (a * std::cos(turn) + rotation.cross(a) * std::sin(turn)).normalized();
+}
+
+std::string LightTree::toString() const {
+    return tfm::format("LightTree[triangles = %d, nodes = %d]", m_triangles.size(), m_nodes.size());
+}
+
+TRACER_NAMESPACE_END
@@ -125,18 +125,28 @@ static void render(Scene *scene, const std::string &filename) {
                 cout << "Rendering " << curSampleCount << "spp ... ";
                 cout.flush();
                 scene->getSampler()->setSampleCount(curSampleCount);
+                scene->getIntegrator()->beginPass();
                 tbb::parallel_for(range, map);
+                scene->getIntegrator()->endPass();
                 blockGenerator.reset();
                 cout << "done." << endl;
                 result.clear();
+                if (scene->getIntegrator()->converged()) {
+                    cout << "Training converged, skipping to the final pass." << endl;
+                    break;
+                }
             }
             cout << "Rendering " << maxSampleCount << "spp ... ";
             cout.flush();
             scene->getSampler()->setSampleCount(maxSampleCount);
+            scene->getIntegrator()->beginPass();
             tbb::parallel_for(range, map);
+            scene->getIntegrator()->endPass();
         }
         else {
+            scene->getIntegrator()->beginPass();
             tbb::parallel_for(range, map);
+            scene->getIntegrator()->endPass();
         }
 
         cout << "done. (took " << timer.elapsedString() << ")" << endl;
@@ -22,6 +22,8 @@
 #include <tracer/emitter.h>
 #include <tracer/warp.h>
 #include <Eigen/Geometry>
+#include <tbb/parallel_for.h>
+#include <tbb/blocked_range.h>
 
 TRACER_NAMESPACE_BEGIN
 
@@ -39,22 +41,29 @@ void Mesh::activate() {
             TracerObjectFactory::createInstance("diffuse", PropertyList()));
     }
     // Create Discrete PDF for the surface and compute total area
-    m_facepdf.reserve(m_F.cols());
-    m_area = 0.0f;
-	for (uint32_t i = 0; i < m_F.cols(); i++) {
-        float area = surfaceArea(i);
-        m_area += area;
-        m_facepdf.append(area);
-    }
-    m_facepdf.normalize();
+    /* Emitters can have many faces, so their areas are computed in parallel */
+    std::vector<float> areas(m_F.cols());
+    tbb::parallel_for(tbb::blocked_range<uint32_t>(0u, (uint32_t) m_F.cols(), 4096),
+        [&](const tbb::blocked_range<uint32_t> &range) {
+            for (uint32_t i = range.begin(); i != range.end(); ++i)
+                areas[i] = surfaceArea(i);
+        }
+    );
+    m_facepdf.assign(std::move(areas));
+    m_area = m_facepdf.normalize();
 }
 
 void Mesh::samplePosition(const Point2f &sample, Point3f &p, Frame &nFrame, float &pdf) const {
     float x = sample.x();
     size_t index = m_facepdf.sampleReuse(x);
+    sampleTriangle((uint32_t) index, Point2f(x, sample.y()), p, nFrame);
+    pdf = 1.0f / m_area;
+}
+
+void Mesh::sampleTriangle(uint32_t index, const Point2f &sample, Point3f &p, Frame &nFrame) const {
     uint32_t i0 = m_F(0, index), i1 = m_F(1, index), i2 = m_F(2, index);
     const Point3f p0 = m_V.col(i0), p1 = m_V.col(i1), p2 = m_V.col(i2);
-    float alpha = 1.0f - sqrt(1.0f - sample.y()), beta = x * (1.0f - alpha);
+    float alpha = 1.0f - sqrt(1.0f - sample.y()), beta = sample.x() * (1.0f - alpha);
     Point3f bary = Point3f(alpha, beta, 1 - alpha - beta);
     p = bary.x() * p0 + bary.y() * p1 + bary.z() * p2;
     if(m_N.cols() > 0) {
@@ -63,7 +72,6 @@ void Mesh::samplePosition(const Point2f &sample, Point3f &p, Frame &nFrame, floa
     else {
 		nFrame = Frame((p1 - p0).cross(p2 - p0).normalized());
     }
-    pdf = 1.0f / m_area;
 }
 
 float Mesh::surfaceArea(uint32_t index) const {
@@ -0,0 +1,154 @@
+#include <tracer/mlp.h>
+#include <pcg32.h>
+#include <fstream>
+
+TRACER_NAMESPACE_BEGIN
+
+static const char MLP_MAGIC[8] = { 'R', 'L', 'Q', 'T', 'M', 'L', 'P', '1' };
+
+/* Adam hyperparameters */
+static const float ADAM_BETA1 = 0.9f, ADAM_BETA2 = 0.999f, ADAM_EPSILON = 1e-8f;
+
+/* Column vector of at most TinyMLP::MAX_WIDTH entries, kept on the stack */
+typedef Eigen::Matrix<float, Eigen::Dynamic, 1, 0, TinyMLP::MAX_WIDTH, 1> Activation;
+
+TinyMLP::TinyMLP(int inputs, int width, int layers, int outputs, uint64_t seed)
+    : m_inputs(inputs), m_width(width), m_outputs(outputs) {
+    if (inputs < 1 || inputs > MAX_WIDTH || width < 1 || width > MAX_WIDTH || layers < 1 || outputs < 1)
+        throw TracerException("TinyMLP: inputs and width must be in [1, %d], layers and outputs >= 1", (int)MAX_WIDTH);
+    pcg32 random;
+    random.seed(seed);
+    for (int l = 0; l <= layers; l++) {
+        int fanIn = l == 0 ? inputs : width, fanOut = l == layers ? outputs : width;
+        Layer layer;
+        layer.weights.resize(fanOut, fanIn);
+        float scale = std::sqrt(2.0f / fanIn);
+        for (int i = 0; i < fanOut; i++) {
+            for (int j = 0; j < fanIn; j++) {
+                /* Box-Muller */
+                float u1 = std::max(random.nextFloat(), 1e-7f), u2 = random.nextFloat();
+                layer.weights(i, j) = scale * std::sqrt(-2.0f * std::log(u1)) * std::cos(2.0f * M_PI * u2);
+            }
+        }
+        layer.bias = Eigen::VectorXf::Zero(fanOut);
+        layer.mWeights = layer.vWeights = Matrix::Zero(fanOut, fanIn);
+        layer.mBias = layer.vBias = Eigen::VectorXf::Zero(fanOut);
+        m_layers.push_back(layer);
+    }
+}
+
+void TinyMLP::evaluate(const float *input, float *output) const {
+    Activation x = Eigen::Map<const Eigen::VectorXf>(input, m_inputs), y;
+    for (size_t l = 0; l + 1 < m_layers.size(); l++) {
+        y.noalias() = m_layers[l].weights * x;
+        x = (y + m_layers[l].bias).cwiseMax(0.0f);
+    }
+    const Layer &last = m_layers.back();
+    Eigen::Map<Eigen::VectorXf> out(output, m_outputs);
+    out.noalias() = last.weights * x;
+    out += last.bias;
+}
+
+void TinyMLP::assignWeights(const TinyMLP &other) {
+    if (other.m_inputs != m_inputs || other.m_width != m_width || other.m_outputs != m_outputs
+        || other.m_layers.size() != m_layers.size())
+        throw TracerException("TinyMLP: cannot assign the weights of a network with other layer sizes");
+    for (size_t l = 0; l < m_layers.size(); l++) {
+        m_layers[l].weights = other.m_layers[l].weights;
+        m_layers[l].bias = other.m_layers[l].bias;
+    }
+}
+
+float TinyMLP::train(const Matrix &input, const int *bins, const float *targets, float learningRate) {
+    int batch = (int)input.cols(), count = (int)m_layers.size();
+
+    /* Forward pass, keeping the activations */
+    std::vector<Matrix> activations(count + 1);
+    activations[0] = input;
+    for (int l = 0; l < count; l++) {
+        activations[l + 1] = (m_layers[l].weights * activations[l]).colwise() + m_layers[l].bias;
+        if (l + 1 < count)
+            activations[l + 1] = activations[l + 1].cwiseMax(0.0f);
+    }
+
+    /* Only the trained output of each input has a gradient */
+    Matrix delta = Matrix::Zero(m_outputs, batch);
+    float loss = 0.0f;
+    for (int i = 0; i < batch; i++) {
+        float error = activations[count](bins[i], i) - targets[i];
+        loss += error * error;
+        delta(bins[i], i) = 2.0f * error / batch;
+    }
+    loss /= batch;
+
+    m_steps++;
+    float correction1 = 1.0f - std::pow(ADAM_BETA1, (float)m_steps),
+          correction2 = 1.0f - std::pow(ADAM_BETA2, (float)m_steps);
+    float step = learningRate * std::sqrt(correction2) / correction1;
+    for (int l = count - 1; l >= 0; l--) {
+        Layer &layer = m_layers[l];
+        Matrix gradWeights = delta * activations[l].transpose();
+        Eigen::VectorXf gradBias = delta.rowwise().sum();
+        if (l > 0) {
+            /* ReLU derivative: the activation was positive */
+            Matrix next = layer.weights.transpose() * delta;
+            delta = next.cwiseProduct((activations[l].array() > 0.0f).cast<float>().matrix());
+        }
+        layer.mWeights = ADAM_BETA1 * layer.mWeights + (1.0f - ADAM_BETA1) * gradWeights;
+        layer.vWeights = ADAM_BETA2 * layer.vWeights + (1.0f - ADAM_BETA2) * gradWeights.cwiseProduct(gradWeights);
+        layer.mBias = ADAM_BETA1 * layer.mBias + (1.0f - ADAM_BETA1) * gradBias;
+        layer.vBias = ADAM_BETA2 * layer.vBias + (1.0f - ADAM_BETA2) * gradBias.cwiseProduct(gradBias);
+        layer.weights.array() -= step * layer.mWeights.array() / (layer.vWeights.array().sqrt() + ADAM_EPSILON);
+        layer.bias.array() -= step * layer.mBias.array() / (layer.vBias.array().sqrt() + ADAM_EPSILON);
+    }
+    return loss;
+}
+
+void TinyMLP::save(const std::string &filename) const {
+    std::ofstream file(filename, std::ios::binary | std::ios::out);
+    if (!file.is_open())
+        throw TracerException("Cannot open file %s to write", filename);
+    int32_t sizes[4] = { m_inputs, m_width, (int32_t)m_layers.size() - 1, m_outputs };
+    file.write(MLP_MAGIC, sizeof(MLP_MAGIC));
+    file.write((const char *)sizes, sizeof(sizes));
+    for (const Layer &layer : m_layers) {
+        file.write((const char *)layer.weights.data(), layer.weights.size() * sizeof(float));
+        file.write((const char *)layer.bias.data(), layer.bias.size() * sizeof(float));
+    }
+    if (!file)
+        throw TracerException("Error while writing %s", filename);
+}
+
+void TinyMLP::load(const std::string &filename) {
+    std::ifstream file(filename, std::ios::binary | std::ios::in);
+    if (!file.is_open())
+        throw TracerException("Cannot open file %s", filename);
+    char magic[sizeof(MLP_MAGIC)];
+    int32_t sizes[4];
+    if (!file.read(magic, sizeof(magic)) || memcmp(magic, MLP_MAGIC, sizeof(MLP_MAGIC)) != 0
+        || !file.read((char *)sizes, sizeof(sizes)))
+        throw TracerException("%s is not a network written by TinyMLP", filename);
+    if (sizes[0] != m_inputs || sizes[1] != m_width || sizes[2] != (int32_t)m_layers.size() - 1 || sizes[3] != m_outputs)
+        throw TracerException("%s has layer sizes %d/%d x %d/%d, expected %d/%d x %d/%d", filename,
+            sizes[0], sizes[1], sizes[2], sizes[3], m_inputs, m_width, m_layers.size() - 1, m_outputs);
+    for (Layer &layer : m_layers) {
+        file.read((char *)layer.weights.data(), layer.weights.size() * sizeof(float));
+        file.read((char *)layer.bias.data(), layer.bias.size() * sizeof(float));
+    }
+    if (!file)
+        throw TracerException("Error while reading %s", filename);
+}
+
+size_t TinyMLP::getParameterCount() const {
+    size_t count = 0;
+    for (const Layer &layer : m_layers)
+        count += layer.weights.size() + layer.bias.size();
+    return count;
+}
+
+std::string TinyMLP::toString() const {
+    return tfm::format("TinyMLP[%d -> %d x %d -> %d, %d parameters]",
+        m_inputs, m_layers.size() - 1, m_width, m_outputs, getParameterCount());
+}
+
+TRACER_NAMESPACE_END
@@ -0,0 +1,415 @@
+#include <tracer/guider.h>
+#include <tracer/scene.h>
+#include <tracer/sampler.h>
+#include <tracer/emitter.h>
+#include <tracer/bsdf.h>
+#include <tracer/equalarea.h>
+#include <tracer/mlp.h>
+#include <tbb/spin_rw_mutex.h>
+#include <tbb/mutex.h>
+#include <tbb/enumerable_thread_specific.h>
+#include <tbb/concurrent_queue.h>
+#include <atomic>
+#include <memory>
+
+TRACER_NAMESPACE_BEGIN
+
+/**
+ * \brief Guider that represents incident radiance with a small network
+ *
+ * A \ref TinyMLP maps a frequency encoding of the position (normalized to
+ * the scene bounds) and the shading normal to the log of the radiance
+ * arriving in each of the 2 A^2 equal-area bins of the world sphere, as
+ * stored by qtable_sphere. Directions are sampled from these values
+ * gathered over the hemisphere, optionally times the BSDF lobe.
+ *
+ * Updates are the same bootstrapped targets as for the Q-tables. Each
+ * thread collects them into a mini-batch, which trains the network with
+ * one Adam step once it is full, so memory does not depend on the scene.
+ * Render threads never wait for training: a full batch is stepped by the
+ * thread that filled it if no other thread is training, and otherwise
+ * queued for that thread to take on. Beyond \c trainQueue queued batches,
+ * further ones are dropped.
+ * Training steps a separate copy of the network; every \c publishInterval
+ * steps and at the end of each pass its weights are copied to a standby
+ * network, which is swapped in for inference under a brief writer lock.
+ * Inference runs concurrently under a reader lock.
+ */
+class NeuralGuider : public Guider {
+    struct Batch {
+        TinyMLP::Matrix inputs;
+        std::vector<int> bins;
+        std::vector<float> targets;
+        int count = 0;
+    };
+public:
+    NeuralGuider(const PropertyList &props) {
+        m_angleResolution = props.getInteger("angleResolution", 8);
+        /* Octaves of the sine/cosine encoding of the position */
+        m_frequencies = props.getInteger("frequencies", 6);
+        m_batchSize = props.getInteger("batchSize", 256);
+        m_learningRate = props.getFloat("learningRate", 1e-3f);
+        /* Radiance offset before taking the log, which keeps every bin reachable */
+        m_epsilon = props.getFloat("radianceEpsilon", 0.01f);
+        /* Training steps between two updates of the network used for inference */
+        m_publishInterval = props.getInteger("publishInterval", 16);
+        /* Full batches waiting for the training thread before new ones are dropped */
+        m_maxQueued = props.getInteger("trainQueue", 16);
+        if (m_angleResolution < 1 || m_frequencies < 0 || m_batchSize < 1 || m_learningRate <= 0 || m_epsilon <= 0
+            || m_publishInterval < 1 || m_maxQueued < 0)
+            throw TracerException("NeuralGuider: angleResolution, batchSize and publishInterval must be >= 1, "
+                "frequencies and trainQueue >= 0, learningRate and radianceEpsilon > 0");
+        m_trainer.reset(new TinyMLP(6 * m_frequencies + 3, props.getInteger("hiddenWidth", 64),
+            props.getInteger("hiddenLayers", 2), 2 * m_angleResolution * m_angleResolution,
+            (uint64_t)props.getInteger("seed", 0)));
+        m_network.reset(new TinyMLP(*m_trainer));
+        m_standby.reset(new TinyMLP(*m_trainer));
+        m_kernels = &GuiderKernels::get(m_angleResolution);
+        m_productSampling = props.getBoolean("productSampling", false);
+        m_product.init(m_angleResolution, props.getInteger("productSubdivision", 2));
+        for (int i = 0; i < m_angleResolution; i++) {
+            for (int j = 0; j < m_angleResolution; j++) {
+                m_binCenters.push_back(EqualAreaMap::squareToHemisphere(
+                    Point2f((i + 0.5f) / m_angleResolution, (j + 0.5f) / m_angleResolution)));
+            }
+        }
+        m_importFilename = props.getString("import", "");
+        m_exportFilename = props.getString("export", "");
+    }
+
+    virtual ~NeuralGuider() {
+        Batch *batch;
+        while (m_queued.try_pop(batch))
+            delete batch;
+        while (m_spare.try_pop(batch))
+            delete batch;
+    }
+
+    void init(const Scene *scene) {
+        m_sceneBox = scene->getBoundingBox();
+        m_sceneExtent = (m_sceneBox.max - m_sceneBox.min).cwiseMax(Epsilon);
+        if (m_importFilename.length() > 0) {
+            m_trainer->load(m_importFilename);
+            publish();
+            cout << tfm::format("Loaded %s from %s", m_trainer->toString(), m_importFilename) << endl;
+        }
+    }
+
+    Vector3f sample(const Point2f& sample, const Intersection& its, float& pdf) {
+        SphereScratch map(2 * m_angleResolution * m_angleResolution), weights(m_angleResolution * m_angleResolution);
+        evaluate(its, map.data());
+        float total = gather(its.shFrame, map.data(), weights.data());
+        return m_product.sample(weights.data(), total, sample, pdf);
+    }
+
+    void update(const Intersection& origin, const Intersection& dest, Sampler* sampler) {
+        SphereScratch map(2 * m_angleResolution * m_angleResolution);
+        evaluate(dest, map.data());
+        push(origin, (dest.p - origin.p).normalized(), integral(origin, dest, map.data(), sampler));
+    }
+
+    float pdf(const Vector3f& di, const Intersection& origin) {
+        SphereScratch map(2 * m_angleResolution * m_angleResolution), weights(m_angleResolution * m_angleResolution);
+        evaluate(origin, map.data());
+        float total = gather(origin.shFrame, map.data(), weights.data());
+        return m_product.pdf(weights.data(), total, di);
+    }
+
+    Vector3f sampleProduct(const Point2f& sample, const Intersection& its, const Vector3f& wi, float& pdf) {
+        const BSDF *bsdf = its.mesh->getBSDF();
+        if (!m_productSampling || !BSDFProduct::applicable(bsdf, wi))
+            return this->sample(sample, its, pdf);
+        SphereScratch products(m_angleResolution * m_angleResolution);
+        float total = productWeights(its, bsdf, wi, products.data());
+        return m_product.sample(products.data(), total, sample, pdf);
+    }
+
+    float pdfProduct(const Vector3f& di, const Intersection& origin, const Vector3f& wi) {
+        const BSDF *bsdf = origin.mesh->getBSDF();
+        if (!m_productSampling || !BSDFProduct::applicable(bsdf, wi))
+            return pdf(di, origin);
+        SphereScratch products(m_angleResolution * m_angleResolution);
+        float total = productWeights(origin, bsdf, wi, products.data());
+        return m_product.pdf(products.data(), total, di);
+    }
+
+    void update(const GuiderCell& origin, const GuiderCell& dest, Sampler* sampler) {
+        push(origin.its, (dest.its.p - origin.its.p).normalized(), target(origin, dest, sampler));
+    }
+
+    float target(const GuiderCell& origin, const GuiderCell& dest, Sampler* sampler) {
+        return integral(origin.its, dest.its, dest.values.data(), sampler);
+    }
+
+    void updateTarget(const GuiderCell& cell, const Vector3f& di, float value, Sampler* sampler) {
+        push(cell.its, cell.its.shFrame.toWorld(di), value);
+    }
+
+    bool reflected(const GuiderCell& cell, Sampler* sampler, Color3f& result) {
+        const BSDF *bsdf = cell.its.mesh->getBSDF();
+        if (!bsdf || !bsdf->isDiffuse() || Frame::cosTheta(cell.wi) <= 0)
+            return false;
+        SphereScratch q(m_angleResolution * m_angleResolution);
+        gather(cell.its.shFrame, cell.values.data(), q.data());
+        for (int b = 0; b < m_angleResolution * m_angleResolution; b++)
+            q[b] = std::max(q[b] - m_epsilon, 0.0f);
+        result = reflectBins(bsdf, cell.wi, q.data(), m_angleResolution, sampler);
+        return true;
+    }
+
+    /* Train on the queued and partial batches as well; runs between passes, when no thread is using them */
+    void endPass() {
+        Batch *queued;
+        while (m_queued.try_pop(queued)) {
+            m_queuedCount--;
+            step(*queued);
+            m_spare.push(queued);
+        }
+        for (Batch &batch : m_batches) {
+            if (batch.count > 0)
+                step(batch);
+        }
+        publish();
+        cout << tfm::format("NeuralGuider: %d training steps, loss %f, %d batches dropped", m_trainer->getSteps(),
+            (float)m_loss, (size_t)m_dropped) << endl;
+    }
+
+    void done() {
+        if (m_exportFilename.length() > 0) {
+            m_trainer->save(m_exportFilename);
+            cout << tfm::format("Exported %s to %s", m_trainer->toString(), m_exportFilename) << endl;
+        }
+    }
+
+    /* Parameters of the trained network with their Adam moments and of the two others, and the batches of the threads seen so far and of the queue */
+    size_t memoryUsage() const {
+        size_t batches = 0;
+        for (const Batch &batch : m_batches)
+            batches += batch.inputs.size() * sizeof(float) + batch.bins.capacity() * (sizeof(int) + sizeof(float));
+        size_t queued = (size_t)m_allocated * m_batchSize * (m_network->getInputs() + 2) * sizeof(float);
+        return 5 * m_trainer->getParameterCount() * sizeof(float) + batches + queued;
+    }
+
+    std::string toString() const {
+        return tfm::format(
+            "NeuralGuider[\n"
+            "  network = %s,\n"
+            "  angleResolution = %d,\n"
+            "  frequencies = %d,\n"
+            "  batchSize = %d,\n"
+            "  learningRate = %f,\n"
+            "  publishInterval = %d,\n"
+            "  trainQueue = %d,\n"
+            "  productSampling = %s,\n"
+            "  memory = %s,\n"
+            "  import = %s\n"
+            "]",
+            m_trainer->toString(), m_angleResolution, m_frequencies, m_batchSize, m_learningRate,
+            m_publishInterval, m_maxQueued, m_productSampling ? "true" : "false", memString(memoryUsage()),
+            m_importFilename.length() > 0 ? m_importFilename : "none");
+    }
+
+    using Guider::sample;
+    using Guider::pdf;
+    using Guider::update;
+
+    void locate(const Intersection& its, const Vector3f& wi, GuiderCell& cell) {
+        cell.its = its;
+        cell.wi = wi;
+        cell.values.resize(2 * m_angleResolution * m_angleResolution);
+        evaluate(its, cell.values.data());
+        cell.weights.resize(m_angleResolution * m_angleResolution);
+        cell.total = gather(its.shFrame, cell.values.data(), cell.weights.data());
+        const BSDF *bsdf = its.mesh->getBSDF();
+        cell.product = m_productSampling && BSDFProduct::applicable(bsdf, wi);
+        if (cell.product)
+            cell.total = m_product.multiply(bsdf, wi, cell.weights.data());
+    }
+
+    Vector3f sample(const Point2f& sample, const GuiderCell& cell, float& pdf) {
+        return m_product.sample(cell.weights.data(), cell.total, sample, pdf);
+    }
+
+    float pdf(const Vector3f& di, const GuiderCell& cell) {
+        return m_product.pdf(cell.weights.data(), cell.total, di);
+    }
+
+protected:
+    /* Network input of a vertex: sin and cos of the normalized position at each octave, then the normal */
+    void encode(const Intersection& its, float* x) const {
+        Vector3f u = (its.p - m_sceneBox.min).cwiseQuotient(m_sceneExtent);
+        int k = 0;
+        for (int f = 0; f < m_frequencies; f++) {
+            float scale = (float)M_PI * (float)(1 << f);
+            for (int c = 0; c < 3; c++) {
+                x[k++] = std::sin(scale * u[c]);
+                x[k++] = std::cos(scale * u[c]);
+            }
+        }
+        for (int c = 0; c < 3; c++)
+            x[k++] = its.shFrame.n[c];
+    }
+
+    /* Radiance plus epsilon in every sphere bin at its */
+    void evaluate(const Intersection& its, float* map) {
+        float x[TinyMLP::MAX_WIDTH];
+        encode(its, x);
+        {
+            tbb::spin_rw_mutex::scoped_lock lock(m_mutex, false);
+            m_network->evaluate(x, map);
+        }
+        for (int b = 0; b < 2 * m_angleResolution * m_angleResolution; b++)
+            map[b] = std::exp(std::min(map[b], MAX_LOG_RADIANCE));
+    }
+
+    /* Add an estimate of the radiance arriving at its along the world direction ray to the batch of this thread */
+    void push(const Intersection& its, const Vector3f& ray, float value) {
+        Batch &batch = m_batches.local();
+        if (batch.count == 0 && batch.inputs.cols() != m_batchSize) {
+            batch.inputs.resize(m_network->getInputs(), m_batchSize);
+            batch.bins.resize(m_batchSize);
+            batch.targets.resize(m_batchSize);
+        }
+        encode(its, batch.inputs.col(batch.count).data());
+        batch.bins[batch.count] = EqualAreaMap::sphereBin(ray, m_angleResolution);
+        batch.targets[batch.count] = std::log(std::max(value, 0.0f) + m_epsilon);
+        if (++batch.count == m_batchSize)
+            train(batch);
+    }
+
+    /**
+     * Train on a full batch without waiting: if another thread is training,
+     * the batch is handed to it through the queue, in exchange for a spare
+     * one, or dropped when the queue is full. The training thread then
+     * works through the queue before it returns. A batch queued just as it
+     * releases the lock waits for the next training step or endPass().
+     */
+    void train(Batch& batch) {
+        tbb::mutex::scoped_lock lock;
+        if (!lock.try_acquire(m_trainMutex)) {
+            if (m_queuedCount.fetch_add(1) >= m_maxQueued) {
+                m_queuedCount--;
+                m_dropped++;
+                batch.count = 0;
+                return;
+            }
+            Batch *queued;
+            if (!m_spare.try_pop(queued)) {
+                queued = new Batch;
+                m_allocated++;
+            }
+            std::swap(*queued, batch);
+            batch.count = 0;
+            m_queued.push(queued);
+            return;
+        }
+        step(batch);
+        Batch *queued;
+        while (m_queued.try_pop(queued)) {
+            m_queuedCount--;
+            step(*queued);
+            m_spare.push(queued);
+        }
+    }
+
+    /* One Adam step of the trained network, which inference does not read, so readers are not blocked; the caller holds m_trainMutex */
+    void step(Batch& batch) {
+        m_loss = m_trainer->train(batch.inputs.leftCols(batch.count), batch.bins.data(), batch.targets.data(), m_learningRate);
+        batch.count = 0;
+        if (m_trainer->getSteps() % m_publishInterval == 0)
+            publishLocked();
+    }
+
+    void publish() {
+        tbb::mutex::scoped_lock lock(m_trainMutex);
+        publishLocked();
+    }
+
+    /* Copy the trained weights to the standby network and swap it in for inference; the caller holds m_trainMutex */
+    void publishLocked() {
+        m_standby->assignWeights(*m_trainer);
+        tbb::spin_rw_mutex::scoped_lock lock(m_mutex, true);
+        std::swap(m_network, m_standby);
+    }
+
+    /**
+     * New estimate for the bin of origin towards dest: the radiance map of
+     * dest, gathered over the hemisphere of its normal, integrated against
+     * its BSDF, plus emission
+     */
+    float integral(const Intersection& origin, const Intersection& dest, const float* map, Sampler* sampler) const {
+        const Vector3f ray = (dest.p - origin.p).normalized(),
+            dest_wi = dest.shFrame.toLocal(-ray);
+        float integral_term = 0.0f;
+        const BSDF *bsdf = dest.mesh->getBSDF();
+        BSDFQueryRecord brec = BSDFQueryRecord(dest_wi);
+        if (bsdf->isDiffuse()) {
+            brec.measure = ESolidAngle;
+            SphereScratch q(m_angleResolution * m_angleResolution);
+            gather(dest.shFrame, map, q.data());
+            for (int i = 0; i < m_angleResolution; i++) {
+                for (int j = 0; j < m_angleResolution; j++) {
+                    Point2f sample = (sampler->next2D() + Point2f(i, j)) / m_angleResolution;
+                    brec.wo = EqualAreaMap::squareToHemisphere(sample);
+                    float eval = bsdf->eval(brec).maxCoeff();
+                    float radiance = std::max(q[i * m_angleResolution + j] - m_epsilon, 0.0f);
+                    integral_term += radiance * Frame::cosTheta(brec.wo) * eval;
+                }
+            }
+        }
+        else {
+            for (int i = 0; i < m_angleResolution * m_angleResolution; i++) {
+                bsdf->sample(brec, sampler->next2D());
+                int idx = EqualAreaMap::sphereBin(dest.shFrame.toWorld(brec.wo), m_angleResolution);
+                integral_term += std::max(map[idx] - m_epsilon, 0.0f);
+            }
+        }
+        integral_term *= 2.0f * M_PI / m_angleResolution / m_angleResolution;
+        if (dest.mesh->isEmitter())
+            integral_term += dest.mesh->getEmitter()->getRadiance(dest.p, dest_wi).sum();
+        return integral_term;
+    }
+
+    /* Gather the sphere bins of map onto the hemisphere bins around frame, see QTableSphereGuider */
+    float gather(const Frame& frame, const float* map, float* weights) const {
+        return m_kernels->gather(frame, m_binCenters.data(), map, weights, m_angleResolution);
+    }
+
+    float productWeights(const Intersection& its, const BSDF* bsdf, const Vector3f& wi, float* products) {
+        SphereScratch map(2 * m_angleResolution * m_angleResolution);
+        evaluate(its, map.data());
+        gather(its.shFrame, map.data(), products);
+        return m_product.multiply(bsdf, wi, products);
+    }
+
+    int m_angleResolution;
+    int m_frequencies;
+    int m_batchSize;
+    float m_learningRate;
+    float m_epsilon;
+    int m_publishInterval;
+    int m_maxQueued;
+    /* Network stepped by training, network used for inference and the next one to be */
+    std::unique_ptr<TinyMLP> m_trainer, m_network, m_standby;
+    tbb::mutex m_trainMutex;
+    tbb::spin_rw_mutex m_mutex;
+    tbb::enumerable_thread_specific<Batch> m_batches;
+    /* Full batches waiting for the training thread, and emptied ones to exchange for the next */
+    tbb::concurrent_queue<Batch*> m_queued, m_spare;
+    std::atomic<int> m_queuedCount{0};
+    std::atomic<int> m_allocated{0};
+    std::atomic<size_t> m_dropped{0};
+    std::atomic<float> m_loss{0.0f};
+    const GuiderKernels *m_kernels;
+    bool m_productSampling;
+    BSDFProduct m_product;
+    std::vector<Vector3f> m_binCenters;
+    BoundingBox3f m_sceneBox;
+    Vector3f m_sceneExtent;
+    std::string m_importFilename;
+    std::string m_exportFilename;
+    const float MAX_LOG_RADIANCE = 30.0f;
+};
+
+TRACER_REGISTER_CLASS(NeuralGuider, "neural");
+TRACER_NAMESPACE_END
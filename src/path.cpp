@@ -38,14 +38,14 @@ public:
 			last_specular = !bsdf->isDiffuse();
 			if (bsdf->isDiffuse() && need_shading && Frame::cosTheta(wi) > 0) {
 				float emitter_shading_pdf = 0.0f, hemisphere_shading_pdf;
-				float emitter_pdf, surface_pdf;
-				const Emitter* emitter = scene->sampleEmitter(sampler->next1D(), emitter_pdf);
+				float light_pdf;
+				Point3f source;
+				Frame enFrame;
+				const Emitter* emitter = scene->sampleLight(its.p, sampler->next1D(), sampler->next2D(), source, enFrame, light_pdf);
 				do {
 					if (!emitter)
 						break;
-					Point3f source;
-					Frame enFrame;
-					Color3f radiance = emitter->sample(its.p, sampler->next2D(), source, enFrame, surface_pdf);
+					Color3f radiance = emitter->getRadiance(source, enFrame.toLocal(its.p - source).normalized());
 					Vector3f inc_ray = source - its.p;
                     if (its.shFrame.n.dot(inc_ray) <= 0 || enFrame.n.dot(-inc_ray) <= 0)
 						break;
@@ -54,7 +54,7 @@ public:
 						break;
 					inc_ray.normalize();
 					BSDFQueryRecord brec = BSDFQueryRecord(wi, its.shFrame.toLocal(inc_ray), ESolidAngle);
-					emitter_shading_pdf = surface_pdf * emitter_pdf / enFrame.n.dot(-inc_ray) * inc_norm;
+					emitter_shading_pdf = light_pdf / enFrame.n.dot(-inc_ray) * inc_norm;
 					hemisphere_shading_pdf = bsdf->pdf(brec);
 					result += alpha * bsdf->eval(brec) * radiance  / (emitter_shading_pdf + hemisphere_shading_pdf) * its.shFrame.n.dot(inc_ray);
 				} while (false);
@@ -68,10 +68,7 @@ public:
 					break;
 				if (its.mesh->isEmitter() && bsdf->isDiffuse() && need_shading && Frame::cosTheta(wi) > 0) {
 					float emitter_shading_pdf = 0.0f, hemisphere_shading_pdf = bsdf->pdf(brec);
-					float emitter_pdf, surface_pdf;
-					emitter_pdf = 1.0f / scene->getEmitters().size();
-					surface_pdf = its.mesh->getEmitter()->pdf(its.p);
-					emitter_shading_pdf = surface_pdf * emitter_pdf / its.shFrame.n.dot(-ray_.d) * (its.p - ray_.o).squaredNorm();
+					emitter_shading_pdf = scene->pdfLight(ray_.o, its) / its.shFrame.n.dot(-ray_.d) * (its.p - ray_.o).squaredNorm();
 					Color3f radiance = its.mesh->getEmitter()->getRadiance(its.p, its.shFrame.toLocal(-ray_.d));
 					if(radiance.maxCoeff() > 0)
 						result += backup * bsdf->eval(brec) * radiance * Frame::cosTheta(brec.wo) / (emitter_shading_pdf + hemisphere_shading_pdf);
@@ -5,13 +5,24 @@
 #include <tracer/mesh.h>
 #include <tracer/sampler.h>
 #include <tracer/guider.h>
+#include <tracer/pretrain.h>
+#include <tracer/pathreturn.h>
+#include <tracer/transitions.h>
+#include <tracer/qtermination.h>
+#include <tracer/adrrs.h>
+#include <tracer/telemetry.h>
 #include <tracer/warp.h>
 
 TRACER_NAMESPACE_BEGIN
 
 class PathGuidedIntegrator : public Integrator {
 public:
-    PathGuidedIntegrator(const PropertyList &props) { }
+    PathGuidedIntegrator(const PropertyList &props) : m_pretrainer(props), m_termination(props), m_roulette(props) {
+        m_returnUpdates = props.getBoolean("returnUpdates", false);
+        m_returnLambda = props.getFloat("returnLambda", 1.0f);
+        /* Log file of the training transitions for offline training, none by default */
+        m_recordFilename = props.getString("recordTransitions", "");
+    }
 
     void addChild(TracerObject *obj) {
         switch (obj->getClassType()) {
@@ -33,61 +44,162 @@ public:
 
     void preprocess(const Scene *scene) {
         m_guider->init(scene);
+        m_pretrainer.run(scene, m_guider);
+        if (m_recordFilename.length() > 0)
+            m_recorder.reset(new TransitionRecorder(m_recordFilename, scene));
     }
 
 	Color3f Li(const Scene *scene, Sampler *sampler, const Ray3f &ray) const {
 		/* Find the surface that is visible in the requested direction */
-		Intersection its, last_its;
+		Intersection its;
+		GuiderCell cell, last_cell;
 		Ray3f ray_ = ray;
 		if (!scene->rayIntersect(ray_, its))
 			return Color3f(0.0f);
+		Color3f result = Color3f(0.0f);
 		Color3f alpha = Color3f(1.0f);
+		PathReturns returns(m_returnUpdates ? m_guider : nullptr, m_returnLambda);
 		int k = 0;
+		/* Vertices over all branches, for the telemetry */
+		int vertices = 0;
+		Color3f pixel(0.0f);
+		/* Split paths waiting to be followed; returns follow a single path, so they rule out splitting */
+		std::vector<PathBranch> branches;
 		while (true) {
-			const Vector3f wi = its.shFrame.toLocal(-ray_.d.normalized());
-            if (k > 0) {
-                m_guider->update(last_its, its, sampler);
-            }
-			if (its.mesh->isEmitter()) {
-				return alpha * its.mesh->getEmitter()->getRadiance(its.p, wi);
+			while (true) {
+				vertices++;
+				const Vector3f wi = its.shFrame.toLocal(-ray_.d.normalized());
+                m_guider->locate(its, wi, cell);
+                if (k == 0 && m_roulette.isEnabled())
+                    pixel = m_roulette.pixelEstimate(m_guider, cell, its.mesh->isEmitter() ? its.mesh->getEmitter()->getRadiance(its.p, wi) : Color3f(0.0f), sampler);
+                if (k > 0 && m_recorder)
+                    m_recorder->record(last_cell.its, cell.its);
+                if (returns.isEnabled()) {
+                    returns.addVertex(cell, sampler);
+                }
+                else if (k > 0) {
+                    m_guider->update(last_cell, cell, sampler);
+                }
+				if (its.mesh->isEmitter()) {
+					Color3f radiance = its.mesh->getEmitter()->getRadiance(its.p, wi);
+					returns.addEmission(radiance, radiance);
+					result += alpha * radiance;
+					break;
+				}
+				const BSDF* bsdf = its.mesh->getBSDF();
+				if (!bsdf) {
+					break;
+				}
+                if (m_termination.isEnabled()) {
+                    Color3f estimate;
+                    float scale = m_termination.decide(m_guider, cell, k, sampler, estimate);
+                    result += alpha * estimate;
+                    if (scale == 0.0f) {
+                        returns.addDirect(estimate);
+                        break;
+                    }
+                    alpha *= scale;
+                }
+                /* Paths are only rouletted and split with the adjoint-driven rule, never by a fixed one */
+                int count = 1;
+                float survival = 1.0f;
+                if (m_roulette.isEnabled()) {
+                    count = m_roulette.continuations(m_guider, cell, alpha, pixel, k, !returns.isEnabled(), sampler, survival);
+                    if (count == 0)
+                        break;
+                    alpha *= survival;
+                }
+                for (int b = 1; b < count; b++) {
+                    PathBranch branch;
+                    BSDFQueryRecord brec = BSDFQueryRecord(wi);
+                    branch.alpha = alpha * scatter(bsdf, cell, sampler, brec);
+                    branch.ray = Ray3f(its.p, its.shFrame.toWorld(brec.wo));
+                    if (branch.alpha.isZero() || !scene->rayIntersect(branch.ray, branch.its))
+                        continue;
+                    branch.last_cell = cell;
+                    branch.k = k + 1;
+                    branches.push_back(branch);
+                }
+                BSDFQueryRecord brec = BSDFQueryRecord(wi);
+                Color3f weight = scatter(bsdf, cell, sampler, brec);
+                alpha *= weight;
+                /* The returned radiance is weighted like the path, roulette included */
+                returns.scatter(weight * survival);
+                ray_ = Ray3f(its.p, its.shFrame.toWorld(brec.wo));
+                std::swap(last_cell, cell);
+                if (!scene->rayIntersect(ray_, its))
+                    break;
+				k++;
 			}
-			const BSDF* bsdf = its.mesh->getBSDF();
-			if (!bsdf) {
+			if (branches.empty())
 				break;
-			}
-            BSDFQueryRecord brec = BSDFQueryRecord(wi);
-			if (bsdf->isDiffuse()) {
-                float pdf;
-                brec.wo = m_guider->sample(sampler->next2D(), its, pdf);
-                brec.measure = ESolidAngle;
-                alpha *= bsdf->eval(brec) * Frame::cosTheta(brec.wo) / pdf;
-			}
-            else {
-                alpha *= bsdf->sample(brec, sampler->next2D());
-            }
-            ray_ = Ray3f(its.p, its.shFrame.toWorld(brec.wo));
-            last_its = its;
-            if (!scene->rayIntersect(ray_, its))
-                break;
-			k++;
+			PathBranch &branch = branches.back();
+			ray_ = branch.ray;
+			its = branch.its;
+			std::swap(last_cell, branch.last_cell);
+			alpha = branch.alpha;
+			k = branch.k;
+			branches.pop_back();
 		}
-        return Color3f(0.0f);
+		returns.finish(sampler);
+		if (GuiderTelemetry *telemetry = m_guider->getTelemetry())
+			telemetry->recordPath(vertices);
+        return result;
 	}
 
+	/* Sample the next direction at a vertex: from the guider if the BSDF is diffuse, else from the BSDF */
+	Color3f scatter(const BSDF *bsdf, const GuiderCell &cell, Sampler *sampler, BSDFQueryRecord &brec) const {
+		if (!bsdf->isDiffuse())
+			return bsdf->sample(brec, sampler->next2D());
+		float pdf;
+		brec.wo = m_guider->sample(sampler->next2D(), cell, pdf);
+		brec.measure = ESolidAngle;
+		return bsdf->eval(brec) * Frame::cosTheta(brec.wo) / pdf;
+	}
+
+    void beginPass() {
+        m_guider->beginPass();
+    }
+
+    void endPass() {
+        m_guider->endPass();
+    }
+
+    bool converged() const {
+        return m_guider->converged();
+    }
+
     void done() {
         m_guider->done();
+        if (m_recorder) {
+            m_recorder->close();
+            cout << tfm::format("Recorded %d transitions to %s", m_recorder->getCount(), m_recorder->getFilename()) << endl;
+        }
     }
 
 	std::string toString() const {
         return tfm::format(
             "PathGuidedIntegrator[\n"
-            "  guider = %s\n"
+            "  guider = %s,\n"
+            "  pretrainer = %s,\n"
+            "  termination = %s,\n"
+            "  roulette = %s\n"
             "]",
-            indent(m_guider->toString())
+            indent(m_guider->toString()),
+            m_pretrainer.toString(),
+            m_termination.toString(),
+            m_roulette.toString()
         );
 	}
 protected:
     Guider* m_guider = nullptr;
+    LightPathPretrainer m_pretrainer;
+    QTermination m_termination;
+    AdjointRoulette m_roulette;
+    bool m_returnUpdates;
+    float m_returnLambda;
+    std::string m_recordFilename;
+    std::unique_ptr<TransitionRecorder> m_recorder;
 };
 
 TRACER_REGISTER_CLASS(PathGuidedIntegrator, "path_guided");
@@ -5,6 +5,13 @@
 #include <tracer/mesh.h>
 #include <tracer/sampler.h>
 #include <tracer/guider.h>
+#include <tracer/pretrain.h>
+#include <tracer/pathreturn.h>
+#include <tracer/transitions.h>
+#include <tracer/qtermination.h>
+#include <tracer/adrrs.h>
+#include <tracer/telemetry.h>
+#include <tracer/lightselect.h>
 
 TRACER_NAMESPACE_BEGIN
 
@@ -12,7 +19,14 @@ TRACER_NAMESPACE_BEGIN
 
 class PathGuidedMISIntegrator : public Integrator {
 public:
-    PathGuidedMISIntegrator(const PropertyList &props) { }
+    PathGuidedMISIntegrator(const PropertyList &props) : m_pretrainer(props), m_termination(props), m_roulette(props), m_lights(props) {
+        /* Feed NEE estimates into the direct table of guiders that keep one; scenes opt in */
+        m_neeUpdates = props.getBoolean("neeUpdates", false);
+        m_returnUpdates = props.getBoolean("returnUpdates", false);
+        m_returnLambda = props.getFloat("returnLambda", 1.0f);
+        /* Log file of the training transitions for offline training, none by default */
+        m_recordFilename = props.getString("recordTransitions", "");
+    }
 
     void addChild(TracerObject *obj) {
         switch (obj->getClassType()) {
@@ -34,112 +48,208 @@ public:
 
     void preprocess(const Scene *scene) {
         m_guider->init(scene);
+        m_pretrainer.run(scene, m_guider, m_neeUpdates && m_guider->hasDirectTable());
+        m_lights.init(scene);
+        if (m_recordFilename.length() > 0)
+            m_recorder.reset(new TransitionRecorder(m_recordFilename, scene));
     }
 
 	Color3f Li(const Scene *scene, Sampler *sampler, const Ray3f &ray) const {
 		/* Find the surface that is visible in the requested direction */
 		Intersection its, last_its;
+		GuiderCell cell, last_cell;
 		Ray3f ray_ = ray;
 		if (!scene->rayIntersect(ray_, its))
 			return Color3f(0.0f);
 		Color3f result = Color3f(0.0f);
 		Color3f alpha = Color3f(1.0f);
+		PathReturns returns(m_returnUpdates ? m_guider : nullptr, m_returnLambda);
 		int k = 0;
+		/* Vertices over all branches, for the telemetry */
+		int vertices = 0;
 		bool last_specular = false;
+		Color3f pixel(0.0f);
+		/* Split paths waiting to be followed; returns follow a single path, so they rule out splitting */
+		std::vector<PathBranch> branches;
 		while (true) {
-			bool need_shading = true;
-			const Vector3f wi = its.shFrame.toLocal(-ray_.d.normalized());
-			if (its.mesh->isEmitter()) {
-				if (last_specular || k == 0) {
-					//Last hop specular or primary ray
-					result += alpha * its.mesh->getEmitter()->getRadiance(its.p, wi);
+			while (true) {
+				vertices++;
+				bool need_shading = true;
+				const Vector3f wi = its.shFrame.toLocal(-ray_.d.normalized());
+				m_guider->locate(its, wi, cell);
+				/* NEE samples of diffuse vertices go to the direct table of the guider */
+				cell.direct = m_neeUpdates && m_guider->hasDirectTable() && its.mesh->getBSDF() && its.mesh->getBSDF()->isDiffuse()
+					&& Frame::cosTheta(wi) > 0;
+				returns.addVertex(cell, sampler);
+				if (its.mesh->isEmitter()) {
+					if (last_specular || k == 0) {
+						//Last hop specular or primary ray
+						Color3f radiance = its.mesh->getEmitter()->getRadiance(its.p, wi);
+						result += alpha * radiance;
+						returns.addEmission(radiance, radiance);
+					}
+	                else {
+	                    float geom = (its.p - ray_.o).squaredNorm() / abs(Frame::cosTheta(wi));
+	                    float emitter_shading_pdf = m_lights.pdfPosition(scene, last_cell, its) * geom;
+	                    float hemisphere_shading_pdf = m_guider->pdf(last_its.shFrame.toLocal((its.p - last_its.p).normalized()), last_cell);
+	                    bool isresult_nan = CHECK_VALID(result.r());
+	                    Color3f radiance = its.mesh->getEmitter()->getRadiance(its.p, wi);
+	                    result += alpha * radiance * hemisphere_shading_pdf / (emitter_shading_pdf + hemisphere_shading_pdf);
+	                    returns.addEmission(radiance, radiance * hemisphere_shading_pdf / (emitter_shading_pdf + hemisphere_shading_pdf));
+	                    if (!isresult_nan && CHECK_VALID(result.r())) {
+	                        cout << tfm::format("65: alpha: %s\nh_pdf: %f, e_pdf: %f, geom: %f\nits.p: %s, last_its.p: %s, its.n: %s, last_its.n: %s\n",
+	                            alpha.toString(), hemisphere_shading_pdf, emitter_shading_pdf, geom, its.p.toString(), last_its.p.toString(), its.shFrame.n.toString(), last_its.shFrame.n.toString());
+	                    }
+	                }
 				}
-                else {
-                    float emitter_pdf, surface_pdf;
-                    emitter_pdf = 1.0f / scene->getEmitters().size();
-                    surface_pdf = its.mesh->getEmitter()->pdf(its.p);
-                    float geom = (its.p - ray_.o).squaredNorm() / abs(Frame::cosTheta(wi));
-                    float emitter_shading_pdf = emitter_pdf * surface_pdf * geom;
-                    float hemisphere_shading_pdf = m_guider->pdf(last_its.shFrame.toLocal((its.p - last_its.p).normalized()), last_its);
-                    bool isresult_nan = CHECK_VALID(result.r());
-                    result += alpha * its.mesh->getEmitter()->getRadiance(its.p, wi) * hemisphere_shading_pdf / (emitter_shading_pdf + hemisphere_shading_pdf);
-                    if (!isresult_nan && CHECK_VALID(result.r())) {
-                        cout << tfm::format("65: alpha: %s\nh_pdf: %f, e_pdf: %f, geom: %f\nits.p: %s, last_its.p: %s, its.n: %s, last_its.n: %s\n",
-                            alpha.toString(), hemisphere_shading_pdf, emitter_shading_pdf, geom, its.p.toString(), last_its.p.toString(), its.shFrame.n.toString(), last_its.shFrame.n.toString());
-                    }
-                }
-			}
-            if (k > 0) {
-                //Update Guider
-                m_guider->update(last_its, its, sampler);
-            }
-			const BSDF* bsdf = its.mesh->getBSDF();
-			if (!bsdf) {
-				break;
-			}
-			last_specular = !bsdf->isDiffuse();
-			if (bsdf->isDiffuse() && need_shading && Frame::cosTheta(wi) > 0) {
-				float emitter_shading_pdf = 0.0f, hemisphere_shading_pdf;
-				float emitter_pdf, surface_pdf;
-				const Emitter* emitter = scene->sampleEmitter(sampler->next1D(), emitter_pdf);
-				do {
-					if (!emitter)
-						break;
+				if (k == 0 && m_roulette.isEnabled())
+					pixel = m_roulette.pixelEstimate(m_guider, cell, its.mesh->isEmitter() ? its.mesh->getEmitter()->getRadiance(its.p, wi) : Color3f(0.0f), sampler);
+	            if (k > 0 && m_recorder)
+	                m_recorder->record(last_cell.its, cell.its);
+	            if (k > 0 && !returns.isEnabled()) {
+	                //Update Guider
+	                m_guider->update(last_cell, cell, sampler);
+	            }
+				const BSDF* bsdf = its.mesh->getBSDF();
+				if (!bsdf) {
+					break;
+				}
+				last_specular = !bsdf->isDiffuse();
+	            if (m_termination.isEnabled()) {
+	                Color3f estimate;
+	                float scale = m_termination.decide(m_guider, cell, k, sampler, estimate);
+	                result += alpha * estimate;
+	                if (scale == 0.0f) {
+	                    returns.addDirect(estimate);
+	                    break;
+	                }
+	                alpha *= scale;
+	            }
+				if (bsdf->isDiffuse() && need_shading && Frame::cosTheta(wi) > 0) {
+					float emitter_shading_pdf = 0.0f, hemisphere_shading_pdf;
+					float light_pdf;
 					Point3f source;
 					Frame enFrame;
-					Color3f radiance = emitter->sample(its.p, sampler->next2D(), source, enFrame, surface_pdf);
-					Vector3f inc_ray = source - its.p;
-					if (its.shFrame.n.dot(inc_ray) <= 0 || enFrame.n.dot(-inc_ray) <= 0 || radiance.sum() < Epsilon)
-						break;
-					float inc_norm = inc_ray.squaredNorm();
-                    if (scene->rayIntersect(Ray3f(its.p, inc_ray, Epsilon, 1 - Epsilon)))
-                        break;
-                    //Intersection e_its;
-                    //if (!scene->rayIntersect(Ray3f(its.p, inc_ray), e_its) || (source - e_its.p).norm() > Epsilon)
-                    //    break;
-                    inc_ray.normalize();
-                    Vector3f local_inc_ray = its.shFrame.toLocal(inc_ray);
+					const Emitter* emitter = m_lights.samplePosition(scene, cell, sampler->next1D(), sampler->next2D(), source, enFrame, light_pdf);
+					Color3f light(0.0f), nee_radiance(0.0f);
+					Vector3f nee_dir(0.0f, 0.0f, 1.0f);
+					float nee_pdf = 0.0f;
+					do {
+						if (!emitter)
+							break;
+						Color3f radiance = emitter->getRadiance(source, enFrame.toLocal(its.p - source).normalized());
+						Vector3f inc_ray = source - its.p;
+						if (its.shFrame.n.dot(inc_ray) <= 0 || enFrame.n.dot(-inc_ray) <= 0 || radiance.sum() < Epsilon)
+							break;
+						float inc_norm = inc_ray.squaredNorm();
+	                    if (scene->rayIntersect(Ray3f(its.p, inc_ray, Epsilon, 1 - Epsilon)))
+	                        break;
+	                    //Intersection e_its;
+	                    //if (!scene->rayIntersect(Ray3f(its.p, inc_ray), e_its) || (source - e_its.p).norm() > Epsilon)
+	                    //    break;
+	                    inc_ray.normalize();
+	                    Vector3f local_inc_ray = its.shFrame.toLocal(inc_ray);
 
-					BSDFQueryRecord brec = BSDFQueryRecord(wi, local_inc_ray, ESolidAngle);
-					emitter_shading_pdf = surface_pdf * emitter_pdf / abs(enFrame.n.dot(inc_ray)) * inc_norm;
-                    hemisphere_shading_pdf = m_guider->pdf(local_inc_ray, its);
-                    bool isresult_nan = CHECK_VALID(result.r());
-					result += alpha * bsdf->eval(brec) * radiance  / (emitter_shading_pdf + hemisphere_shading_pdf) * Frame::cosTheta(local_inc_ray);
-                    if (!isresult_nan && CHECK_VALID(result.r())) {
-                        cout << tfm::format("112: alpha: %s\nh_pdf: %f, e_pdf: %f, radiance: %s\nits.p: %s, source: %s, its.n: %s, enFrame.n: %s\n",
-                            alpha.toString(), hemisphere_shading_pdf, emitter_shading_pdf, radiance.toString(), its.p.toString(), source.toString(), its.shFrame.n.toString(), enFrame.n.toString());
-                    }
-                    //m_guider->update(its, e_its, sampler);
-				} while (false);
-			}
-			if (k <= 2 || sampler->next1D() < 0.95f) {
-                BSDFQueryRecord brec = BSDFQueryRecord(wi);
-                if (last_specular) {
-                    alpha *= bsdf->sample(brec, sampler->next2D()) / (k <= 2 ? 1.0f : 0.95f);
-                }
-                else {
-                    //Use guider to decide next direction
-                    float pdf;
-                    brec.wo = m_guider->sample(sampler->next2D(), its, pdf);
-                    brec.measure = ESolidAngle;
-                    pdf *= k <= 2 ? 1.0f : 0.95f;
-                    alpha *= bsdf->eval(brec) * Frame::cosTheta(brec.wo) / pdf;
-                }
-                last_its = its;
-                ray_ = Ray3f(its.p, its.shFrame.toWorld(brec.wo));
-                if (!scene->rayIntersect(ray_, its))
-                    break;
+						BSDFQueryRecord brec = BSDFQueryRecord(wi, local_inc_ray, ESolidAngle);
+						light = bsdf->eval(brec) * radiance * (Frame::cosTheta(local_inc_ray) * abs(enFrame.n.dot(inc_ray)) / inc_norm / light_pdf);
+						emitter_shading_pdf = light_pdf / abs(enFrame.n.dot(inc_ray)) * inc_norm;
+						nee_dir = local_inc_ray;
+						nee_radiance = radiance;
+						nee_pdf = emitter_shading_pdf;
+	                    hemisphere_shading_pdf = m_guider->pdf(local_inc_ray, cell);
+	                    bool isresult_nan = CHECK_VALID(result.r());
+						Color3f direct = bsdf->eval(brec) * radiance  / (emitter_shading_pdf + hemisphere_shading_pdf) * Frame::cosTheta(local_inc_ray);
+						result += alpha * direct;
+						returns.addDirect(direct);
+	                    if (!isresult_nan && CHECK_VALID(result.r())) {
+	                        cout << tfm::format("112: alpha: %s\nh_pdf: %f, e_pdf: %f, radiance: %s\nits.p: %s, source: %s, its.n: %s, enFrame.n: %s\n",
+	                            alpha.toString(), hemisphere_shading_pdf, emitter_shading_pdf, radiance.toString(), its.p.toString(), source.toString(), its.shFrame.n.toString(), enFrame.n.toString());
+	                    }
+	                    //m_guider->update(its, e_its, sampler);
+					} while (false);
+					if (emitter)
+						m_lights.update(cell, emitter, light);
+					/* Samples that brought no light count too, as zero */
+					if (cell.direct)
+						m_guider->updateDirect(cell, nee_dir, nee_radiance, nee_pdf, sampler);
+				}
+				float survival;
+				int count = m_roulette.continuations(m_guider, cell, alpha, pixel, k, !returns.isEnabled(), sampler, survival);
+				if (count == 0)
+					break;
+				alpha *= survival;
+				for (int b = 1; b < count; b++) {
+					PathBranch branch;
+					BSDFQueryRecord brec = BSDFQueryRecord(wi);
+					branch.alpha = alpha * scatter(bsdf, cell, last_specular, sampler, brec);
+					branch.ray = Ray3f(its.p, its.shFrame.toWorld(brec.wo));
+					if (branch.alpha.isZero() || !scene->rayIntersect(branch.ray, branch.its))
+						continue;
+					branch.last_its = its;
+					branch.last_cell = cell;
+					branch.k = k + 1;
+					branch.last_specular = last_specular;
+					branches.push_back(branch);
+				}
+				BSDFQueryRecord brec = BSDFQueryRecord(wi);
+				Color3f weight = scatter(bsdf, cell, last_specular, sampler, brec);
+				alpha *= weight;
+				/* The returned radiance is weighted like the path, roulette included */
+				returns.scatter(weight * survival);
+				last_its = its;
+				std::swap(last_cell, cell);
+				ray_ = Ray3f(its.p, its.shFrame.toWorld(brec.wo));
+				if (!scene->rayIntersect(ray_, its))
+					break;
+				k++;
 			}
-			else {
+			if (branches.empty())
 				break;
-			}
-			k++;
+			PathBranch &branch = branches.back();
+			ray_ = branch.ray;
+			its = branch.its;
+			last_its = branch.last_its;
+			std::swap(last_cell, branch.last_cell);
+			alpha = branch.alpha;
+			k = branch.k;
+			last_specular = branch.last_specular;
+			branches.pop_back();
 		}
+		returns.finish(sampler);
+		if (GuiderTelemetry *telemetry = m_guider->getTelemetry())
+			telemetry->recordPath(vertices);
 		return result;
 	}
 
+	/* Sample the next direction at a vertex: from the BSDF if it is specular, else from the guider */
+	Color3f scatter(const BSDF *bsdf, const GuiderCell &cell, bool specular, Sampler *sampler, BSDFQueryRecord &brec) const {
+		if (specular)
+			return bsdf->sample(brec, sampler->next2D());
+		float pdf;
+		brec.wo = m_guider->sample(sampler->next2D(), cell, pdf);
+		brec.measure = ESolidAngle;
+		return bsdf->eval(brec) * Frame::cosTheta(brec.wo) / pdf;
+	}
+
+    void beginPass() {
+        m_guider->beginPass();
+    }
+
+    void endPass() {
+        m_guider->endPass();
+        m_lights.endPass();
+    }
+
+    bool converged() const {
+        return m_guider->converged();
+    }
+
     void done() {
         m_guider->done();
+        if (m_recorder) {
+            m_recorder->close();
+            cout << tfm::format("Recorded %d transitions to %s", m_recorder->getCount(), m_recorder->getFilename()) << endl;
+        }
     }
 
 	std::string toString() const {
@@ -147,6 +257,15 @@ public:
 	}
 protected:
     Guider* m_guider = nullptr;
+    LightPathPretrainer m_pretrainer;
+    QTermination m_termination;
+    AdjointRoulette m_roulette;
+    LightSelector m_lights;
+    bool m_neeUpdates;
+    bool m_returnUpdates;
+    float m_returnLambda;
+    std::string m_recordFilename;
+    std::unique_ptr<TransitionRecorder> m_recorder;
 };
 
 TRACER_REGISTER_CLASS(PathGuidedMISIntegrator, "path_guided_mis");
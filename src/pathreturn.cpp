@@ -0,0 +1,75 @@
+#include <tracer/pathreturn.h>
+
+TRACER_NAMESPACE_BEGIN
+
+PathReturns::PathReturns(Guider *guider, float lambda) : m_guider(guider), m_lambda(lambda) {
+    if (m_guider) {
+        m_vertices = &storage();
+        m_vertices->clear();
+    }
+}
+
+std::vector<PathReturns::Vertex> &PathReturns::storage() {
+    static thread_local std::vector<Vertex> vertices;
+    return vertices;
+}
+
+void PathReturns::addVertex(const GuiderCell &cell, Sampler *sampler) {
+    if (!m_guider)
+        return;
+    if (m_lambda < 1.0f && !m_vertices->empty())
+        m_vertices->back().td = m_guider->target(m_vertices->back().cell, cell, sampler);
+    m_vertices->emplace_back();
+    Vertex &v = m_vertices->back();
+    /* Only the location is needed for the final update, not the cached values */
+    v.cell.its = cell.its;
+    v.cell.wi = cell.wi;
+    v.cell.block = cell.block;
+    v.cell.normalBin = cell.normalBin;
+    v.cell.direct = cell.direct;
+    v.emitted = v.counted = v.direct = v.weight = v.reflected = Color3f(0.0f);
+    v.td = 0.0f;
+}
+
+void PathReturns::addEmission(const Color3f &emitted, const Color3f &counted) {
+    if (!m_guider || m_vertices->empty())
+        return;
+    m_vertices->back().emitted += emitted;
+    m_vertices->back().counted += counted;
+}
+
+void PathReturns::addDirect(const Color3f &direct) {
+    if (!m_guider || m_vertices->empty())
+        return;
+    m_vertices->back().direct += direct;
+}
+
+void PathReturns::scatter(const Color3f &weight) {
+    if (!m_guider || m_vertices->empty())
+        return;
+    m_vertices->back().weight = weight;
+}
+
+void PathReturns::finish(Sampler *sampler) {
+    if (!m_guider)
+        return;
+    std::vector<Vertex> &vertices = *m_vertices;
+    int n = (int)vertices.size();
+    if (n > 0)
+        vertices[n - 1].reflected = vertices[n - 1].direct;
+    for (int k = n - 2; k >= 0; k--) {
+        Vertex &v = vertices[k];
+        const Vertex &next = vertices[k + 1];
+        /* Radiance leaving the next vertex towards this one; the guider learns
+           the emission from the NEE samples of vertices with a direct table */
+        float value = (v.cell.direct ? next.reflected : next.emitted + next.reflected).sum();
+        if (m_lambda < 1.0f)
+            value = (1.0f - m_lambda) * v.td + m_lambda * value;
+        Vector3f di = v.cell.its.shFrame.toLocal((next.cell.its.p - v.cell.its.p).normalized());
+        m_guider->updateTarget(v.cell, di, value, sampler);
+        v.reflected = v.direct + v.weight * (next.counted + next.reflected);
+    }
+    vertices.clear();
+}
+
+TRACER_NAMESPACE_END
@@ -0,0 +1,90 @@
+#include <tracer/pretrain.h>
+#include <tracer/scene.h>
+#include <tracer/emitter.h>
+#include <tracer/sampler.h>
+#include <tracer/block.h>
+#include <tracer/timer.h>
+#include <tbb/parallel_for.h>
+#include <tbb/blocked_range.h>
+
+TRACER_NAMESPACE_BEGIN
+
+/* Light paths traced per task, each task seeds its own sampler */
+static const int PATHS_PER_TASK = 1024;
+
+LightPathPretrainer::LightPathPretrainer(const PropertyList &props) {
+    m_paths = props.getInteger("pretrainPaths", 0);
+    m_depth = props.getInteger("pretrainDepth", 8);
+    if (m_paths < 0 || m_depth < 1)
+        throw TracerException("LightPathPretrainer: pretrainPaths must be >= 0 and pretrainDepth >= 1");
+}
+
+void LightPathPretrainer::run(const Scene *scene, Guider *guider, bool direct) const {
+    if (!isEnabled() || scene->getEmitters().empty())
+        return;
+    cout << tfm::format("Pretraining guider with %d light paths ... ", m_paths);
+    cout.flush();
+    Timer timer;
+
+    int tasks = (m_paths + PATHS_PER_TASK - 1) / PATHS_PER_TASK;
+    tbb::parallel_for(tbb::blocked_range<int>(0, tasks), [&](const tbb::blocked_range<int> &range) {
+        std::unique_ptr<Sampler> sampler(scene->getSampler()->clone());
+        ImageBlock seed(Vector2i(1, 1), nullptr);
+        for (int task = range.begin(); task != range.end(); ++task) {
+            /* Negative offsets keep these streams apart from the image blocks */
+            seed.setOffset(Point2i(task, -1));
+            sampler->prepare(seed);
+            int end = std::min(m_paths, (task + 1) * PATHS_PER_TASK);
+            for (int i = task * PATHS_PER_TASK; i < end; i++)
+                trace(scene, guider, sampler.get(), direct);
+        }
+    });
+
+    cout << "done. (took " << timer.elapsedString() << ")" << endl;
+}
+
+void LightPathPretrainer::trace(const Scene *scene, Guider *guider, Sampler *sampler, bool direct) const {
+    float emitter_pdf, area_pdf;
+    const Emitter *emitter = scene->sampleEmitter(sampler->next1D(), emitter_pdf);
+    if (!emitter)
+        return;
+    /* Light paths start on the emitter and have no shading point to sample
+       towards, so the emitter gets the center of the scene as origin. It
+       must not alias p, which the emitter writes. */
+    const Point3f origin = scene->getBoundingBox().getCenter();
+    Point3f p;
+    Frame nFrame;
+    emitter->sample(origin, sampler->next2D(), p, nFrame, area_pdf);
+    Ray3f ray(p, nFrame.toWorld(Warp::squareToCosineHemisphere(sampler->next2D())));
+
+    /* The emitter vertex, found by tracing back from the first hit */
+    Intersection last, its;
+    if (!scene->rayIntersect(ray, its))
+        return;
+    if (!scene->rayIntersect(Ray3f(its.p, -ray.d), last) || !last.mesh->isEmitter())
+        return;
+
+    for (int k = 0; k < m_depth; k++) {
+        const BSDF *bsdf = its.mesh->getBSDF();
+        /* The emission arriving at diffuse vertices then goes to the direct table */
+        if (!(direct && last.mesh->isEmitter() && bsdf && bsdf->isDiffuse()))
+            guider->update(its, last, sampler);
+        if (its.mesh->isEmitter())
+            break;
+        if (!bsdf)
+            break;
+        BSDFQueryRecord brec(its.shFrame.toLocal(-ray.d));
+        if (bsdf->sample(brec, sampler->next2D()).isZero())
+            break;
+        ray = Ray3f(its.p, its.shFrame.toWorld(brec.wo));
+        last = its;
+        if (!scene->rayIntersect(ray, its))
+            break;
+    }
+}
+
+std::string LightPathPretrainer::toString() const {
+    return tfm::format("LightPathPretrainer[paths = %d, depth = %d]", m_paths, m_depth);
+}
+
+TRACER_NAMESPACE_END
@@ -0,0 +1,197 @@
+#include <tracer/qsnapshot.h>
+#include <cstddef>
+#include <fstream>
+#include <numeric>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+TRACER_NAMESPACE_BEGIN
+
+static const char SNAPSHOT_MAGIC[8] = { 'R', 'L', 'Q', 'T', 'A', 'B', 'L', 'E' };
+static const size_t SNAPSHOT_ALIGNMENT = 64;
+
+static uint64_t alignOffset(uint64_t offset) {
+    return (offset + SNAPSHOT_ALIGNMENT - 1) & ~(uint64_t)(SNAPSHOT_ALIGNMENT - 1);
+}
+
+QSnapshot::QSnapshot(const std::string &filename) {
+#if defined(_WIN32)
+    HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+        OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+        throw TracerException("Cannot open file %s", filename);
+    LARGE_INTEGER size;
+    GetFileSizeEx(file, &size);
+    m_size = (size_t)size.QuadPart;
+    m_file = file;
+    if (m_size >= sizeof(Header)) {
+        m_mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (m_mapping)
+            m_data = MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0);
+    }
+#else
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+        throw TracerException("Cannot open file %s", filename);
+    struct stat st;
+    fstat(fd, &st);
+    m_size = (size_t)st.st_size;
+    if (m_size >= sizeof(Header)) {
+        void *data = mmap(nullptr, m_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (data != MAP_FAILED)
+            m_data = data;
+    }
+    close(fd);
+#endif
+    if (!m_data) {
+        unmap();
+        throw TracerException("Cannot map Q-table snapshot %s", filename);
+    }
+
+    const uint8_t *base = (const uint8_t *)m_data;
+    m_header = (const Header *)base;
+    std::string error;
+    if (memcmp(m_header->magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0)
+        error = "not a Q-table snapshot";
+    else if (m_header->version != VERSION)
+        error = tfm::format("unsupported version %d (expected %d)", m_header->version, (int)VERSION);
+    else if (m_header->precision > QValueCodec::ELog8)
+        error = "unknown precision";
+    else {
+        m_codec = QValueCodec((QValueCodec::EPrecision)m_header->precision);
+        uint64_t indexEnd = m_header->indexOffset + m_header->cellCount * sizeof(int32_t),
+                 payloadEnd = m_header->payloadOffset + m_header->cellCount * m_header->recordBytes;
+        if (m_header->recordBytes != recordBytes(m_header->binCount, m_codec))
+            error = "inconsistent record size";
+        else if (indexEnd > m_size || payloadEnd > m_size || m_header->payloadOffset < indexEnd)
+            error = "truncated file";
+        else {
+            m_index = (const int32_t *)(base + m_header->indexOffset);
+            m_payload = base + m_header->payloadOffset;
+            uint64_t hash = checksum(m_header, offsetof(Header, indexChecksum));
+            hash = checksum(m_index, m_header->cellCount * sizeof(int32_t), hash);
+            if (hash != m_header->indexChecksum)
+                error = "index checksum mismatch";
+        }
+    }
+    if (!error.empty()) {
+        unmap();
+        throw TracerException("Invalid Q-table snapshot %s: %s", filename, error);
+    }
+}
+
+QSnapshot::~QSnapshot() {
+    unmap();
+}
+
+void QSnapshot::unmap() {
+#if defined(_WIN32)
+    if (m_data)
+        UnmapViewOfFile(m_data);
+    if (m_mapping)
+        CloseHandle(m_mapping);
+    if (m_file)
+        CloseHandle(m_file);
+    m_mapping = m_file = nullptr;
+#else
+    if (m_data)
+        munmap(m_data, m_size);
+#endif
+    m_data = nullptr;
+}
+
+BoundingBox3f QSnapshot::getBounds() const {
+    const float *b = m_header->bounds;
+    return BoundingBox3f(Point3f(b[0], b[1], b[2]), Point3f(b[3], b[4], b[5]));
+}
+
+ptrdiff_t QSnapshot::find(int32_t key) const {
+    const int32_t *end = m_index + m_header->cellCount;
+    const int32_t *it = std::lower_bound(m_index, end, key);
+    if (it == end || *it != key)
+        return -1;
+    return it - m_index;
+}
+
+bool QSnapshot::verify() const {
+    return checksum(m_payload, m_header->cellCount * m_header->recordBytes) == m_header->payloadChecksum;
+}
+
+uint64_t QSnapshot::checksum(const void *data, size_t size, uint64_t hash) {
+    const uint8_t *bytes = (const uint8_t *)data;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+QSnapshotWriter::QSnapshotWriter(QSnapshot::EGuiderType type, const QValueCodec &codec,
+        int sceneResolution, int angleResolution, uint32_t binCount,
+        const BoundingBox3f &bounds) : m_codec(codec) {
+    memset(&m_header, 0, sizeof(QSnapshot::Header));
+    memcpy(m_header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    m_header.version = QSnapshot::VERSION;
+    m_header.guiderType = type;
+    m_header.precision = codec.getPrecision();
+    m_header.sceneResolution = sceneResolution;
+    m_header.angleResolution = angleResolution;
+    m_header.binCount = binCount;
+    m_header.recordBytes = QSnapshot::recordBytes(binCount, codec);
+    for (int i = 0; i < 3; i++) {
+        m_header.bounds[i] = bounds.min[i];
+        m_header.bounds[i + 3] = bounds.max[i];
+    }
+}
+
+void QSnapshotWriter::add(int32_t key, const uint8_t *values, const uint8_t *visits) {
+    size_t offset = m_records.size();
+    m_keys.push_back(key);
+    m_records.resize(offset + m_header.recordBytes, 0);
+    memcpy(&m_records[offset], values, m_header.binCount * m_codec.valueBytes());
+    memcpy(&m_records[offset + QSnapshot::visitOffset(m_header.binCount, m_codec)], visits,
+        m_header.binCount * m_codec.visitBytes());
+}
+
+void QSnapshotWriter::write(const std::string &filename) {
+    std::ofstream file(filename, std::ios::binary | std::ios::out);
+    if (!file.is_open())
+        throw TracerException("Cannot open file %s to write", filename);
+
+    /* Sort the cells by key */
+    size_t count = m_keys.size(), stride = m_header.recordBytes;
+    std::vector<size_t> order(count);
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b) { return m_keys[a] < m_keys[b]; });
+    std::vector<int32_t> index(count);
+    std::vector<uint8_t> payload(count * stride);
+    for (size_t i = 0; i < count; i++) {
+        index[i] = m_keys[order[i]];
+        memcpy(&payload[i * stride], &m_records[order[i] * stride], stride);
+    }
+
+    m_header.cellCount = count;
+    m_header.indexOffset = alignOffset(sizeof(QSnapshot::Header));
+    m_header.payloadOffset = alignOffset(m_header.indexOffset + count * sizeof(int32_t));
+    uint64_t hash = QSnapshot::checksum(&m_header, offsetof(QSnapshot::Header, indexChecksum));
+    m_header.indexChecksum = QSnapshot::checksum(index.data(), count * sizeof(int32_t), hash);
+    m_header.payloadChecksum = QSnapshot::checksum(payload.data(), payload.size());
+
+    static const char padding[SNAPSHOT_ALIGNMENT] = { 0 };
+    file.write((const char *)&m_header, sizeof(QSnapshot::Header));
+    file.write(padding, m_header.indexOffset - sizeof(QSnapshot::Header));
+    file.write((const char *)index.data(), count * sizeof(int32_t));
+    file.write(padding, m_header.payloadOffset - m_header.indexOffset - count * sizeof(int32_t));
+    file.write((const char *)payload.data(), payload.size());
+    if (!file)
+        throw TracerException("Error while writing %s", filename);
+}
+
+TRACER_NAMESPACE_END
@@ -5,9 +5,16 @@
 #include <tracer/emitter.h>
 #include <tracer/bsdf.h>
 #include <tracer/warp.h>
+#include <tracer/qsnapshot.h>
+#include <tracer/telemetry.h>
+#include <tracer/thinning.h>
+#include <tracer/statehash.h>
+#include <tracer/convergence.h>
 #include <tbb/spin_rw_mutex.h>
 #include <tbb/concurrent_vector.h>
 #include <tbb/concurrent_hash_map.h>
+#include <atomic>
+#include <memory>
 
 TRACER_NAMESPACE_BEGIN
 
@@ -15,15 +22,35 @@ class QTableGuider : public Guider {
 protected:
     template<typename Scalar>
     struct RangeTree;
+
+    enum EEvictionPolicy {
+        ELeastRecent = 0,
+        ELowestValue
+    };
+
     struct Wrapper {
-        RangeTree<float>* tree;
-        int* visit;
+        RangeTree<float>* tree = nullptr;
+        int* visit = nullptr;
+        /* Last pass in which the cell was used */
+        int lastPass = 0;
+        /* Sum of the visit counts, to pick the level of detail of hashed states */
+        int64_t total = 0;
+        /* Summed NEE estimates of the direct radiance per bin and their count, see updateDirect(); allocated by the first sample */
+        float* direct = nullptr;
+        float directCount = 0.0f;
 
         ~Wrapper() {
             if (tree)
                 delete tree;
             if (visit)
                 delete[] visit;
+            if (direct)
+                delete[] direct;
+        }
+
+        /* Incident radiance of bin b: the learned values plus the direct radiance estimated from NEE */
+        float value(int b) const {
+            return tree->m_data[b] + (direct ? direct[b] / directCount : 0.0f);
         }
 
         void init(int width, int height) {
@@ -31,12 +58,19 @@ protected:
             visit = new int[width * height];
             memset(visit, 0, width * height * sizeof(int));
         }
+
+        void init(int width, int height, const std::function<float(int, int)>& initializer) {
+            tree = new RangeTree<float>(width, height, initializer);
+            visit = new int[width * height];
+            memset(visit, 0, width * height * sizeof(int));
+        }
     };
     typedef tbb::concurrent_hash_map<int, Wrapper> WrapperMap;
 public:
-    QTableGuider(const PropertyList &props): m_storage(10000) {
+    QTableGuider(const PropertyList &props): m_storage(10000), m_thinning(props), m_convergence(props) {
         m_sceneResolution = props.getInteger("sceneResolution", 50);
         m_angleResolution = props.getInteger("angleResolution", 8);
+        m_kernels = &GuiderKernels::get(m_angleResolution);
         try {
             m_alpha = props.getFloat("alpha");
             m_useVisit = false;
@@ -44,6 +78,35 @@ public:
         catch (TracerException e) {
             //alpha doesn't exist
         }
+        m_productSampling = props.getBoolean("productSampling", false);
+        /* Also samples the bins cached in cell handles when product sampling is off */
+        m_product.init(m_angleResolution, props.getInteger("productSubdivision", 2));
+        /* Memory budget in MiB for the cell storage, 0 means unlimited */
+        m_memoryBudget = (size_t)props.getInteger("memoryBudget", 0) << 20;
+        m_maxCells = m_memoryBudget / cellBytes();
+        if (m_memoryBudget > 0 && m_maxCells == 0)
+            throw TracerException("QTableGuider: memoryBudget is too small to hold a single cell");
+        std::string eviction = props.getString("eviction", "lru");
+        if (eviction == "lru")
+            m_eviction = ELeastRecent;
+        else if (eviction == "lowvalue")
+            m_eviction = ELowestValue;
+        else
+            throw TracerException("QTableGuider: unknown eviction policy \"%s\"", eviction);
+        m_fallbackFactor = props.getInteger("fallbackFactor", 4);
+        m_fallbackResolution = std::max(1, m_sceneResolution / m_fallbackFactor);
+        std::string stateKey = props.getString("stateKey", "grid");
+        if (stateKey == "hashed")
+            m_stateHash.reset(new StateHash(props));
+        else if (stateKey != "grid")
+            throw TracerException("QTableGuider: unknown state key \"%s\"", stateKey);
+        m_uniform.init(m_angleResolution, m_angleResolution);
+        m_importFilename = props.getString("import", "");
+        m_exportFilename = props.getString("export", "");
+        m_verifyImport = props.getBoolean("verifyImport", false);
+        std::string telemetry = props.getString("telemetry", "");
+        if (telemetry.length() > 0)
+            m_telemetry.reset(new GuiderTelemetry(telemetry, props.getFloat("telemetryInterval", 0.0f)));
     }
 
     /* Integrator need to call this in preprocess() */
@@ -52,105 +115,628 @@ public:
         Point3f orig_max = m_sceneBox.max;
         m_sceneBox.expandBy(orig_max + Vector3f(Epsilon));
         m_sceneBlockSize = (m_sceneBox.max - m_sceneBox.min) / m_sceneResolution;
+        if (m_importFilename.length() > 0) {
+            // Map the snapshot; range trees are built when a cell is first touched
+            m_snapshot.reset(new QSnapshot(m_importFilename));
+            const QSnapshot::Header& header = m_snapshot->getHeader();
+            if (header.guiderType != (m_stateHash ? QSnapshot::EHemisphereHashed : QSnapshot::EHemisphere))
+                throw TracerException("QTableGuider: %s was not exported by a qtable guider with stateKey=%s",
+                    m_importFilename, m_stateHash ? "hashed" : "grid");
+            if (header.sceneResolution != m_sceneResolution || header.angleResolution != m_angleResolution)
+                throw TracerException("QTableGuider: %s has resolution %d/%d, expected %d/%d", m_importFilename,
+                    header.sceneResolution, header.angleResolution, m_sceneResolution, m_angleResolution);
+            if (m_verifyImport && !m_snapshot->verify())
+                throw TracerException("QTableGuider: checksum mismatch in %s", m_importFilename);
+            m_sceneBox = m_snapshot->getBounds();
+            m_sceneBlockSize = (m_sceneBox.max - m_sceneBox.min) / m_sceneResolution;
+            cout << tfm::format("Mapped %d Q-table cells from %s", m_snapshot->getCellCount(), m_importFilename) << endl;
+        }
+        if (m_stateHash)
+            m_stateHash->init(m_sceneBox, m_sceneResolution);
     }
 
     Vector3f sample(const Point2f& sample, const Intersection& its, float& pdf) {
-        int block_idx = locateBlock(its.p);
-        Point2f result;
+        int block_idx = locateState(its);
         WrapperMap::const_accessor const_access;
         WrapperMap::accessor access;
-        if (m_storage.find(const_access, block_idx)) {
-            result = const_access->second.tree->warp(sample, pdf);
+        if (lookupCell(const_access, block_idx))
+            return sampleCell(const_access->second, sample, pdf);
+        else if (acquireCell(access, block_idx))
+            return sampleCell(access->second, sample, pdf);
+        return sampleCell(m_uniform, sample, pdf);
+    }
+
+    /* Sample the incident radiance of a cell, the direct table included like the values locate() hands out */
+    Vector3f sampleCell(const Wrapper& cell, const Point2f& sample, float& pdf) const {
+        if (cell.direct) {
+            SphereScratch q(m_angleResolution * m_angleResolution);
+            const float *v = values(cell, q.data());
+            return m_product.sample(v, m_kernels->sum(v, m_angleResolution), sample, pdf);
+        }
+        Point2f result = cell.tree->warp(sample, pdf);
+        pdf *= INV_TWOPI;
+        return EqualAreaMap::squareToHemisphere(result);
+    }
+
+    /* Density of sampleCell() along di, which lies in bin (ox, oy) */
+    float pdfCell(const Wrapper& cell, const Vector3f& di, int ox, int oy) const {
+        if (cell.direct) {
+            SphereScratch q(m_angleResolution * m_angleResolution);
+            const float *v = values(cell, q.data());
+            return m_product.pdf(v, m_kernels->sum(v, m_angleResolution), di);
+        }
+        return cell.tree->getPdf(ox, oy);
+    }
+
+    void update(const Intersection& origin, const Intersection& dest, Sampler* sampler) {
+        const Vector3f ray = (dest.p - origin.p).normalized();
+        int block_orig_idx = locateState(origin);
+        float weight = thin(origin, block_orig_idx, ray, sampler);
+        if (weight == 0.0f)
+            return;
+        int block_dest_idx = locateState(dest);
+        WrapperMap::const_accessor const_access_dest;
+        WrapperMap::accessor access_dest;
+        float integral_term;
+        SphereScratch q(m_angleResolution * m_angleResolution);
+        if (lookupCell(const_access_dest, block_dest_idx)) {
+            integral_term = integral(origin, dest, values(const_access_dest->second, q.data()), sampler);
+            const_access_dest.release();
+        }
+        else if (acquireCell(access_dest, block_dest_idx)) {
+            integral_term = integral(origin, dest, values(access_dest->second, q.data()), sampler);
+            access_dest.release();
         }
         else {
-            if (m_storage.insert(access, block_idx)) {
-                access->second.init(m_angleResolution, m_angleResolution);
+            integral_term = integral(origin, dest, m_uniform.tree->m_data, sampler);
+        }
+        splat(origin, block_orig_idx, ray, integral_term, sampler, weight);
+    }
+
+    void update(const GuiderCell& origin, const GuiderCell& dest, Sampler* sampler) {
+        const Vector3f ray = (dest.its.p - origin.its.p).normalized();
+        float weight = thin(origin.its, origin.block, ray, sampler);
+        if (weight > 0.0f)
+            splat(origin.its, origin.block, ray, target(origin, dest, sampler), sampler, weight);
+    }
+
+    float target(const GuiderCell& origin, const GuiderCell& dest, Sampler* sampler) {
+        /* The direct table of origin already holds the emission of dest */
+        return integral(origin.its, dest.its, dest.values.data(), sampler, !origin.direct);
+    }
+
+    bool reflected(const GuiderCell& cell, Sampler* sampler, Color3f& result) {
+        const BSDF *bsdf = cell.its.mesh->getBSDF();
+        if (!bsdf || !bsdf->isDiffuse() || Frame::cosTheta(cell.wi) <= 0)
+            return false;
+        result = reflectBins(bsdf, cell.wi, cell.values.data(), m_angleResolution, sampler);
+        return true;
+    }
+
+    /* Q-values are incident radiance, so value directly estimates the bin along di */
+    void updateTarget(const GuiderCell& cell, const Vector3f& di, float value, Sampler* sampler) {
+        const Vector3f ray = cell.its.shFrame.toWorld(di);
+        float weight = thin(cell.its, cell.block, ray, sampler);
+        if (weight > 0.0f)
+            splat(cell.its, cell.block, ray, value, sampler, weight);
+    }
+
+    /**
+     * Learn the direct radiance of the cell from a NEE sample, in a table of
+     * its own. Each sample estimates the mean direct radiance of every bin,
+     * radiance / (pdf * bin solid angle) for the bin containing di and zero
+     * for the others; the table keeps their sum and count. Averaging these
+     * into the Q-values instead would be biased: light samples are not
+     * spread uniformly over their bin, and they do not see indirect light.
+     */
+    void updateDirect(const GuiderCell& cell, const Vector3f& di, const Color3f& radiance, float pdf, Sampler* sampler) {
+        if (m_convergence.isConverged())
+            return;
+        int size = m_angleResolution * m_angleResolution, bin = -1;
+        float estimate = 0.0f;
+        if (pdf > 0.0f && Frame::cosTheta(di) > 0.0f && radiance.isValid() && !radiance.isZero()) {
+            bin = locateDirection(di);
+            estimate = radiance.sum() / (pdf * 2.0f * M_PI / size);
+        }
+        int blocks[StateHash::MAX_LEVELS] = { cell.block };
+        int count = 1;
+        if (m_stateHash) {
+            count = m_stateHash->getLevels();
+            for (int l = 0; l < count; l++)
+                blocks[l] = m_stateHash->key(cell.its.p, cell.its.shFrame.n, l);
+        }
+        for (int c = 0; c < count; c++) {
+            WrapperMap::accessor access;
+            if (!acquireCell(access, blocks[c]))
+                continue;
+            Wrapper &wrapper = access->second;
+            if (!wrapper.direct) {
+                wrapper.direct = new float[size];
+                memset(wrapper.direct, 0, size * sizeof(float));
             }
-            result = access->second.tree->warp(sample, pdf);
+            if (bin >= 0)
+                wrapper.direct[bin] += estimate;
+            wrapper.directCount += 1.0f;
         }
-        pdf *= INV_TWOPI;
-        return Warp::squareToUniformHemisphere(result);
     }
 
-    void update(const Intersection& origin, const Intersection& dest, Sampler* sampler) {
-        const Vector3f& ray = (dest.p - origin.p).normalized(),
-                origin_wo = origin.shFrame.toLocal(ray),
-                dest_wi = dest.shFrame.toLocal(-ray);
-        int ox, oy;
-        int block_orig_idx = locateBlock(origin.p), angle_orig_idx = locateDirection(origin_wo, ox, oy);
-        int block_dest_idx = locateBlock(dest.p);
+    bool hasDirectTable() const { return true; }
 
-        WrapperMap::const_accessor const_access_dest;
-        WrapperMap::accessor access_dest, access_orig;
+    /* The incident radiance of every bin of a cell, see Wrapper::value() */
+    const float* values(const Wrapper& cell, float* scratch) const {
+        if (!cell.direct)
+            return cell.tree->m_data;
+        for (int b = 0; b < m_angleResolution * m_angleResolution; b++)
+            scratch[b] = cell.value(b);
+        return scratch;
+    }
+
+    /* Importance weight of an update of the bin along ray in cell block_idx, 0 if the thinning policy rejects it or training has converged */
+    float thin(const Intersection& origin, int block_idx, const Vector3f& ray, Sampler* sampler) {
+        if (m_convergence.isConverged())
+            return 0.0f;
+        if (!m_thinning.isEnabled())
+            return 1.0f;
+        int bin = locateDirection(origin.shFrame.toLocal(ray));
+        int64_t visits = 0;
+        WrapperMap::const_accessor const_access;
+        if (findCell(const_access, block_idx)) {
+            visits = const_access->second.visit[bin];
+        }
+        else if (m_snapshot) {
+            ptrdiff_t i = m_snapshot->find(block_idx);
+            if (i >= 0)
+                visits = m_snapshot->getCodec().getVisit(m_snapshot->getVisits(i), bin);
+        }
+        return m_thinning.accept(visits, sampler->next1D());
+    }
 
+    /* New estimate for the bin of origin towards dest: the Q-values q of the dest cell integrated against its BSDF, plus emission if emitted is set */
+    float integral(const Intersection& origin, const Intersection& dest, const float* q, Sampler* sampler, bool emitted = true) const {
+        const Vector3f ray = (dest.p - origin.p).normalized(),
+                dest_wi = dest.shFrame.toLocal(-ray);
         float integral_term = 0.0f;
         const BSDF *bsdf = dest.mesh->getBSDF();
         BSDFQueryRecord brec = BSDFQueryRecord(dest_wi);
-        auto integral_job = [&](auto& accessor) {
-            if (bsdf->isDiffuse()) {
-                brec.measure = ESolidAngle;
-                for (int i = 0; i < m_angleResolution; i++) {
-                    for (int j = 0; j < m_angleResolution; j++) {
-                        Point2f sample = (sampler->next2D() + Point2f(i, j)) / m_angleResolution;
-                        brec.wo = Warp::squareToUniformHemisphere(sample);
-                        float eval = bsdf->eval(brec).maxCoeff();
-                        float normal_q = accessor->second.tree->get(i, j);
-                        float term = normal_q * Frame::cosTheta(brec.wo) * eval;
-                        integral_term += term;
-                    }
+        if (bsdf->isDiffuse()) {
+            brec.measure = ESolidAngle;
+            for (int i = 0; i < m_angleResolution; i++) {
+                for (int j = 0; j < m_angleResolution; j++) {
+                    Point2f sample = (sampler->next2D() + Point2f(i, j)) / m_angleResolution;
+                    brec.wo = EqualAreaMap::squareToHemisphere(sample);
+                    float eval = bsdf->eval(brec).maxCoeff();
+                    float normal_q = q[i * m_angleResolution + j];
+                    float term = normal_q * Frame::cosTheta(brec.wo) * eval;
+                    integral_term += term;
                 }
             }
-            else {
-                //We need to sample the incident ray because brdf is always 0
-                for (int i = 0; i < m_angleResolution * m_angleResolution; i++) {
-                    bsdf->sample(brec, sampler->next2D());
-                    int tx, ty;
-                    locateDirection(brec.wo, tx, ty);
-                    integral_term += accessor->second.tree->get(tx, ty);
-                }
-            }
-            accessor.release();
-        };
-        if (m_storage.find(const_access_dest, block_dest_idx)) {
-            integral_job(const_access_dest);
         }
         else {
-            if (m_storage.insert(access_dest, block_dest_idx)) {
-                access_dest->second.init(m_angleResolution, m_angleResolution);
+            //We need to sample the incident ray because brdf is always 0
+            for (int i = 0; i < m_angleResolution * m_angleResolution; i++) {
+                bsdf->sample(brec, sampler->next2D());
+                integral_term += q[locateDirection(brec.wo)];
             }
-            integral_job(access_dest);
         }
         integral_term *= 2.0f * M_PI / m_angleResolution / m_angleResolution;
-        if (dest.mesh->isEmitter()) {
+        if (emitted && dest.mesh->isEmitter()) {
             integral_term += dest.mesh->getEmitter()->getRadiance(dest.p, dest_wi).sum();
         }
+        return integral_term;
+    }
 
-
-        if (m_storage.insert(access_orig, block_orig_idx)) {
-            access_orig->second.init(m_angleResolution, m_angleResolution);
+    /**
+     * Blend a new estimate into the bin of the cell block_orig_idx that points
+     * from origin along the world direction ray. The estimate counts as
+     * weight identical updates. Hashed states update every level of detail
+     * of origin instead.
+     */
+    void splat(const Intersection& origin, int block_orig_idx, const Vector3f& ray, float integral_term, Sampler* sampler, float weight = 1.0f) {
+        if (m_telemetry)
+            m_telemetry->recordUpdate();
+        int ox, oy;
+        int angle_orig_idx = locateDirection(origin.shFrame.toLocal(ray), ox, oy);
+        int blocks[StateHash::MAX_LEVELS] = { block_orig_idx };
+        int count = 1;
+        if (m_stateHash) {
+            count = m_stateHash->getLevels();
+            for (int l = 0; l < count; l++)
+                blocks[l] = m_stateHash->key(origin.p, origin.shFrame.n, l);
+        }
+        /* Fractional visits are rounded stochastically */
+        int whole = (int)weight;
+        if (weight > whole && sampler->next1D() < weight - whole)
+            whole++;
+        for (int c = 0; c < count; c++) {
+            WrapperMap::accessor access_orig;
+            if (!acquireCell(access_orig, blocks[c]))
+                continue;
+            int &visit = access_orig->second.visit[angle_orig_idx];
+            float alpha = m_useVisit ? weight / (visit + weight) : 1.0f - std::pow(1.0f - m_alpha, weight);
+            float oldval = access_orig->second.tree->get(ox, oy);
+            float newval = (1.0f - alpha) * oldval + alpha * integral_term;
+            access_orig->second.tree->update(ox, oy, newval);
+            visit += whole;
+            access_orig->second.total += whole;
         }
-        float alpha = m_useVisit ? 1.0f / (1 + access_orig->second.visit[angle_orig_idx]) : m_alpha;
-        float oldval = access_orig->second.tree->get(ox, oy);
-        float newval = (1.0f - alpha) * oldval + alpha * integral_term;
-        access_orig->second.tree->update(ox, oy, newval);
-        access_orig->second.visit[angle_orig_idx]++;
     }
 
     float pdf(const Vector3f& di, const Intersection& origin) {
         int ox, oy;
-        int block_idx = locateBlock(origin.p), angle_idx = locateDirection(di, ox, oy);
+        int block_idx = locateState(origin), angle_idx = locateDirection(di, ox, oy);
         WrapperMap::const_accessor const_access;
         WrapperMap::accessor access;
-        if (m_storage.find(const_access, block_idx)) {
-            return const_access->second.tree->getPdf(ox, oy);
+        if (lookupCell(const_access, block_idx))
+            return pdfCell(const_access->second, di, ox, oy);
+        else if (acquireCell(access, block_idx))
+            return pdfCell(access->second, di, ox, oy);
+        return pdfCell(m_uniform, di, ox, oy);
+    }
+
+    Vector3f sampleProduct(const Point2f& sample, const Intersection& its, const Vector3f& wi, float& pdf) {
+        const BSDF *bsdf = its.mesh->getBSDF();
+        Vector3f di;
+        if (!m_productSampling || !BSDFProduct::applicable(bsdf, wi)) {
+            di = this->sample(sample, its, pdf);
         }
         else {
-            if (m_storage.insert(access, block_idx)) {
+            SphereScratch products(m_angleResolution * m_angleResolution);
+            float total = productWeights(its, bsdf, wi, products.data());
+            di = m_product.sample(products.data(), total, sample, pdf);
+        }
+        if (m_telemetry)
+            m_telemetry->recordSample(pdf);
+        return di;
+    }
+
+    float pdfProduct(const Vector3f& di, const Intersection& origin, const Vector3f& wi) {
+        const BSDF *bsdf = origin.mesh->getBSDF();
+        if (!m_productSampling || !BSDFProduct::applicable(bsdf, wi))
+            return pdf(di, origin);
+        SphereScratch products(m_angleResolution * m_angleResolution);
+        float total = productWeights(origin, bsdf, wi, products.data());
+        return m_product.pdf(products.data(), total, di);
+    }
+
+    using Guider::sample;
+    using Guider::pdf;
+    using Guider::update;
+
+    void locate(const Intersection& its, const Vector3f& wi, GuiderCell& cell) {
+        int size = m_angleResolution * m_angleResolution;
+        cell.its = its;
+        cell.wi = wi;
+        cell.block = locateState(its);
+        cell.values.resize(size);
+        auto copy = [&](const Wrapper& wrapper) {
+            for (int b = 0; b < size; b++)
+                cell.values[b] = wrapper.value(b);
+            cell.visits = wrapper.total;
+        };
+        WrapperMap::const_accessor const_access;
+        WrapperMap::accessor access;
+        if (lookupCell(const_access, cell.block)) {
+            copy(const_access->second);
+            const_access.release();
+        }
+        else if (acquireCell(access, cell.block)) {
+            copy(access->second);
+            access.release();
+        }
+        else {
+            copy(m_uniform);
+        }
+        cell.weights = cell.values;
+        const BSDF *bsdf = its.mesh->getBSDF();
+        cell.product = m_productSampling && BSDFProduct::applicable(bsdf, wi);
+        if (cell.product) {
+            cell.total = m_product.multiply(bsdf, wi, cell.weights.data());
+        }
+        else {
+            cell.total = m_kernels->sum(cell.weights.data(), m_angleResolution);
+        }
+    }
+
+    Vector3f sample(const Point2f& sample, const GuiderCell& cell, float& pdf) {
+        Vector3f di = m_product.sample(cell.weights.data(), cell.total, sample, pdf);
+        if (m_telemetry)
+            m_telemetry->recordSample(pdf);
+        return di;
+    }
+
+    float pdf(const Vector3f& di, const GuiderCell& cell) {
+        return m_product.pdf(cell.weights.data(), cell.total, di);
+    }
+
+    /* Gather the bins of the cell around its and multiply them by the BSDF lobe */
+    float productWeights(const Intersection& its, const BSDF* bsdf, const Vector3f& wi, float* products) {
+        int block_idx = locateState(its);
+        WrapperMap::const_accessor const_access;
+        WrapperMap::accessor access;
+        auto gather = [&](const Wrapper& cell) {
+            for (int i = 0; i < m_angleResolution; i++) {
+                for (int j = 0; j < m_angleResolution; j++) {
+                    products[i * m_angleResolution + j] = cell.value(i * m_angleResolution + j);
+                }
+            }
+        };
+        if (lookupCell(const_access, block_idx)) {
+            gather(const_access->second);
+            const_access.release();
+        }
+        else if (acquireCell(access, block_idx)) {
+            gather(access->second);
+            access.release();
+        }
+        else {
+            gather(m_uniform);
+        }
+        return m_product.multiply(bsdf, wi, products);
+    }
+
+    /**
+     * Acquire write access to the cell block_idx, creating it if needed. Once
+     * the memory budget is exhausted no new cells are born; the coarse
+     * fallback cell enclosing block_idx stands in for it. Hashed states have
+     * their coarser levels as fallback: false is then returned for a missing
+     * cell, and callers use the shared uniform cell.
+     */
+    bool acquireCell(WrapperMap::accessor& access, int block_idx) {
+        if (findCell(access, block_idx)) {
+            access->second.lastPass = m_pass;
+            return true;
+        }
+        /* Reserve the slot before inserting, so that concurrent insertions
+           cannot take the storage past the budget */
+        size_t reserved = m_cellCount.fetch_add(1);
+        if (m_maxCells > 0 && reserved >= m_maxCells) {
+            m_cellCount--;
+            if (m_stateHash)
+                return findCell(access, block_idx);
+            if (!findCell(access, block_idx) && insertCell(m_fallback, access, fallbackBlock(block_idx))) {
                 access->second.init(m_angleResolution, m_angleResolution);
+                m_fallbackCount++;
+            }
+            return true;
+        }
+        if (!insertCell(access, block_idx)) {
+            /* Inserted by another thread in the meantime */
+            m_cellCount--;
+        }
+        else {
+            ptrdiff_t i = m_snapshot ? m_snapshot->find(block_idx) : -1;
+            if (i >= 0) {
+                const QValueCodec& codec = m_snapshot->getCodec();
+                const uint8_t *values = m_snapshot->getValues(i), *visits = m_snapshot->getVisits(i);
+                access->second.init(m_angleResolution, m_angleResolution, [&](int x, int y) -> float {
+                    return codec.get(values, x * m_angleResolution + y);
+                });
+                for (int k = 0; k < m_angleResolution * m_angleResolution; k++) {
+                    access->second.visit[k] = codec.getVisit(visits, k);
+                    access->second.total += access->second.visit[k];
+                }
+            }
+            else {
+                access->second.init(m_angleResolution, m_angleResolution);
+            }
+        }
+        access->second.lastPass = m_pass;
+        return true;
+    }
+
+    /* Look up a cell for reading, counting the time spent in the telemetry */
+    bool findCell(WrapperMap::const_accessor& access, int block_idx) const {
+        GuiderTelemetry::WaitTimer wait(m_telemetry.get());
+        return m_storage.find(access, block_idx);
+    }
+
+    /* Look up a cell for writing, counting the time spent in the telemetry */
+    bool findCell(WrapperMap::accessor& access, int block_idx) {
+        GuiderTelemetry::WaitTimer wait(m_telemetry.get());
+        return m_storage.find(access, block_idx);
+    }
+
+    /* Find or insert a cell for writing, counting the time spent in the telemetry; true if inserted */
+    bool insertCell(WrapperMap& cells, WrapperMap::accessor& access, int block_idx) {
+        GuiderTelemetry::WaitTimer wait(m_telemetry.get());
+        return cells.insert(access, block_idx);
+    }
+
+    bool insertCell(WrapperMap::accessor& access, int block_idx) {
+        return insertCell(m_storage, access, block_idx);
+    }
+
+    /* Index of the coarse fallback cell enclosing block_idx */
+    int fallbackBlock(int block_idx) const {
+        int z = block_idx % m_sceneResolution,
+            y = (block_idx / m_sceneResolution) % m_sceneResolution,
+            x = block_idx / m_sceneResolution / m_sceneResolution;
+        x = std::min(x / m_fallbackFactor, m_fallbackResolution - 1);
+        y = std::min(y / m_fallbackFactor, m_fallbackResolution - 1);
+        z = std::min(z / m_fallbackFactor, m_fallbackResolution - 1);
+        return (x * m_fallbackResolution + y) * m_fallbackResolution + z;
+    }
+
+    /**
+     * Look up a cell for sampling or evaluation. Lookups count as uses for
+     * the LRU eviction: the first one of each pass takes the write lock to
+     * mark the cell, the others only read.
+     */
+    bool lookupCell(WrapperMap::const_accessor& const_access, int block_idx) {
+        if (!findCell(const_access, block_idx))
+            return false;
+        if (m_maxCells == 0 || const_access->second.lastPass == m_pass)
+            return true;
+        const_access.release();
+        {
+            WrapperMap::accessor access;
+            if (findCell(access, block_idx))
+                access->second.lastPass = m_pass;
+        }
+        return findCell(const_access, block_idx);
+    }
+
+    /* Total visits of a cell, or -1 if it is neither stored nor imported */
+    int64_t cellVisits(int block_idx) const {
+        WrapperMap::const_accessor const_access;
+        if (findCell(const_access, block_idx))
+            return const_access->second.total;
+        if (m_snapshot) {
+            ptrdiff_t i = m_snapshot->find(block_idx);
+            if (i >= 0) {
+                int64_t total = 0;
+                for (int k = 0; k < m_angleResolution * m_angleResolution; k++)
+                    total += m_snapshot->getCodec().getVisit(m_snapshot->getVisits(i), k);
+                return total;
             }
-            return access->second.tree->getPdf(ox, oy);
         }
-        return 0.0f;
+        return -1;
+    }
+
+    /* Gather per-cell statistics and write a telemetry record; not thread safe */
+    void writeTelemetry(const std::string& event) {
+        int size = m_angleResolution * m_angleResolution;
+        m_telemetry->beginCells();
+        for (WrapperMap::const_iterator it = m_storage.begin(); it != m_storage.end(); ++it) {
+            int64_t visits = 0;
+            for (int i = 0; i < size; i++)
+                visits += it->second.visit[i];
+            m_telemetry->addCell(it->second.tree->m_data, size, visits);
+        }
+        m_telemetry->record(event, m_pass, memoryUsage());
+    }
+
+    /* Compare the stored cells to the previous pass; not thread safe */
+    void trackConvergence() {
+        m_convergence.beginCells();
+        for (WrapperMap::const_iterator it = m_storage.begin(); it != m_storage.end(); ++it)
+            m_convergence.addCell(it->first, it->second.tree->m_data, m_angleResolution * m_angleResolution, it->second.total);
+        m_convergence.endCells("QTableGuider");
+    }
+
+    /* Approximate heap footprint of one cell: range tree nodes, data, visits and hash map node */
+    size_t cellBytes() const {
+        size_t nodes = (size_t)(m_angleResolution + 1) * (2 * m_angleResolution - 1);
+        return nodes * sizeof(typename RangeTree<float>::Node) + m_angleResolution * sizeof(void*)
+            + m_angleResolution * m_angleResolution * (2 * sizeof(float) + sizeof(int))
+            + sizeof(RangeTree<float>) + sizeof(Wrapper) + sizeof(int) + 4 * sizeof(void*);
+    }
+
+    size_t memoryUsage() const {
+        return (m_cellCount + m_fallbackCount) * cellBytes();
+    }
+
+    /**
+     * Evict cells until the storage is back to EVICTION_WATERMARK of the
+     * budget. Evicted cells are merged into their fallback cell, weighted by
+     * visits; hashed states are dropped, their coarser levels take over.
+     * Must not run concurrently with rendering.
+     */
+    void evict() {
+        size_t target = (size_t)(m_maxCells * EVICTION_WATERMARK);
+        if (m_cellCount <= target)
+            return;
+        int size = m_angleResolution * m_angleResolution;
+        std::vector<std::pair<int64_t, int>> scores;
+        scores.reserve(m_storage.size());
+        for (WrapperMap::const_iterator it = m_storage.begin(); it != m_storage.end(); ++it) {
+            int64_t visits = 0;
+            for (int i = 0; i < size; i++)
+                visits += it->second.visit[i];
+            int64_t score = m_eviction == ELeastRecent ? ((int64_t)it->second.lastPass << 32) + visits : visits;
+            scores.push_back(std::make_pair(score, it->first));
+        }
+        size_t victims = scores.size() - target;
+        std::nth_element(scores.begin(), scores.begin() + victims, scores.end());
+        for (size_t v = 0; v < victims; v++) {
+            int block_idx = scores[v].second;
+            WrapperMap::const_accessor cell;
+            if (!m_storage.find(cell, block_idx))
+                continue;
+            if (!m_stateHash) {
+                WrapperMap::accessor coarse;
+                if (m_fallback.insert(coarse, fallbackBlock(block_idx))) {
+                    coarse->second.init(m_angleResolution, m_angleResolution);
+                    m_fallbackCount++;
+                }
+                for (int i = 0; i < m_angleResolution; i++) {
+                    for (int j = 0; j < m_angleResolution; j++) {
+                        int b = i * m_angleResolution + j;
+                        int v0 = coarse->second.visit[b], v1 = cell->second.visit[b];
+                        if (v0 + v1 > 0)
+                            coarse->second.tree->update(i, j, (coarse->second.tree->m_data[b] * v0 + cell->second.value(b) * v1) / (v0 + v1));
+                        coarse->second.visit[b] = v0 + v1;
+                        coarse->second.total += v1;
+                    }
+                }
+            }
+            cell.release();
+            m_storage.erase(block_idx);
+            m_cellCount--;
+        }
+        cout << tfm::format("QTableGuider: evicted %d cells, %s in use", victims, memString(memoryUsage())) << endl;
+    }
+
+    /* Evict before a pass rather than after it, so that done() exports the cells of the last one */
+    void beginPass() {
+        if (m_maxCells > 0)
+            evict();
+    }
+
+    void endPass() {
+        m_pass++;
+        if (m_convergence.isEnabled() && !m_convergence.isConverged())
+            trackConvergence();
+        if (m_telemetry && m_telemetry->due())
+            writeTelemetry("pass");
+    }
+
+    bool converged() const { return m_convergence.isConverged(); }
+
+    GuiderTelemetry* getTelemetry() const { return m_telemetry.get(); }
+
+    void done() {
+        if (m_telemetry) {
+            writeTelemetry("done");
+            cout << "Wrote guider telemetry to " << m_telemetry->getFilename() << endl;
+        }
+        if (m_exportFilename.length() > 0) {
+            std::cout << "Exporting QTable to " << m_exportFilename << " ... ";
+            std::cout.flush();
+            QValueCodec codec;
+            QSnapshotWriter writer(m_stateHash ? QSnapshot::EHemisphereHashed : QSnapshot::EHemisphere, codec, m_sceneResolution, m_angleResolution,
+                m_angleResolution * m_angleResolution, m_sceneBox);
+            /* The direct tables are folded into the exported values */
+            std::vector<float> scratch(m_angleResolution * m_angleResolution);
+            for (WrapperMap::const_iterator it = m_storage.begin(); it != m_storage.end(); ++it)
+                writer.add(it->first, (const uint8_t*)values(it->second, scratch.data()), (const uint8_t*)it->second.visit);
+            if (m_snapshot) {
+                /* Carry over the imported cells that were never touched */
+                int size = m_angleResolution * m_angleResolution;
+                const QValueCodec& source = m_snapshot->getCodec();
+                std::vector<float> values(size);
+                std::vector<int> visits(size);
+                for (size_t i = 0; i < m_snapshot->getCellCount(); i++) {
+                    WrapperMap::const_accessor const_access;
+                    if (m_storage.find(const_access, m_snapshot->getKey(i)))
+                        continue;
+                    for (int k = 0; k < size; k++) {
+                        values[k] = source.get(m_snapshot->getValues(i), k);
+                        visits[k] = source.getVisit(m_snapshot->getVisits(i), k);
+                    }
+                    writer.add(m_snapshot->getKey(i), (const uint8_t*)values.data(), (const uint8_t*)visits.data());
+                }
+            }
+            writer.write(m_exportFilename);
+            std::cout << tfm::format("done (%d cells).", writer.getCellCount()) << std::endl;
+        }
+    }
+
+    /* State of a vertex: the grid cell of its position, or its hashed state at the level of detail to read */
+    int locateState(const Intersection& its) const {
+        if (!m_stateHash)
+            return locateBlock(its.p);
+        return m_stateHash->lookup(its.p, its.shFrame.n, [this](int key) { return cellVisits(key); });
     }
 
     int locateBlock(const Point3f& pos) const {
@@ -161,16 +747,9 @@ public:
         return (x * m_sceneResolution + y) * m_sceneResolution + z;
     }
 
+    /* Bin of a local direction, see EqualAreaMap */
     inline int locateDirection(const Vector3f& di, int &ix, int& iy) const {
-        float x = std::min(1 - 1e-6f, di.z());
-        float y = 0.0f;
-        if (di.z() < 1 - 1e-6f) {
-            y = sphericalCoordinates(di).y();
-        }
-        y /= 2 * M_PI;
-        ix = x * m_angleResolution;
-        iy = y * m_angleResolution;
-        return ix * m_angleResolution + iy;
+        return EqualAreaMap::hemisphereBin(di, m_angleResolution, ix, iy);
     }
 
     int locateDirection(const Vector3f& di) const {
@@ -183,9 +762,27 @@ public:
             "QTableGuider[\n"
             "  alpha = %s,\n"
             "  sceneResolution = %d,\n"
-            "  angleResolution = %d\n"
+            "  angleResolution = %d,\n"
+            "  productSampling = %s,\n"
+            "  memoryBudget = %s,\n"
+            "  eviction = %s,\n"
+            "  memory = %s (%d cells, %d fallback cells),\n"
+            "  import = %s,\n"
+            "  telemetry = %s,\n"
+            "  thinning = %s,\n"
+            "  stateKey = %s,\n"
+            "  convergence = %s\n"
             "]",
-            m_useVisit? "1/(1 + visit)" : tfm::format("%f", m_alpha), m_sceneResolution, m_angleResolution);
+            m_useVisit? "1/(1 + visit)" : tfm::format("%f", m_alpha), m_sceneResolution, m_angleResolution,
+            m_productSampling ? "true" : "false",
+            m_memoryBudget > 0 ? memString(m_memoryBudget) : "unlimited",
+            m_eviction == ELeastRecent ? "lru" : "lowvalue",
+            memString(memoryUsage()), (size_t)m_cellCount, (size_t)m_fallbackCount,
+            m_snapshot ? tfm::format("%s (%d cells mapped)", m_importFilename, m_snapshot->getCellCount()) : "none",
+            m_telemetry ? m_telemetry->getFilename() : "none",
+            m_thinning.toString(),
+            m_stateHash ? indent(m_stateHash->toString()) : "grid",
+            m_convergence.toString());
 	}
 
 protected:
@@ -340,7 +937,7 @@ protected:
             if (*root) {
                 free1D(&(*root)->left);
                 free1D(&(*root)->right);
-                delete root;
+                delete *root;
             }
         }
         
@@ -357,7 +954,29 @@ protected:
     Vector3f m_sceneBlockSize;
     BoundingBox3f m_sceneBox;
     WrapperMap m_storage;
-
+    bool m_productSampling;
+    BSDFProduct m_product;
+    const GuiderKernels *m_kernels;
+    size_t m_memoryBudget;
+    size_t m_maxCells;
+    EEvictionPolicy m_eviction;
+    int m_fallbackFactor;
+    int m_fallbackResolution;
+    WrapperMap m_fallback;
+    std::atomic<size_t> m_cellCount{0};
+    std::atomic<size_t> m_fallbackCount{0};
+    int m_pass = 0;
+    /* Read-only all-ones cell standing in for cells that could not be created */
+    Wrapper m_uniform;
+    std::string m_importFilename;
+    std::string m_exportFilename;
+    bool m_verifyImport;
+    std::unique_ptr<QSnapshot> m_snapshot;
+    std::unique_ptr<GuiderTelemetry> m_telemetry;
+    UpdateThinning m_thinning;
+    ConvergenceMonitor m_convergence;
+    std::unique_ptr<StateHash> m_stateHash;
+    const float EVICTION_WATERMARK = 0.75f;
 };
 
 TRACER_REGISTER_CLASS(QTableGuider, "qtable");
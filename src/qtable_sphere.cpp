@@ -6,11 +6,22 @@
 #include <tracer/integrator.h>
 #include <tracer/bsdf.h>
 #include <tracer/warp.h>
+#include <tracer/equalarea.h>
+#include <tracer/qvalue.h>
+#include <tracer/qsnapshot.h>
+#include <tracer/telemetry.h>
+#include <tracer/thinning.h>
+#include <tracer/statehash.h>
+#include <tracer/convergence.h>
 #include <tbb/concurrent_vector.h>
 #include <tbb/concurrent_hash_map.h>
+#include <tbb/parallel_for.h>
+#include <tbb/blocked_range.h>
 #include <algorithm>
+#include <atomic>
 #include <fstream>
 #include <iostream>
+#include <memory>
 
 #undef NDEBUG
 #include <assert.h>
@@ -19,31 +30,65 @@ TRACER_NAMESPACE_BEGIN
 
 class QTableSphereGuider : public Guider {
 protected:
+    enum ESpatialFilter {
+        ENearest = 0,
+        ETrilinear,
+        EStochastic
+    };
+
+    enum EEvictionPolicy {
+        ELeastRecent = 0,
+        ELowestValue
+    };
+
+    enum ESmoothing {
+        ENoSmoothing = 0,
+        EBoxSmoothing,
+        EBilateralSmoothing
+    };
+
     struct Wrapper {
-        float* map;
-        int* visit;
+        /* Q-values and visit counts, encoded as described by QValueCodec */
+        uint8_t* map = nullptr;
+        uint8_t* visit = nullptr;
+        /* Sum of the visit counts, to pick the level of detail of hashed states */
+        int64_t total = 0;
+        /* Last pass in which the cell was used */
+        int lastPass = 0;
+        /* Summed NEE estimates of the direct radiance per bin and their count, see updateDirect(); allocated by the first sample */
+        float* direct = nullptr;
+        float directCount = 0.0f;
 
         ~Wrapper() {
             if (map)
                 delete[] map;
             if (visit)
                 delete[] visit;
+            if (direct)
+                delete[] direct;
         }
 
-        void init(int width, int height) {
-            map = new float[width * height];
-            visit = new int[width * height];
-            memset(visit, 0, width * height * sizeof(int));
-            for (int i = 0; i < width * height; i++) {
-                map[i] = 1.0f;
-            }
+        /* Add weight times the direct radiance estimated from NEE to the size bins of map */
+        void addDirect(float* map, int size, float weight) const {
+            if (!direct)
+                return;
+            for (int b = 0; b < size; b++)
+                map[b] += weight * direct[b] / directCount;
+        }
+
+        void init(int width, int height, const QValueCodec& codec) {
+            map = new uint8_t[width * height * codec.valueBytes()];
+            visit = new uint8_t[width * height * codec.visitBytes()];
+            memset(visit, 0, width * height * codec.visitBytes());
+            codec.fill(map, width * height, 1.0f);
         }
     };
     typedef tbb::concurrent_hash_map<int, Wrapper> WrapperMap;
 public:
-    QTableSphereGuider(const PropertyList &props): m_storage(10000) {
+    QTableSphereGuider(const PropertyList &props): m_storage(10000), m_thinning(props), m_convergence(props) {
         m_sceneResolution = props.getInteger("sceneResolution", 50);
         m_angleResolution = props.getInteger("angleResolution", 8);
+        m_kernels = &GuiderKernels::get(m_angleResolution);
         try {
             m_alpha = props.getFloat("alpha");
             m_useVisit = false;
@@ -51,14 +96,68 @@ public:
         catch (TracerException e) {
             //alpha doesn't exist
         }
-        //Store m_angleResolution x m_angleResolution array for each element in (2 x m_angleResolution) x m_angleResolution array
-        m_hemishpereMap = new int[m_angleResolution * m_angleResolution * m_angleResolution * m_angleResolution * 2];
+        /* Local directions of the hemisphere bin centers, used to gather sphere bins around a normal */
+        for (int i = 0; i < m_angleResolution; i++) {
+            for (int j = 0; j < m_angleResolution; j++) {
+                m_binCenters.push_back(EqualAreaMap::squareToHemisphere(
+                    Point2f((i + 0.5f) / m_angleResolution, (j + 0.5f) / m_angleResolution)));
+            }
+        }
         m_importFilename = props.getString("import", "");
         m_exportFilename = props.getString("export", "");
-    }
-
-    ~QTableSphereGuider() {
-        delete[] m_hemishpereMap;
+        m_verifyImport = props.getBoolean("verifyImport", false);
+        std::string telemetry = props.getString("telemetry", "");
+        if (telemetry.length() > 0)
+            m_telemetry.reset(new GuiderTelemetry(telemetry, props.getFloat("telemetryInterval", 0.0f)));
+        m_productSampling = props.getBoolean("productSampling", false);
+        /* Also samples the bins cached in cell handles when product sampling is off */
+        m_product.init(m_angleResolution, props.getInteger("productSubdivision", 2));
+        std::string filter = props.getString("spatialFilter", "nearest");
+        if (filter == "nearest")
+            m_spatialFilter = ENearest;
+        else if (filter == "trilinear")
+            m_spatialFilter = ETrilinear;
+        else if (filter == "stochastic")
+            m_spatialFilter = EStochastic;
+        else
+            throw TracerException("QTableSphereGuider: unknown spatial filter \"%s\"", filter);
+        m_codec = QValueCodec(QValueCodec::fromString(props.getString("precision", "float32")));
+        /* Memory budget in MiB for the cell storage, 0 means unlimited */
+        m_memoryBudget = (size_t)props.getInteger("memoryBudget", 0) << 20;
+        m_maxCells = m_memoryBudget / cellBytes();
+        if (m_memoryBudget > 0 && m_maxCells == 0)
+            throw TracerException("QTableSphereGuider: memoryBudget is too small to hold a single cell");
+        std::string eviction = props.getString("eviction", "lru");
+        if (eviction == "lru")
+            m_eviction = ELeastRecent;
+        else if (eviction == "lowvalue")
+            m_eviction = ELowestValue;
+        else
+            throw TracerException("QTableSphereGuider: unknown eviction policy \"%s\"", eviction);
+        m_fallbackFactor = props.getInteger("fallbackFactor", 4);
+        m_fallbackResolution = std::max(1, m_sceneResolution / m_fallbackFactor);
+        std::string smoothing = props.getString("smoothing", "none");
+        if (smoothing == "none")
+            m_smoothing = ENoSmoothing;
+        else if (smoothing == "box")
+            m_smoothing = EBoxSmoothing;
+        else if (smoothing == "bilateral")
+            m_smoothing = EBilateralSmoothing;
+        else
+            throw TracerException("QTableSphereGuider: unknown smoothing \"%s\"", smoothing);
+        /* Visits a bin needs before its own value outweighs its neighbours */
+        m_smoothingPrior = props.getFloat("smoothingPrior", 4.0f);
+        /* Relative difference of Q-values at which the bilateral weight falls to 1/e */
+        m_smoothingRange = props.getFloat("smoothingRange", 0.5f);
+        std::string stateKey = props.getString("stateKey", "grid");
+        if (stateKey == "hashed") {
+            m_stateHash.reset(new StateHash(props));
+            if (m_spatialFilter != ENearest || m_smoothing != ENoSmoothing)
+                throw TracerException("QTableSphereGuider: hashed states need the nearest spatial filter and no smoothing");
+        }
+        else if (stateKey != "grid") {
+            throw TracerException("QTableSphereGuider: unknown state key \"%s\"", stateKey);
+        }
     }
 
     /* Integrator need to call this in preprocess() */
@@ -68,238 +167,351 @@ public:
         m_sceneBox.expandBy(orig_max + Vector3f(Epsilon));
         m_sceneBlockSize = (m_sceneBox.max - m_sceneBox.min) / m_sceneResolution;
 
-        int width = (m_angleResolution << 1), height = m_angleResolution;
-
-        //Pre-compute hemisphere map
-        for (int i = 0; i < width; i++) {
-            for (int j = 0; j < height; j++) {
-                Vector3f center_di = Warp::squareToUniformSphere(Point2f((i + 0.5f) / width, (j + 0.5f) / height));
-                Frame center_frame = Frame(center_di);
-                for (int k = 0; k < m_angleResolution; k++) {
-                    for (int l = 0; l < m_angleResolution; l++) {
-                        Vector3f local_di = Warp::squareToUniformHemisphere(Point2f((k + 0.5f) / m_angleResolution, (l + 0.5f) / m_angleResolution));
-                        int mapped_idx = locateDirection(center_frame.toWorld(local_di));
-                        getHemisphereMap(i, j, k, l) = mapped_idx;
-                    }
-                }
-            }
-        }
         if (m_importFilename.length() > 0) {
-            // Import from file
-            std::ifstream file(m_importFilename, std::ios::in | std::ios::binary);
-            if (!file.is_open()) {
-                throw TracerException("Cannot open file %s", m_importFilename.c_str());
-            }
-	        cout << "Importing QTable ...";
-	        cout.flush();
-            float bounds[6];
-            file.read((char*)bounds, 6 * sizeof(float));
-            m_sceneBox = BoundingBox3f(Point3f(bounds[0], bounds[1], bounds[2]), Point3f(bounds[3], bounds[4], bounds[5]));
-            m_sceneBlockSize = (m_sceneBox.max - m_sceneBox.min) / m_sceneResolution;
-            while (!file.eof()) {
-                int block_idx;
-                file.read((char*)&block_idx, sizeof(int));
-                WrapperMap::accessor access;
-                m_storage.insert(access, block_idx);
-                access->second.init(width, height);
-                file.read((char*)access->second.map, width * height * sizeof(float));
-                file.read((char*)access->second.visit, width * height * sizeof(int));
-                access.release();
-            }
-            file.close();
-	        cout << " done." << endl;
-        }
-
-        //cout << "Testing locateDirection" << endl;
-        //for (int i = 0; i < width; i++) {
-        //    for (int j = 0; j < height; j++) {
-        //        int x, y;
-        //        Point2f s = Point2f((i + 0.5f) / width, (j + 0.5f) / height);
-        //        locateDirection(Warp::squareToUniformSphere(s), x, y);
-        //        if (i != x || j != y) {
-        //            cout << "Oops..." << i << ' ' << x << ' ' << j << ' ' << y << endl;
-        //        }
-        //    }
-        //}
-    }
-    Vector3f sample(const Point2f& sample, const Intersection& its, float& pdf) {
-        int nx, ny;
-        int block_idx = locateBlock(its.p);
-        locateDirection(its.shFrame.n, nx, ny);
-        assert(nx < 2 * m_angleResolution);
-        assert(ny < m_angleResolution);
-        Point2f result;
-        WrapperMap::const_accessor const_access;
-        WrapperMap::accessor access;
-        auto do_sample = [&](auto& accessor) -> Point2f {
-            float *weights = new float[m_angleResolution + 1];
-            float total_weight;
-            int x, y;
-            float px, py;
-            float t;
-            weights[0] = 0.0f;
-            for (int i = 1; i <= m_angleResolution; i++) {
-                weights[i] = weights[i - 1];
-                for (int j = 0; j < m_angleResolution; j++) {
-                    int mapped_idx = this->getHemisphereMap(nx, ny, i - 1, j);
-                    assert(mapped_idx < 2 * m_angleResolution * m_angleResolution);
-                    weights[i] += accessor->second.map[mapped_idx];
-                }
+            // Map the snapshot; cells are copied into the storage on their first update
+            m_snapshot.reset(new QSnapshot(m_importFilename));
+            const QSnapshot::Header& header = m_snapshot->getHeader();
+            if (header.guiderType != (m_stateHash ? QSnapshot::ESphereHashed : QSnapshot::ESphere))
+                throw TracerException("QTableSphereGuider: %s was not exported by a qtable_sphere guider with stateKey=%s",
+                    m_importFilename, m_stateHash ? "hashed" : "grid");
+            if (header.binCount != (uint32_t)(2 * header.angleResolution * header.angleResolution))
+                throw TracerException("QTableSphereGuider: %s has an inconsistent bin count", m_importFilename);
+            if (m_verifyImport && !m_snapshot->verify())
+                throw TracerException("QTableSphereGuider: checksum mismatch in %s", m_importFilename);
+            BoundingBox3f bounds = m_snapshot->getBounds();
+            float tolerance = BOUNDS_TOLERANCE * (m_sceneBox.max - m_sceneBox.min).norm();
+            if (header.sceneResolution == m_sceneResolution && header.angleResolution == m_angleResolution &&
+                (bounds.min - m_sceneBox.min).cwiseAbs().maxCoeff() <= tolerance &&
+                (bounds.max - m_sceneBox.max).cwiseAbs().maxCoeff() <= tolerance) {
+                m_sceneBox = bounds;
+                m_sceneBlockSize = (m_sceneBox.max - m_sceneBox.min) / m_sceneResolution;
+                cout << tfm::format("Mapped %d Q-table cells (%s) from %s", m_snapshot->getCellCount(),
+                    QValueCodec::toString(m_snapshot->getCodec().getPrecision()), m_importFilename) << endl;
             }
-            total_weight = weights[m_angleResolution];
-            t = sample.x() * weights[m_angleResolution];
-            x = std::upper_bound(weights, weights + m_angleResolution + 1, t) - weights - 1;
-            assert(x < m_angleResolution);
-            px = x + (t - weights[x]) / (weights[x + 1] - weights[x]);
-            for (int i = 1; i <= m_angleResolution; i++) {
-                weights[i] = weights[i - 1];
-                int mapped_idx = this->getHemisphereMap(nx, ny, x, i - 1);
-                assert(mapped_idx < 2 * m_angleResolution * m_angleResolution);
-                weights[i] += accessor->second.map[mapped_idx];
+            else if (m_stateHash) {
+                throw TracerException("QTableSphereGuider: %s has another resolution or bounds; hashed states cannot be resampled",
+                    m_importFilename);
             }
-            t = sample.y() * weights[m_angleResolution];
-            y = std::upper_bound(weights, weights + m_angleResolution + 1, t) - weights - 1;
-            py = y + (t - weights[y]) / (weights[y + 1] - weights[y]);
-            assert(y < m_angleResolution);
-            int idx = this->getHemisphereMap(nx, ny, x, y);
-            assert(idx < 2 * m_angleResolution * m_angleResolution);
-            pdf = accessor->second.map[idx] / total_weight * m_angleResolution * m_angleResolution * INV_TWOPI;
-            delete[] weights;
-            return Point2f(px / m_angleResolution, py / m_angleResolution);
-        };
-        if (m_storage.find(const_access, block_idx)) {
-            result = do_sample(const_access);
-        }
-        else {
-            if (m_storage.insert(access, block_idx)) {
-                access->second.init(2 * m_angleResolution, m_angleResolution);
+            else {
+                cout << tfm::format("Resampling %d Q-table cells from %s (resolution %d/%d to %d/%d) ...",
+                    m_snapshot->getCellCount(), m_importFilename, header.sceneResolution, header.angleResolution,
+                    m_sceneResolution, m_angleResolution);
+                cout.flush();
+                resampleSnapshot();
+                m_snapshot.reset();
+                cout << tfm::format(" done (%d cells).", (size_t)m_cellCount) << endl;
             }
-            result = do_sample(access);
         }
-        return Warp::squareToUniformHemisphere(result);
+        if (m_stateHash)
+            m_stateHash->init(m_sceneBox, m_sceneResolution);
+    }
+
+    Vector3f sample(const Point2f& sample, const Intersection& its, float& pdf) {
+        SphereScratch map(2 * m_angleResolution * m_angleResolution), weights(m_angleResolution * m_angleResolution);
+        fetch(its, positionHash(its.p), map.data());
+        float total = gather(its.shFrame, map.data(), weights.data());
+        return m_product.sample(weights.data(), total, sample, pdf);
     }
 
     void update(const Intersection& origin, const Intersection& dest, Sampler* sampler) {
-        const Vector3f& ray = (dest.p - origin.p).normalized(),
-            dest_wi = dest.shFrame.toLocal(-ray),
-            orig_wi = origin.shFrame.toLocal(ray);
-        int nx, ny;
-        locateDirection(dest.shFrame.n, nx, ny);
-        assert(nx < 2 * m_angleResolution);
-        assert(ny < m_angleResolution);
-        int block_orig_idx = locateBlock(origin.p),
-            angle_orig_idx = locateDirection(ray);
-        int block_dest_idx = locateBlock(dest.p);
-        assert(angle_orig_idx < 2 * m_angleResolution * m_angleResolution);
+        const Vector3f ray = (dest.p - origin.p).normalized();
+        float weight = thin(origin, -1, ray, sampler);
+        if (weight == 0.0f)
+            return;
+        SphereScratch map(2 * m_angleResolution * m_angleResolution);
+        fetch(dest, m_spatialFilter == EStochastic ? sampler->next1D() : 0.0f, map.data());
+        splat(origin, -1, ray, integral(origin, dest, map.data(), sampler), sampler, weight);
+    }
+
+    void update(const GuiderCell& origin, const GuiderCell& dest, Sampler* sampler) {
+        const Vector3f ray = (dest.its.p - origin.its.p).normalized();
+        float weight = thin(origin.its, origin.block, ray, sampler);
+        if (weight > 0.0f)
+            splat(origin.its, origin.block, ray, target(origin, dest, sampler), sampler, weight);
+    }
 
-        WrapperMap::const_accessor const_access_dest;
-        WrapperMap::accessor access_dest, access_orig;
+    float target(const GuiderCell& origin, const GuiderCell& dest, Sampler* sampler) {
+        /* The direct table of origin already holds the emission of dest */
+        return integral(origin.its, dest.its, dest.values.data(), sampler, !origin.direct);
+    }
+
+    bool reflected(const GuiderCell& cell, Sampler* sampler, Color3f& result) {
+        const BSDF *bsdf = cell.its.mesh->getBSDF();
+        if (!bsdf || !bsdf->isDiffuse() || Frame::cosTheta(cell.wi) <= 0)
+            return false;
+        SphereScratch q(m_angleResolution * m_angleResolution);
+        gather(cell.its.shFrame, cell.values.data(), q.data());
+        result = reflectBins(bsdf, cell.wi, q.data(), m_angleResolution, sampler);
+        return true;
+    }
 
+    /* Q-values are incident radiance, so value directly estimates the bin along di */
+    void updateTarget(const GuiderCell& cell, const Vector3f& di, float value, Sampler* sampler) {
+        const Vector3f ray = cell.its.shFrame.toWorld(di);
+        float weight = thin(cell.its, cell.block, ray, sampler);
+        if (weight > 0.0f)
+            splat(cell.its, cell.block, ray, value, sampler, weight);
+    }
+
+    /* Importance weight of an update of the bin along ray at origin, 0 if the thinning policy rejects it or training has converged */
+    float thin(const Intersection& origin, int block_hint, const Vector3f& ray, Sampler* sampler) {
+        if (m_convergence.isConverged())
+            return 0.0f;
+        if (!m_thinning.isEnabled())
+            return 1.0f;
+        int block_idx = block_hint >= 0 ? block_hint : locateState(origin), bin = locateDirection(ray);
+        int64_t visits = 0;
+        WrapperMap::const_accessor const_access;
+        if (findCell(m_storage, const_access, block_idx)) {
+            visits = m_codec.getVisit(const_access->second.visit, bin);
+        }
+        else if (m_snapshot) {
+            ptrdiff_t i = m_snapshot->find(block_idx);
+            if (i >= 0)
+                visits = m_snapshot->getCodec().getVisit(m_snapshot->getVisits(i), bin);
+        }
+        return m_thinning.accept(visits, sampler->next1D());
+    }
+
+    /**
+     * New estimate for the bin of origin towards dest: the Q-values map of
+     * the dest cell, gathered over the hemisphere of its normal, integrated
+     * against its BSDF, plus emission
+     */
+    float integral(const Intersection& origin, const Intersection& dest, const float* map, Sampler* sampler, bool emitted = true) const {
+        const Vector3f ray = (dest.p - origin.p).normalized(),
+            dest_wi = dest.shFrame.toLocal(-ray);
         float integral_term = 0.0f;
         const BSDF *bsdf = dest.mesh->getBSDF();
         BSDFQueryRecord brec = BSDFQueryRecord(dest_wi);
-        auto integral_job = [&](auto& accessor) {
-            if (bsdf->isDiffuse()) {
-                brec.measure = ESolidAngle;
-                for (int i = 0; i < m_angleResolution; i++) {
-                    for (int j = 0; j < m_angleResolution; j++) {
-                        Point2f sample = (sampler->next2D() + Point2f(i, j)) / m_angleResolution;
-                        brec.wo = Warp::squareToUniformHemisphere(sample);
-                        float eval = bsdf->eval(brec).maxCoeff();
-                        float normal_q = accessor->second.map[getHemisphereMap(nx, ny, i, j)];
-                        float term = normal_q * Frame::cosTheta(brec.wo) * eval;
-                        integral_term += term;
-                    }
-                }
-            }
-            else {
-                //We need to sample the incident ray because brdf is always 0
-                for (int i = 0; i < m_angleResolution * m_angleResolution; i++) {
-                    bsdf->sample(brec, sampler->next2D());
-                    int idx = locateDirection(dest.shFrame.toWorld(brec.wo));
-                    integral_term += accessor->second.map[idx];
+        if (bsdf->isDiffuse()) {
+            brec.measure = ESolidAngle;
+            SphereScratch q(m_angleResolution * m_angleResolution);
+            gather(dest.shFrame, map, q.data());
+            for (int i = 0; i < m_angleResolution; i++) {
+                for (int j = 0; j < m_angleResolution; j++) {
+                    Point2f sample = (sampler->next2D() + Point2f(i, j)) / m_angleResolution;
+                    brec.wo = EqualAreaMap::squareToHemisphere(sample);
+                    float eval = bsdf->eval(brec).maxCoeff();
+                    float normal_q = q[i * m_angleResolution + j];
+                    float term = normal_q * Frame::cosTheta(brec.wo) * eval;
+                    integral_term += term;
                 }
             }
-            accessor.release();
-        };
-        if (m_storage.find(const_access_dest, block_dest_idx)) {
-            integral_job(const_access_dest);
         }
         else {
-            if (m_storage.insert(access_dest, block_dest_idx)) {
-                access_dest->second.init(2 * m_angleResolution, m_angleResolution);
+            //We need to sample the incident ray because brdf is always 0
+            for (int i = 0; i < m_angleResolution * m_angleResolution; i++) {
+                bsdf->sample(brec, sampler->next2D());
+                int idx = locateDirection(dest.shFrame.toWorld(brec.wo));
+                integral_term += map[idx];
             }
-            integral_job(access_dest);
         }
         integral_term *= 2.0f * M_PI / m_angleResolution / m_angleResolution;
-        if (dest.mesh->isEmitter()) {
+        if (emitted && dest.mesh->isEmitter()) {
             integral_term += dest.mesh->getEmitter()->getRadiance(dest.p, dest_wi).sum();
         }
+        return integral_term;
+    }
 
+    /**
+     * Blend a new estimate into the bin along the world direction ray of the
+     * origin cell(s); block_hint is the nearest cell if known. The estimate
+     * counts as weight identical updates.
+     */
+    void splat(const Intersection& origin, int block_hint, const Vector3f& ray, float integral_term, Sampler* sampler, float weight = 1.0f) {
+        if (m_telemetry)
+            m_telemetry->recordUpdate();
+        int angle_orig_idx = locateDirection(ray);
+        assert(angle_orig_idx < 2 * m_angleResolution * m_angleResolution);
 
-        if (m_storage.insert(access_orig, block_orig_idx)) {
-            access_orig->second.init(2 * m_angleResolution, m_angleResolution);
+        /* Splat the new estimate into the origin cell(s) */
+        int blocks[8];
+        float block_weights[8];
+        int count = splatBlocks(origin, block_hint, sampler, blocks, block_weights);
+        for (int c = 0; c < count; c++) {
+            WrapperMap::accessor access_orig;
+            if (!acquireCell(access_orig, blocks[c]))
+                continue;
+            Wrapper &cell = access_orig->second;
+            int visit = m_codec.getVisit(cell.visit, angle_orig_idx);
+            float alpha = m_useVisit ? weight / (visit + weight) : 1.0f - std::pow(1.0f - m_alpha, weight);
+            alpha *= block_weights[c];
+            float oldval = m_codec.get(cell.map, angle_orig_idx);
+            float newval = (1.0f - alpha) * oldval + alpha * integral_term;
+            if (newval < UPDATE_THREASHOLD)
+                newval = UPDATE_THREASHOLD;
+            /* Compact encodings round stochastically to keep small updates */
+            float u = m_codec.getPrecision() == QValueCodec::EFloat32 ? 0.5f : sampler->next1D();
+            m_codec.set(cell.map, angle_orig_idx, newval, u);
+            /* Fractional visits are rounded stochastically */
+            float increment = weight * block_weights[c];
+            int64_t whole = (int64_t)increment;
+            if (increment > whole && sampler->next1D() < increment - whole)
+                whole++;
+            if (whole > 0) {
+                m_codec.setVisit(cell.visit, angle_orig_idx, visit + whole);
+                cell.total += whole;
+            }
         }
-        float alpha = m_useVisit ? 1.0f / (1 + access_orig->second.visit[angle_orig_idx]) : m_alpha;
-        float oldval = access_orig->second.map[angle_orig_idx];
-        float newval = (1.0f - alpha) * oldval + alpha * integral_term;
-        if (newval < UPDATE_THREASHOLD)
-            newval = UPDATE_THREASHOLD;
-        access_orig->second.map[angle_orig_idx] = newval;
-        access_orig->second.visit[angle_orig_idx]++;
     }
 
-    float pdf(const Vector3f& di, const Intersection& origin) {
-        int nx, ny, ox, oy;
-        locateDirection(origin.shFrame.n, nx, ny);
-        assert(nx < 2 * m_angleResolution);
-        assert(ny < m_angleResolution);
-        int block_idx = locateBlock(origin.p), angle_idx = locateDirection(origin.shFrame.toWorld(di));
-        assert(angle_idx < 2 * m_angleResolution * m_angleResolution);
-
-        WrapperMap::const_accessor const_access;
-        WrapperMap::accessor access;
+    /**
+     * The cells an update at origin goes to and their weights, depending on
+     * the spatial filter; block_hint is the nearest cell if known. Returns
+     * the number of cells.
+     */
+    int splatBlocks(const Intersection& origin, int block_hint, Sampler* sampler, int* blocks, float* block_weights) {
+        if (m_spatialFilter == ETrilinear)
+            return locateNeighbours(origin.p, blocks, block_weights);
+        if (m_stateHash) {
+            /* Every level of detail learns from the update */
+            int count = m_stateHash->getLevels();
+            for (int l = 0; l < count; l++) {
+                blocks[l] = m_stateHash->key(origin.p, origin.shFrame.n, l);
+                block_weights[l] = 1.0f;
+            }
+            return count;
+        }
+        if (m_spatialFilter == EStochastic)
+            blocks[0] = locateBlock(origin.p, sampler->next1D());
+        else
+            blocks[0] = block_hint >= 0 ? block_hint : locateBlock(origin.p);
+        block_weights[0] = 1.0f;
+        return 1;
+    }
 
-        auto calc_pdf = [&](auto& accessor) -> float {
-            float total_weight = 0.0f;
-            for (int i = 0; i < m_angleResolution; i++) {
-                for (int j = 0; j < m_angleResolution; j++) {
-                    int mapped_idx = this->getHemisphereMap(nx, ny, i, j);
-                    total_weight += accessor->second.map[mapped_idx];
-                }
+    /**
+     * Learn the direct radiance of the state from a NEE sample, in a table of
+     * its own. Each sample estimates the mean direct radiance of every bin,
+     * radiance / (pdf * bin solid angle) for the bin containing di and zero
+     * for the others; the table keeps their sum and count. Averaging these
+     * into the Q-values instead would be biased: light samples are not
+     * spread uniformly over their bin, and they do not see indirect light.
+     */
+    void updateDirect(const GuiderCell& cell, const Vector3f& di, const Color3f& radiance, float pdf, Sampler* sampler) {
+        if (m_convergence.isConverged())
+            return;
+        int size = 2 * m_angleResolution * m_angleResolution, bin = -1;
+        float estimate = 0.0f;
+        if (pdf > 0.0f && radiance.isValid() && !radiance.isZero()) {
+            bin = locateDirection(cell.its.shFrame.toWorld(di));
+            estimate = radiance.sum() / (pdf * 4.0f * M_PI / size);
+        }
+        int blocks[8];
+        float block_weights[8];
+        int count = splatBlocks(cell.its, cell.block, sampler, blocks, block_weights);
+        for (int c = 0; c < count; c++) {
+            WrapperMap::accessor access;
+            if (!acquireCell(access, blocks[c]))
+                continue;
+            Wrapper &wrapper = access->second;
+            if (!wrapper.direct) {
+                wrapper.direct = new float[size];
+                memset(wrapper.direct, 0, size * sizeof(float));
             }
-            return accessor->second.map[angle_idx] / total_weight * m_angleResolution * m_angleResolution * INV_TWOPI;
-        };
-        if (m_storage.find(const_access, block_idx)) {
-            return calc_pdf(const_access);
+            if (bin >= 0)
+                wrapper.direct[bin] += block_weights[c] * estimate;
+            wrapper.directCount += block_weights[c];
+        }
+    }
+
+    bool hasDirectTable() const { return true; }
+
+    float pdf(const Vector3f& di, const Intersection& origin) {
+        SphereScratch map(2 * m_angleResolution * m_angleResolution), weights(m_angleResolution * m_angleResolution);
+        fetch(origin, positionHash(origin.p), map.data());
+        float total = gather(origin.shFrame, map.data(), weights.data());
+        return m_product.pdf(weights.data(), total, di);
+    }
+
+    Vector3f sampleProduct(const Point2f& sample, const Intersection& its, const Vector3f& wi, float& pdf) {
+        const BSDF *bsdf = its.mesh->getBSDF();
+        Vector3f di;
+        if (!m_productSampling || !BSDFProduct::applicable(bsdf, wi)) {
+            di = this->sample(sample, its, pdf);
         }
         else {
-            if (m_storage.insert(access, block_idx)) {
-                access->second.init(2 * m_angleResolution, m_angleResolution);
-            }
-            return calc_pdf(access);
+            SphereScratch products(m_angleResolution * m_angleResolution);
+            float total = productWeights(its, bsdf, wi, products.data());
+            di = m_product.sample(products.data(), total, sample, pdf);
         }
-        return 0.0f;
+        if (m_telemetry)
+            m_telemetry->recordSample(pdf);
+        return di;
+    }
+
+    float pdfProduct(const Vector3f& di, const Intersection& origin, const Vector3f& wi) {
+        const BSDF *bsdf = origin.mesh->getBSDF();
+        if (!m_productSampling || !BSDFProduct::applicable(bsdf, wi))
+            return pdf(di, origin);
+        SphereScratch products(m_angleResolution * m_angleResolution);
+        float total = productWeights(origin, bsdf, wi, products.data());
+        return m_product.pdf(products.data(), total, di);
+    }
+
+    /* Evict before a pass rather than after it, so that done() exports the cells of the last one */
+    void beginPass() {
+        if (m_maxCells > 0)
+            evict();
+    }
+
+    void endPass() {
+        m_pass++;
+        if (m_smoothing != ENoSmoothing)
+            smooth();
+        if (m_convergence.isEnabled() && !m_convergence.isConverged())
+            trackConvergence();
+        if (m_telemetry && m_telemetry->due())
+            writeTelemetry("pass");
     }
 
+    bool converged() const { return m_convergence.isConverged(); }
+
+    GuiderTelemetry* getTelemetry() const { return m_telemetry.get(); }
+
     void done() {
+        if (m_telemetry) {
+            writeTelemetry("done");
+            cout << "Wrote guider telemetry to " << m_telemetry->getFilename() << endl;
+        }
         if (m_exportFilename.length() > 0) {
-            std::ofstream file(m_exportFilename, std::ios::binary | std::ios::out);
-            if (!file.is_open()) {
-                throw TracerException("Cannot open file %s to write", m_importFilename.c_str());
-            }
-            // Export to the file
             std::cout << "Exporting QTableSphere to " << m_exportFilename << " ... ";
             std::cout.flush();
-            float bounds[6] = { m_sceneBox.min.x(), m_sceneBox.min.y(), m_sceneBox.min.z(), m_sceneBox.max.x(), m_sceneBox.max.y(), m_sceneBox.max.z() };
-            file.write((char*)bounds, 6 * sizeof(float));
+            int size = 2 * m_angleResolution * m_angleResolution;
+            QSnapshotWriter writer(m_stateHash ? QSnapshot::ESphereHashed : QSnapshot::ESphere, m_codec, m_sceneResolution, m_angleResolution, size, m_sceneBox);
+            /* The direct tables are folded into the exported values */
+            Wrapper folded;
+            folded.init(2 * m_angleResolution, m_angleResolution, m_codec);
+            std::vector<float> map(size);
             for (WrapperMap::const_iterator it = m_storage.begin(); it != m_storage.end(); ++it) {
-                file.write((char*)&it->first, sizeof(int));
-                file.write((char*)it->second.map, 2 * m_angleResolution * m_angleResolution * sizeof(float));
-                file.write((char*)it->second.visit, 2 * m_angleResolution * m_angleResolution * sizeof(int));
+                if (!it->second.direct) {
+                    writer.add(it->first, it->second.map, it->second.visit);
+                    continue;
+                }
+                std::fill(map.begin(), map.end(), 0.0f);
+                m_codec.decode(it->second.map, map.data(), size);
+                it->second.addDirect(map.data(), size, 1.0f);
+                for (int b = 0; b < size; b++)
+                    m_codec.set(folded.map, b, map[b]);
+                writer.add(it->first, folded.map, it->second.visit);
+            }
+            if (m_snapshot) {
+                /* Carry over the imported cells that were never updated */
+                Wrapper cell;
+                for (size_t i = 0; i < m_snapshot->getCellCount(); i++) {
+                    int block_idx = m_snapshot->getKey(i);
+                    WrapperMap::const_accessor const_access;
+                    if (m_storage.find(const_access, block_idx))
+                        continue;
+                    if (!cell.map)
+                        cell.init(2 * m_angleResolution, m_angleResolution, m_codec);
+                    copySnapshotCell(i, cell);
+                    writer.add(block_idx, cell.map, cell.visit);
+                }
             }
-            file.close();
-            std::cout << "done." << std::endl;
+            writer.write(m_exportFilename);
+            std::cout << tfm::format("done (%d cells).", writer.getCellCount()) << std::endl;
         }
     }
 
@@ -308,58 +520,646 @@ public:
             "QTableSphereGuider[\n"
             "  alpha = %s,\n"
             "  sceneResolution = %d,\n"
-            "  angleResolution = %d\n"
+            "  angleResolution = %d,\n"
+            "  productSampling = %s,\n"
+            "  spatialFilter = %s,\n"
+            "  precision = %s,\n"
+            "  memoryBudget = %s,\n"
+            "  eviction = %s,\n"
+            "  memory = %s (%d cells, %d fallback cells),\n"
+            "  import = %s,\n"
+            "  telemetry = %s,\n"
+            "  thinning = %s,\n"
+            "  smoothing = %s,\n"
+            "  stateKey = %s,\n"
+            "  convergence = %s\n"
             "]",
-            m_useVisit? "1/(1 + visit)" : tfm::format("%f", m_alpha), m_sceneResolution, m_angleResolution);
+            m_useVisit? "1/(1 + visit)" : tfm::format("%f", m_alpha), m_sceneResolution, m_angleResolution,
+            m_productSampling ? "true" : "false",
+            m_spatialFilter == ETrilinear ? "trilinear" : (m_spatialFilter == EStochastic ? "stochastic" : "nearest"),
+            QValueCodec::toString(m_codec.getPrecision()),
+            m_memoryBudget > 0 ? memString(m_memoryBudget) : "unlimited",
+            m_eviction == ELeastRecent ? "lru" : "lowvalue",
+            memString(memoryUsage()), (size_t)m_cellCount, (size_t)m_fallbackCount,
+            m_snapshot ? tfm::format("%s (%d cells mapped)", m_importFilename, m_snapshot->getCellCount()) : "none",
+            m_telemetry ? m_telemetry->getFilename() : "none",
+            m_thinning.toString(),
+            m_smoothing == ENoSmoothing ? "none" : tfm::format("%s (prior = %f, range = %f)",
+                m_smoothing == EBoxSmoothing ? "box" : "bilateral", m_smoothingPrior, m_smoothingRange),
+            m_stateHash ? indent(m_stateHash->toString()) : "grid",
+            m_convergence.toString());
 	}
 
+    using Guider::sample;
+    using Guider::pdf;
+    using Guider::update;
+
+    void locate(const Intersection& its, const Vector3f& wi, GuiderCell& cell) {
+        cell.its = its;
+        cell.wi = wi;
+        cell.block = m_spatialFilter == ENearest ? locateState(its) : -1;
+        cell.values.resize(2 * m_angleResolution * m_angleResolution);
+        int64_t visits;
+        fetch(its, positionHash(its.p), cell.values.data(), cell.block, &visits);
+        cell.visits = std::max<int64_t>(visits, 0);
+        cell.weights.resize(m_angleResolution * m_angleResolution);
+        cell.total = gather(its.shFrame, cell.values.data(), cell.weights.data());
+        const BSDF *bsdf = its.mesh->getBSDF();
+        cell.product = m_productSampling && BSDFProduct::applicable(bsdf, wi);
+        if (cell.product)
+            cell.total = m_product.multiply(bsdf, wi, cell.weights.data());
+    }
+
+    Vector3f sample(const Point2f& sample, const GuiderCell& cell, float& pdf) {
+        Vector3f di = m_product.sample(cell.weights.data(), cell.total, sample, pdf);
+        if (m_telemetry)
+            m_telemetry->recordSample(pdf);
+        return di;
+    }
+
+    float pdf(const Vector3f& di, const GuiderCell& cell) {
+        return m_product.pdf(cell.weights.data(), cell.total, di);
+    }
+
 protected:
+    /**
+     * Gather the sphere bins of map onto the hemisphere bins around frame:
+     * each hemisphere bin takes the sphere bin containing its center.
+     * Returns the sum of the gathered values.
+     */
+    float gather(const Frame& frame, const float* map, float* weights) const {
+        return m_kernels->gather(frame, m_binCenters.data(), map, weights, m_angleResolution);
+    }
 
-    int locateBlock(const Point3f& pos) const {
-        Vector3f offset = pos - m_sceneBox.min;
-        int x = offset.x() / m_sceneBlockSize.x(),
-            y = offset.y() / m_sceneBlockSize.y(),
-            z = offset.z() / m_sceneBlockSize.z();
-        return (x * m_sceneResolution + y) * m_sceneResolution + z;
+    /* Gather the hemisphere bins of the state around its and multiply them by the BSDF lobe */
+    float productWeights(const Intersection& its, const BSDF* bsdf, const Vector3f& wi, float* products) {
+        SphereScratch map(2 * m_angleResolution * m_angleResolution);
+        fetch(its, positionHash(its.p), map.data());
+        gather(its.shFrame, map.data(), products);
+        return m_product.multiply(bsdf, wi, products);
+    }
+
+    /**
+     * Copy the Q-values of the state of its into map. Depending on the spatial
+     * filter this is the enclosing cell (or hashed state, block_hint if known),
+     * a neighbouring cell picked with its trilinear weight using the uniform
+     * number u, or the trilinear blend of all neighbouring cells. Cells that
+     * were never updated read as 1. If visits is given, it returns the total
+     * visits of the cell read with the largest weight (the enclosing one for
+     * trilinear filtering), -1 if it is neither stored nor imported.
+     */
+    void fetch(const Intersection& its, float u, float* map, int block_hint = -1, int64_t* visits = nullptr) {
+        int blocks[8];
+        float block_weights[8];
+        int count = 1;
+        if (m_spatialFilter == ETrilinear) {
+            count = locateNeighbours(its.p, blocks, block_weights);
+        }
+        else {
+            if (m_spatialFilter == EStochastic)
+                blocks[0] = locateBlock(its.p, u);
+            else
+                blocks[0] = block_hint >= 0 ? block_hint : locateState(its);
+            block_weights[0] = 1.0f;
+        }
+        int heaviest = 0;
+        for (int c = 1; c < count; c++) {
+            if (block_weights[c] > block_weights[heaviest])
+                heaviest = c;
+        }
+        m_kernels->fill(map, 0.0f, m_angleResolution);
+        for (int c = 0; c < count; c++) {
+            if (!decodeCell(blocks[c], map, block_weights[c], c == heaviest ? visits : nullptr))
+                m_kernels->add(map, block_weights[c], m_angleResolution);
+        }
+    }
+
+    /**
+     * Accumulate weight * Q of the cell block_idx into map. The cell is looked
+     * up in the storage, then in the imported snapshot, then in the fallback
+     * grid. Returns false if none of them has it. If visits is given, it
+     * returns the total visits of the stored or imported cell, as \ref
+     * cellVisits() would, from the same lookup.
+     */
+    bool decodeCell(int block_idx, float* map, float weight, int64_t* visits = nullptr) {
+        int size = 2 * m_angleResolution * m_angleResolution;
+        if (visits)
+            *visits = -1;
+        WrapperMap::const_accessor const_access;
+        if (lookupCell(const_access, block_idx)) {
+            m_codec.decode(const_access->second.map, map, size, weight);
+            const_access->second.addDirect(map, size, weight);
+            if (visits)
+                *visits = const_access->second.total;
+            return true;
+        }
+        const_access.release();
+        if (m_snapshot) {
+            ptrdiff_t i = m_snapshot->find(block_idx);
+            if (i >= 0) {
+                m_snapshot->getCodec().decode(m_snapshot->getValues(i), map, size, weight);
+                if (visits)
+                    *visits = snapshotVisits(i);
+                return true;
+            }
+        }
+        if (m_maxCells > 0 && !m_stateHash && findCell(m_fallback, const_access, fallbackBlock(block_idx))) {
+            m_codec.decode(const_access->second.map, map, size, weight);
+            const_access->second.addDirect(map, size, weight);
+            return true;
+        }
+        return false;
+    }
+
+    /* Look up a cell for reading, counting the time spent in the telemetry */
+    bool findCell(const WrapperMap& cells, WrapperMap::const_accessor& access, int block_idx) const {
+        GuiderTelemetry::WaitTimer wait(m_telemetry.get());
+        return cells.find(access, block_idx);
+    }
+
+    /* Look up a cell for writing, counting the time spent in the telemetry */
+    bool findCell(WrapperMap& cells, WrapperMap::accessor& access, int block_idx) {
+        GuiderTelemetry::WaitTimer wait(m_telemetry.get());
+        return cells.find(access, block_idx);
+    }
+
+    /* Find or insert a cell for writing, counting the time spent in the telemetry; true if inserted */
+    bool insertCell(WrapperMap& cells, WrapperMap::accessor& access, int block_idx) {
+        GuiderTelemetry::WaitTimer wait(m_telemetry.get());
+        return cells.insert(access, block_idx);
+    }
+
+    /**
+     * Look up a stored cell for sampling or evaluation. Lookups count as
+     * uses for the LRU eviction: the first one of each pass takes the write
+     * lock to mark the cell, the others only read.
+     */
+    bool lookupCell(WrapperMap::const_accessor& const_access, int block_idx) {
+        if (!findCell(m_storage, const_access, block_idx))
+            return false;
+        if (m_maxCells == 0 || const_access->second.lastPass == m_pass)
+            return true;
+        const_access.release();
+        {
+            WrapperMap::accessor access;
+            if (findCell(m_storage, access, block_idx))
+                access->second.lastPass = m_pass;
+        }
+        return findCell(m_storage, const_access, block_idx);
+    }
+
+    /* Gather per-cell statistics and write a telemetry record; not thread safe */
+    void writeTelemetry(const std::string& event) {
+        int size = 2 * m_angleResolution * m_angleResolution;
+        std::vector<float> map(size);
+        m_telemetry->beginCells();
+        for (WrapperMap::const_iterator it = m_storage.begin(); it != m_storage.end(); ++it) {
+            std::fill(map.begin(), map.end(), 0.0f);
+            m_codec.decode(it->second.map, map.data(), size);
+            int64_t visits = 0;
+            for (int i = 0; i < size; i++)
+                visits += m_codec.getVisit(it->second.visit, i);
+            m_telemetry->addCell(map.data(), size, visits);
+        }
+        m_telemetry->record(event, m_pass, memoryUsage());
+    }
+
+    /* Compare the stored cells to the previous pass; not thread safe */
+    void trackConvergence() {
+        int size = 2 * m_angleResolution * m_angleResolution;
+        std::vector<float> map(size);
+        m_convergence.beginCells();
+        for (WrapperMap::const_iterator it = m_storage.begin(); it != m_storage.end(); ++it) {
+            std::fill(map.begin(), map.end(), 0.0f);
+            m_codec.decode(it->second.map, map.data(), size);
+            m_convergence.addCell(it->first, map.data(), size, it->second.total);
+        }
+        m_convergence.endCells("QTableSphereGuider");
+    }
+
+    /* Copy the i-th snapshot cell into an initialized cell, converting the precision if needed */
+    void copySnapshotCell(size_t i, Wrapper& cell) const {
+        int size = 2 * m_angleResolution * m_angleResolution;
+        const QValueCodec& codec = m_snapshot->getCodec();
+        const uint8_t *values = m_snapshot->getValues(i), *visits = m_snapshot->getVisits(i);
+        cell.total = 0;
+        for (int b = 0; b < size; b++)
+            cell.total += codec.getVisit(visits, b);
+        if (codec.getPrecision() == m_codec.getPrecision()) {
+            memcpy(cell.map, values, size * m_codec.valueBytes());
+            memcpy(cell.visit, visits, size * m_codec.visitBytes());
+            return;
+        }
+        for (int b = 0; b < size; b++) {
+            m_codec.set(cell.map, b, codec.get(values, b));
+            m_codec.setVisit(cell.visit, b, codec.getVisit(visits, b));
+        }
+    }
+
+    /* Total visits of a cell, or -1 if it is neither stored nor imported */
+    int64_t cellVisits(int block_idx) const {
+        WrapperMap::const_accessor const_access;
+        if (findCell(m_storage, const_access, block_idx))
+            return const_access->second.total;
+        if (m_snapshot) {
+            ptrdiff_t i = m_snapshot->find(block_idx);
+            if (i >= 0)
+                return snapshotVisits(i);
+        }
+        return -1;
+    }
+
+    /* Total visits of the i-th snapshot cell */
+    int64_t snapshotVisits(size_t i) const {
+        int64_t total = 0;
+        for (int b = 0; b < 2 * m_angleResolution * m_angleResolution; b++)
+            total += m_snapshot->getCodec().getVisit(m_snapshot->getVisits(i), b);
+        return total;
+    }
+
+    /**
+     * Acquire write access to the cell block_idx, creating it if needed. Once
+     * the memory budget is exhausted no new cells are born; the update goes to
+     * the coarse fallback cell enclosing block_idx instead. Hashed states have
+     * their coarser levels as fallback: the update of a missing cell is then
+     * dropped and false returned.
+     */
+    bool acquireCell(WrapperMap::accessor& access, int block_idx) {
+        if (!findCell(m_storage, access, block_idx)) {
+            /* Reserve the slot before inserting, so that concurrent
+               insertions cannot take the storage past the budget */
+            size_t reserved = m_cellCount.fetch_add(1);
+            if (m_maxCells > 0 && reserved >= m_maxCells) {
+                m_cellCount--;
+                if (m_stateHash) {
+                    if (!findCell(m_storage, access, block_idx))
+                        return false;
+                }
+                else if (!findCell(m_storage, access, block_idx) && insertCell(m_fallback, access, fallbackBlock(block_idx))) {
+                    access->second.init(2 * m_angleResolution, m_angleResolution, m_codec);
+                    m_fallbackCount++;
+                }
+            }
+            else if (insertCell(m_storage, access, block_idx)) {
+                access->second.init(2 * m_angleResolution, m_angleResolution, m_codec);
+                if (m_snapshot) {
+                    ptrdiff_t i = m_snapshot->find(block_idx);
+                    if (i >= 0)
+                        copySnapshotCell(i, access->second);
+                }
+            }
+            else {
+                /* Inserted by another thread in the meantime */
+                m_cellCount--;
+            }
+        }
+        access->second.lastPass = m_pass;
+        return true;
+    }
+
+    /* Index of the coarse fallback cell enclosing block_idx */
+    int fallbackBlock(int block_idx) const {
+        int z = block_idx % m_sceneResolution,
+            y = (block_idx / m_sceneResolution) % m_sceneResolution,
+            x = block_idx / m_sceneResolution / m_sceneResolution;
+        x = std::min(x / m_fallbackFactor, m_fallbackResolution - 1);
+        y = std::min(y / m_fallbackFactor, m_fallbackResolution - 1);
+        z = std::min(z / m_fallbackFactor, m_fallbackResolution - 1);
+        return (x * m_fallbackResolution + y) * m_fallbackResolution + z;
+    }
+
+    /**
+     * Shrink the Q-values of every stored cell towards the visit-weighted
+     * mean of its 26 neighbours, q' = (n q + prior mean) / (n + prior), so
+     * that bins with few visits borrow from trained neighbours while trained
+     * bins barely move. The bilateral filter also down-weights neighbours
+     * whose value differs, e.g. on the other side of a wall. All cells are
+     * filtered in parallel into a separate buffer before any is written
+     * back; not thread safe.
+     */
+    void smooth() {
+        int size = 2 * m_angleResolution * m_angleResolution, res = m_sceneResolution;
+        std::vector<int> keys;
+        keys.reserve(m_storage.size());
+        for (WrapperMap::const_iterator it = m_storage.begin(); it != m_storage.end(); ++it)
+            keys.push_back(it->first);
+        std::vector<float> smoothed(keys.size() * size);
+
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, keys.size()), [&](const tbb::blocked_range<size_t> &range) {
+            std::vector<float> own(size), sum(size), weight(size);
+            std::vector<int64_t> visits(size);
+            for (size_t c = range.begin(); c != range.end(); ++c) {
+                int z = keys[c] % res, y = (keys[c] / res) % res, x = keys[c] / res / res;
+                WrapperMap::const_accessor access;
+                m_storage.find(access, keys[c]);
+                for (int b = 0; b < size; b++) {
+                    own[b] = m_codec.get(access->second.map, b);
+                    visits[b] = m_codec.getVisit(access->second.visit, b);
+                }
+                access.release();
+                std::fill(sum.begin(), sum.end(), 0.0f);
+                std::fill(weight.begin(), weight.end(), 0.0f);
+                for (int n = 0; n < 27; n++) {
+                    int nx = x + n / 9 - 1, ny = y + (n / 3) % 3 - 1, nz = z + n % 3 - 1;
+                    if (n == 13 || nx < 0 || ny < 0 || nz < 0 || nx >= res || ny >= res || nz >= res)
+                        continue;
+                    if (!m_storage.find(access, (nx * res + ny) * res + nz))
+                        continue;
+                    for (int b = 0; b < size; b++) {
+                        int64_t count = m_codec.getVisit(access->second.visit, b);
+                        if (count == 0)
+                            continue;
+                        float q = m_codec.get(access->second.map, b), w = (float)count;
+                        if (m_smoothing == EBilateralSmoothing) {
+                            float d = (q - own[b]) / (m_smoothingRange * std::max(std::max(q, own[b]), Epsilon));
+                            w *= std::exp(-d * d);
+                        }
+                        sum[b] += w * q;
+                        weight[b] += w;
+                    }
+                    access.release();
+                }
+                float *out = &smoothed[c * size];
+                for (int b = 0; b < size; b++) {
+                    out[b] = own[b];
+                    if (weight[b] > 0.0f)
+                        out[b] = (visits[b] * own[b] + m_smoothingPrior * sum[b] / weight[b]) / (visits[b] + m_smoothingPrior);
+                }
+            }
+        });
+
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, keys.size()), [&](const tbb::blocked_range<size_t> &range) {
+            for (size_t c = range.begin(); c != range.end(); ++c) {
+                WrapperMap::accessor access;
+                m_storage.find(access, keys[c]);
+                for (int b = 0; b < size; b++)
+                    m_codec.set(access->second.map, b, smoothed[c * size + b]);
+            }
+        });
+    }
+
+    /* Approximate heap footprint of one cell, including the hash map node */
+    size_t cellBytes() const {
+        return 2 * m_angleResolution * m_angleResolution * (m_codec.valueBytes() + m_codec.visitBytes() + sizeof(float))
+            + sizeof(Wrapper) + sizeof(int) + 4 * sizeof(void*);
+    }
+
+    size_t memoryUsage() const {
+        return (m_cellCount + m_fallbackCount) * cellBytes();
+    }
+
+    /**
+     * Evict cells until the storage is back to EVICTION_WATERMARK of the
+     * budget. Evicted cells are merged into their fallback cell, weighted by
+     * visits; hashed states are dropped, their coarser levels take over.
+     * Must not run concurrently with rendering, since iterating the hash map
+     * is not thread safe.
+     */
+    void evict() {
+        size_t target = (size_t)(m_maxCells * EVICTION_WATERMARK);
+        if (m_cellCount <= target)
+            return;
+        int size = 2 * m_angleResolution * m_angleResolution;
+        std::vector<std::pair<int64_t, int>> scores;
+        scores.reserve(m_storage.size());
+        for (WrapperMap::const_iterator it = m_storage.begin(); it != m_storage.end(); ++it) {
+            int64_t visits = 0;
+            for (int i = 0; i < size; i++)
+                visits += m_codec.getVisit(it->second.visit, i);
+            int64_t score = m_eviction == ELeastRecent ? ((int64_t)it->second.lastPass << 32) + visits : visits;
+            scores.push_back(std::make_pair(score, it->first));
+        }
+        size_t victims = scores.size() - target;
+        std::nth_element(scores.begin(), scores.begin() + victims, scores.end());
+        for (size_t v = 0; v < victims; v++) {
+            int block_idx = scores[v].second;
+            WrapperMap::const_accessor cell;
+            if (!m_storage.find(cell, block_idx))
+                continue;
+            if (m_stateHash) {
+                cell.release();
+                m_storage.erase(block_idx);
+                m_cellCount--;
+                continue;
+            }
+            WrapperMap::accessor coarse;
+            if (m_fallback.insert(coarse, fallbackBlock(block_idx))) {
+                coarse->second.init(2 * m_angleResolution, m_angleResolution, m_codec);
+                m_fallbackCount++;
+            }
+            for (int i = 0; i < size; i++) {
+                int64_t v0 = m_codec.getVisit(coarse->second.visit, i), v1 = m_codec.getVisit(cell->second.visit, i);
+                if (v0 + v1 > 0) {
+                    float q = (m_codec.get(coarse->second.map, i) * v0 + m_codec.get(cell->second.map, i) * v1) / (v0 + v1);
+                    m_codec.set(coarse->second.map, i, q);
+                }
+                m_codec.setVisit(coarse->second.visit, i, v0 + v1);
+            }
+            coarse.release();
+            cell.release();
+            m_storage.erase(block_idx);
+            m_cellCount--;
+        }
+        cout << tfm::format("QTableSphereGuider: evicted %d cells, %s in use", victims, memString(memoryUsage())) << endl;
+    }
+
+    /**
+     * Fill the storage from an imported snapshot with a different resolution
+     * or scene bounds. Each new cell blends the old cells around its center
+     * trilinearly, and each new bin averages the old bins it overlaps, with
+     * the overlap estimated from stratified directions within the new bin.
+     * Visit counts are resampled the same way. Only cells near imported data
+     * are created.
+     */
+    void resampleSnapshot() {
+        const QSnapshot& snapshot = *m_snapshot;
+        const QValueCodec& codec = snapshot.getCodec();
+        int oldResolution = snapshot.getHeader().sceneResolution, oldAngle = snapshot.getHeader().angleResolution;
+        int size = 2 * m_angleResolution * m_angleResolution, oldSize = 2 * oldAngle * oldAngle;
+        BoundingBox3f oldBox = snapshot.getBounds();
+        Vector3f oldBlockSize = (oldBox.max - oldBox.min) / oldResolution;
+
+        /* Directional overlap between new and old bins */
+        std::vector<std::vector<std::pair<int, float>>> overlap(size);
+        {
+            int strata = 4 * std::max(1, (oldAngle + m_angleResolution - 1) / m_angleResolution);
+            std::vector<int> hits(strata * strata);
+            for (int b = 0; b < size; b++) {
+                for (int k = 0; k < strata * strata; k++) {
+                    Point2f sample((k / strata + 0.5f) / strata, (k % strata + 0.5f) / strata);
+                    hits[k] = locateDirection(EqualAreaMap::squareToSphereBin(sample, b, m_angleResolution), oldAngle);
+                }
+                std::sort(hits.begin(), hits.end());
+                for (size_t h = 0; h < hits.size(); ) {
+                    size_t end = h;
+                    while (end < hits.size() && hits[end] == hits[h])
+                        end++;
+                    overlap[b].push_back(std::make_pair(hits[h], (float)(end - h) / hits.size()));
+                    h = end;
+                }
+            }
+        }
+
+        /* Mark new cells whose center lies within half an old cell of imported data */
+        std::vector<bool> touched((size_t)m_sceneResolution * m_sceneResolution * m_sceneResolution, false);
+        for (size_t i = 0; i < snapshot.getCellCount(); i++) {
+            int key = snapshot.getKey(i);
+            Vector3f cell((float)(key / oldResolution / oldResolution), (float)((key / oldResolution) % oldResolution),
+                (float)(key % oldResolution));
+            int lo[3], hi[3];
+            for (int k = 0; k < 3; k++) {
+                float a = oldBox.min[k] + (cell[k] - 0.5f) * oldBlockSize[k],
+                      b = oldBox.min[k] + (cell[k] + 1.5f) * oldBlockSize[k];
+                lo[k] = std::max(0, (int)std::ceil((a - m_sceneBox.min[k]) / m_sceneBlockSize[k] - 0.5f));
+                hi[k] = std::min(m_sceneResolution - 1, (int)std::floor((b - m_sceneBox.min[k]) / m_sceneBlockSize[k] - 0.5f));
+            }
+            for (int x = lo[0]; x <= hi[0]; x++)
+                for (int y = lo[1]; y <= hi[1]; y++)
+                    for (int z = lo[2]; z <= hi[2]; z++)
+                        touched[((size_t)x * m_sceneResolution + y) * m_sceneResolution + z] = true;
+        }
+
+        std::vector<float> oldMap(oldSize), oldVisit(oldSize);
+        for (size_t idx = 0; idx < touched.size(); idx++) {
+            if (!touched[idx])
+                continue;
+            int x = (int)(idx / m_sceneResolution / m_sceneResolution),
+                y = (int)((idx / m_sceneResolution) % m_sceneResolution),
+                z = (int)(idx % m_sceneResolution);
+            Point3f center = m_sceneBox.min + m_sceneBlockSize.cwiseProduct(Vector3f(x + 0.5f, y + 0.5f, z + 0.5f));
+            int blocks[8];
+            float weights[8], total = 0.0f;
+            int count = locateNeighbours(center, oldBox.min, oldBlockSize, oldResolution, blocks, weights);
+            std::fill(oldMap.begin(), oldMap.end(), 0.0f);
+            std::fill(oldVisit.begin(), oldVisit.end(), 0.0f);
+            for (int c = 0; c < count; c++) {
+                ptrdiff_t i = snapshot.find(blocks[c]);
+                if (i < 0)
+                    continue;
+                codec.decode(snapshot.getValues(i), oldMap.data(), oldSize, weights[c]);
+                for (int o = 0; o < oldSize; o++)
+                    oldVisit[o] += weights[c] * codec.getVisit(snapshot.getVisits(i), o);
+                total += weights[c];
+            }
+            if (total <= 0.0f)
+                continue;
+
+            WrapperMap::accessor access;
+            if (m_storage.insert(access, (int)idx)) {
+                access->second.init(2 * m_angleResolution, m_angleResolution, m_codec);
+                m_cellCount++;
+            }
+            for (int b = 0; b < size; b++) {
+                float q = 0.0f, visit = 0.0f;
+                for (const auto& o : overlap[b]) {
+                    q += o.second * oldMap[o.first];
+                    visit += o.second * oldVisit[o.first];
+                }
+                m_codec.set(access->second.map, b, q / total);
+                m_codec.setVisit(access->second.visit, b, (int64_t)(visit / total + 0.5f));
+            }
+        }
+    }
+
+    /* Return the (up to 8) cells surrounding pos and their trilinear weights */
+    int locateNeighbours(const Point3f& pos, int* blocks, float* weights) const {
+        return locateNeighbours(pos, m_sceneBox.min, m_sceneBlockSize, m_sceneResolution, blocks, weights);
     }
 
-    inline int locateDirection(const Vector3f& di, int &ix, int& iy) const {
-        float x = std::min(1 - 1e-6f, di.z());
-        float y = 0.0f;
-        if (di.z() > -1 + 1e-6f && di.z() < 1 - 1e-6f) {
-            y = sphericalCoordinates(di).y();
+    /* Same as above, for an arbitrary grid */
+    static int locateNeighbours(const Point3f& pos, const Point3f& origin, const Vector3f& blockSize,
+            int resolution, int* blocks, float* weights) {
+        int lo[3];
+        float frac[3];
+        for (int k = 0; k < 3; k++) {
+            float x = (pos[k] - origin[k]) / blockSize[k] - 0.5f;
+            lo[k] = (int)std::floor(x);
+            frac[k] = x - lo[k];
+            if (lo[k] < 0) {
+                lo[k] = 0;
+                frac[k] = 0.0f;
+            }
+            else if (lo[k] >= resolution - 1) {
+                lo[k] = resolution - 1;
+                frac[k] = 0.0f;
+            }
         }
-        x = (x + 1.0f) / 2.0f;
-        y /= 2.0f * M_PI;
-        ix = x * 2 * m_angleResolution;
-        iy = y * m_angleResolution;
-        return ix * m_angleResolution + iy;
+        int count = 0;
+        for (int c = 0; c < 8; c++) {
+            int x = lo[0], y = lo[1], z = lo[2];
+            float w = 1.0f;
+            w *= (c & 1) ? frac[0] : 1.0f - frac[0];
+            w *= (c & 2) ? frac[1] : 1.0f - frac[1];
+            w *= (c & 4) ? frac[2] : 1.0f - frac[2];
+            if (w <= 0.0f)
+                continue;
+            x += (c & 1) ? 1 : 0;
+            y += (c & 2) ? 1 : 0;
+            z += (c & 4) ? 1 : 0;
+            blocks[count] = (x * resolution + y) * resolution + z;
+            weights[count] = w;
+            count++;
+        }
+        return count;
     }
 
-    int locateDirection(const Vector3f& di) const {
-        int dummyx, dummyy;
-        return locateDirection(di, dummyx, dummyy);
+    /* Pick one of the cells surrounding pos with probability equal to its trilinear weight */
+    int locateBlock(const Point3f& pos, float u) const {
+        int idx[3];
+        for (int k = 0; k < 3; k++) {
+            float x = (pos[k] - m_sceneBox.min[k]) / m_sceneBlockSize[k] - 0.5f;
+            int lo = (int)std::floor(x);
+            float frac = x - lo;
+            if (u < frac) {
+                idx[k] = lo + 1;
+                u /= frac;
+            }
+            else {
+                idx[k] = lo;
+                u = (u - frac) / (1.0f - frac);
+            }
+            idx[k] = std::max(0, std::min(m_sceneResolution - 1, idx[k]));
+        }
+        return (idx[0] * m_sceneResolution + idx[1]) * m_sceneResolution + idx[2];
     }
 
-    inline int locateDirectionHemisphere(const Vector3f& di, int &ix, int& iy) const {
-        float x = std::min(1 - 1e-6f, di.z());
-        float y = 0.0f;
-        if (di.z() < 1 - 1e-6f) {
-            y = sphericalCoordinates(di).y();
+    /* Uniform number derived from the position, so sample() and pdf() agree at a vertex */
+    static float positionHash(const Point3f& pos) {
+        uint32_t h = 0x9e3779b9u;
+        for (int k = 0; k < 3; k++) {
+            uint32_t v;
+            memcpy(&v, &pos[k], sizeof(uint32_t));
+            h ^= v + 0x9e3779b9u + (h << 6) + (h >> 2);
+            h ^= h >> 16;
+            h *= 0x85ebca6bu;
+            h ^= h >> 13;
         }
-        y /= 2 * M_PI;
-        ix = x * m_angleResolution;
-        iy = y * m_angleResolution;
-        return ix * m_angleResolution + iy;
+        return (h >> 8) * (1.0f / (1 << 24));
     }
 
-    int locateDirectionHemisphere(const Vector3f& di) const {
-        int dummyx, dummyy;
-        return locateDirectionHemisphere(di, dummyx, dummyy);
+    /* State of a vertex: the grid cell of its position, or its hashed state at the level of detail to read */
+    int locateState(const Intersection& its) const {
+        if (!m_stateHash)
+            return locateBlock(its.p);
+        return m_stateHash->lookup(its.p, its.shFrame.n, [this](int key) { return cellVisits(key); });
     }
 
-    inline int& getHemisphereMap(int nx, int ny, int x, int y) {
-        return m_hemishpereMap[(((nx * m_angleResolution) + ny) * m_angleResolution + x) * m_angleResolution + y];
+    int locateBlock(const Point3f& pos) const {
+        Vector3f offset = pos - m_sceneBox.min;
+        int x = offset.x() / m_sceneBlockSize.x(),
+            y = offset.y() / m_sceneBlockSize.y(),
+            z = offset.z() / m_sceneBlockSize.z();
+        return (x * m_sceneResolution + y) * m_sceneResolution + z;
+    }
+
+    /* Bin of a world direction, see EqualAreaMap::sphereBin() */
+    inline int locateDirection(const Vector3f& di) const {
+        return EqualAreaMap::sphereBin(di, m_angleResolution);
+    }
+
+    /* Same as above, for an arbitrary angular resolution */
+    static int locateDirection(const Vector3f& di, int resolution) {
+        return EqualAreaMap::sphereBin(di, resolution);
     }
 
     friend class QTableVisualizationIntegrator;
@@ -371,10 +1171,36 @@ protected:
     Vector3f m_sceneBlockSize;
     BoundingBox3f m_sceneBox;
     WrapperMap m_storage;
-    int* m_hemishpereMap;
+    std::vector<Vector3f> m_binCenters;
+    const GuiderKernels *m_kernels;
     const float UPDATE_THREASHOLD = 0.1f;
     std::string m_importFilename;
     std::string m_exportFilename;
+    bool m_verifyImport;
+    std::unique_ptr<QSnapshot> m_snapshot;
+    std::unique_ptr<GuiderTelemetry> m_telemetry;
+    UpdateThinning m_thinning;
+    ConvergenceMonitor m_convergence;
+    bool m_productSampling;
+    BSDFProduct m_product;
+    ESpatialFilter m_spatialFilter;
+    QValueCodec m_codec;
+    size_t m_memoryBudget;
+    size_t m_maxCells;
+    EEvictionPolicy m_eviction;
+    int m_fallbackFactor;
+    int m_fallbackResolution;
+    WrapperMap m_fallback;
+    ESmoothing m_smoothing;
+    std::unique_ptr<StateHash> m_stateHash;
+    float m_smoothingPrior;
+    float m_smoothingRange;
+    std::atomic<size_t> m_cellCount{0};
+    std::atomic<size_t> m_fallbackCount{0};
+    int m_pass = 0;
+    const float EVICTION_WATERMARK = 0.75f;
+    /* Relative difference under which imported scene bounds are used as is */
+    const float BOUNDS_TOLERANCE = 1e-4f;
 };
 
 
@@ -417,21 +1243,15 @@ public:
 
         if (!scene->rayIntersect(Ray3f(its.p, -its.shFrame.n), its_) || its_.mesh->getBSDF()->isProbe())
             return Color3f(0.0f);
-        QTableSphereGuider::WrapperMap::const_accessor const_access;
-        int block_idx = m_guider->locateBlock(its_.p);
-        int nx, ny;
-        m_guider->locateDirection(its_.shFrame.n, nx, ny);
+        int block_idx = m_guider->locateState(its_);
         int angle_idx = m_guider->locateDirection(its.shFrame.n);
 
-        if (m_guider->m_storage.find(const_access, block_idx)) {
-            float maxq = 0.0f;
-
-            for (int i = 0; i < m_guider->m_angleResolution; i++) {
-                for (int j = 0; j < m_guider->m_angleResolution; j++) {
-                    maxq = std::max(maxq, const_access->second.map[m_guider->getHemisphereMap(nx, ny, i, j)]);
-                }
-            }
-            return Color3f(const_access->second.map[angle_idx] / maxq, 1.0f - std::min(1.0f, const_access->second.map[angle_idx] / maxq), 0.0f);
+        std::vector<float> map(2 * m_guider->m_angleResolution * m_guider->m_angleResolution, 0.0f);
+        if (m_guider->decodeCell(block_idx, map.data(), 1.0f)) {
+            std::vector<float> hemisphere(m_guider->m_angleResolution * m_guider->m_angleResolution);
+            m_guider->gather(its_.shFrame, map.data(), hemisphere.data());
+            float maxq = *std::max_element(hemisphere.begin(), hemisphere.end());
+            return Color3f(map[angle_idx] / maxq, 1.0f - std::min(1.0f, map[angle_idx] / maxq), 0.0f);
         }
         return Color3f(0.0f);
     }
@@ -0,0 +1,109 @@
+/*
+    Merges Q-table snapshots that were trained independently (e.g. on
+    several machines) into a single snapshot. Bins are combined by
+    averaging the Q-values weighted by their visit counts.
+*/
+
+#include <tracer/qsnapshot.h>
+#include <memory>
+
+using namespace tracer;
+
+static void checkCompatible(const QSnapshot &a, const QSnapshot &b, const std::string &name) {
+    const QSnapshot::Header &ha = a.getHeader(), &hb = b.getHeader();
+    if (ha.guiderType != hb.guiderType)
+        throw TracerException("%s was exported by a different guider type", name);
+    if (ha.sceneResolution != hb.sceneResolution || ha.angleResolution != hb.angleResolution)
+        throw TracerException("%s has resolution %d/%d, expected %d/%d", name,
+            hb.sceneResolution, hb.angleResolution, ha.sceneResolution, ha.angleResolution);
+    BoundingBox3f ba = a.getBounds(), bb = b.getBounds();
+    float tolerance = 1e-5f * (ba.max - ba.min).norm();
+    if ((ba.min - bb.min).cwiseAbs().maxCoeff() > tolerance || (ba.max - bb.max).cwiseAbs().maxCoeff() > tolerance)
+        throw TracerException("%s has scene bounds %s, expected %s", name, bb.toString(), ba.toString());
+}
+
+int main(int argc, char **argv) {
+    std::string precision;
+    std::vector<std::string> files;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--precision" && i + 1 < argc)
+            precision = argv[++i];
+        else
+            files.push_back(arg);
+    }
+    if (files.size() < 2) {
+        cerr << "Syntax: " << argv[0] << " [--precision float32|float16|log16|log8] <output> <input 1> [<input 2> ...]" << endl;
+        return -1;
+    }
+
+    try {
+        std::vector<std::unique_ptr<QSnapshot>> inputs;
+        for (size_t i = 1; i < files.size(); i++) {
+            inputs.emplace_back(new QSnapshot(files[i]));
+            if (!inputs.back()->verify())
+                throw TracerException("checksum mismatch in %s", files[i]);
+            if (i > 1)
+                checkCompatible(*inputs[0], *inputs.back(), files[i]);
+        }
+
+        const QSnapshot::Header &header = inputs[0]->getHeader();
+        QValueCodec codec(precision.empty() ? inputs[0]->getCodec().getPrecision() : QValueCodec::fromString(precision));
+        QSnapshotWriter writer((QSnapshot::EGuiderType)header.guiderType, codec,
+            header.sceneResolution, header.angleResolution, header.binCount, inputs[0]->getBounds());
+
+        int size = (int)header.binCount;
+        std::vector<double> qsum(size), vsum(size);
+        std::vector<float> qplain(size);
+        std::vector<uint8_t> values(size * codec.valueBytes()), visits(size * codec.visitBytes());
+        std::vector<size_t> cursor(inputs.size(), 0);
+
+        /* Walk the sorted indices of all inputs in lockstep */
+        while (true) {
+            int64_t key = INT64_MAX;
+            for (size_t k = 0; k < inputs.size(); k++) {
+                if (cursor[k] < inputs[k]->getCellCount())
+                    key = std::min(key, (int64_t)inputs[k]->getKey(cursor[k]));
+            }
+            if (key == INT64_MAX)
+                break;
+
+            std::fill(qsum.begin(), qsum.end(), 0.0);
+            std::fill(vsum.begin(), vsum.end(), 0.0);
+            std::fill(qplain.begin(), qplain.end(), 0.0f);
+            int count = 0;
+            for (size_t k = 0; k < inputs.size(); k++) {
+                const QSnapshot &input = *inputs[k];
+                if (cursor[k] >= input.getCellCount() || input.getKey(cursor[k]) != key)
+                    continue;
+                const QValueCodec &source = input.getCodec();
+                const uint8_t *q = input.getValues(cursor[k]), *v = input.getVisits(cursor[k]);
+                for (int b = 0; b < size; b++) {
+                    float value = source.get(q, b);
+                    int visit = source.getVisit(v, b);
+                    qsum[b] += (double)value * visit;
+                    vsum[b] += visit;
+                    qplain[b] += value;
+                }
+                count++;
+                cursor[k]++;
+            }
+
+            for (int b = 0; b < size; b++) {
+                /* Bins that no input has visited keep their (unweighted) mean */
+                float q = vsum[b] > 0 ? (float)(qsum[b] / vsum[b]) : qplain[b] / count;
+                codec.set(values.data(), b, q);
+                codec.setVisit(visits.data(), b, (int64_t)vsum[b]);
+            }
+            writer.add((int32_t)key, values.data(), visits.data());
+        }
+
+        writer.write(files[0]);
+        cout << tfm::format("Merged %d tables into %s (%d cells, %s)", inputs.size(), files[0],
+            writer.getCellCount(), QValueCodec::toString(codec.getPrecision())) << endl;
+    } catch (const std::exception &e) {
+        cerr << "Fatal error: " << e.what() << endl;
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,227 @@
+/*
+    Trains Q-table guiders offline from the transition logs that the guided
+    integrators write with recordTransitions, replaying the transitions at
+    full CPU speed. Lists of learning rates and resolutions train one table
+    per combination, in parallel. The tables are written as snapshots that
+    the renderer can import. The neural guider can be trained the same way,
+    and --bench measures the sampling throughput of the trained guiders.
+    The whole log is loaded into memory (56 bytes per transition) and
+    shared by all configurations.
+*/
+
+#include <tracer/parser.h>
+#include <tracer/scene.h>
+#include <tracer/sampler.h>
+#include <tracer/block.h>
+#include <tracer/guider.h>
+#include <tracer/timer.h>
+#include <tracer/transitions.h>
+#include <filesystem/resolver.h>
+#include <tbb/parallel_for.h>
+#include <tbb/blocked_range.h>
+#include <memory>
+
+using namespace tracer;
+
+/* Transitions replayed per task, each task seeds its own sampler */
+static const size_t TRANSITIONS_PER_TASK = 4096;
+
+struct TrainingConfig {
+    std::string alpha;
+    int sceneResolution;
+    int angleResolution;
+    std::string output;
+};
+
+static std::vector<std::string> splitList(const std::string &list) {
+    std::vector<std::string> items;
+    size_t start = 0;
+    while (true) {
+        size_t end = list.find(',', start);
+        items.push_back(list.substr(start, end == std::string::npos ? std::string::npos : end - start));
+        if (end == std::string::npos)
+            break;
+        start = end + 1;
+    }
+    return items;
+}
+
+/* Set a guider property given on the command line, with the type its value looks like */
+static void setProperty(PropertyList &props, const std::string &assignment) {
+    size_t eq = assignment.find('=');
+    if (eq == std::string::npos)
+        throw TracerException("Expected name=value, got \"%s\"", assignment);
+    std::string name = assignment.substr(0, eq), value = assignment.substr(eq + 1);
+    char *end = nullptr;
+    if (value == "true" || value == "false") {
+        props.setBoolean(name, value == "true");
+        return;
+    }
+    long integer = strtol(value.c_str(), &end, 10);
+    if (!value.empty() && *end == '\0') {
+        props.setInteger(name, (int)integer);
+        return;
+    }
+    float real = strtof(value.c_str(), &end);
+    if (!value.empty() && *end == '\0')
+        props.setFloat(name, real);
+    else
+        props.setString(name, value);
+}
+
+/* Name of the table of a configuration when several are trained: the parameters go before the extension */
+static std::string outputName(const std::string &output, const std::string &type, const TrainingConfig &config) {
+    std::string suffix = type == "neural" ? tfm::format("_res-%d", config.angleResolution)
+        : tfm::format("_alpha-%s_res-%d-%d", config.alpha, config.sceneResolution, config.angleResolution);
+    size_t dot = output.find_last_of('.'), slash = output.find_last_of("/\\");
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+        return output + suffix;
+    return output.substr(0, dot) + suffix + output.substr(dot);
+}
+
+/* Time locating and sampling the guider at the destinations of the logged transitions */
+static void benchmark(const Scene *scene, const TransitionLog &log, Guider *guider, size_t samples, const std::string &name) {
+    size_t tasks = (samples + TRANSITIONS_PER_TASK - 1) / TRANSITIONS_PER_TASK;
+    Timer timer;
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, tasks), [&](const tbb::blocked_range<size_t> &range) {
+        std::unique_ptr<Sampler> sampler(scene->getSampler()->clone());
+        ImageBlock seed(Vector2i(1, 1), nullptr);
+        Intersection origin, dest;
+        GuiderCell cell;
+        for (size_t task = range.begin(); task != range.end(); ++task) {
+            seed.setOffset(Point2i((int)task, -1));
+            sampler->prepare(seed);
+            size_t end = std::min(samples, (task + 1) * TRANSITIONS_PER_TASK);
+            for (size_t i = task * TRANSITIONS_PER_TASK; i < end; i++) {
+                log.get(i % log.getCount(), origin, dest);
+                float pdf;
+                guider->locate(dest, dest.shFrame.toLocal((origin.p - dest.p).normalized()), cell);
+                guider->sample(sampler->next2D(), cell, pdf);
+            }
+        }
+    });
+    double seconds = timer.elapsed() / 1000.0;
+    cout << tfm::format("%s: %d samples in %s (%.3f M samples/s, locate + sample)", name, samples,
+        timer.elapsedString(), samples / std::max(seconds, 1e-9) * 1e-6) << endl;
+}
+
+/* Train and export the guider of a configuration, which is returned for benchmarking */
+static std::unique_ptr<Guider> train(const Scene *scene, const TransitionLog &log, const std::string &type,
+        const PropertyList &baseProps, const TrainingConfig &config, int epochs) {
+    PropertyList props(baseProps);
+    if (config.alpha != "visits")
+        props.setFloat("alpha", std::stof(config.alpha));
+    props.setInteger("sceneResolution", config.sceneResolution);
+    props.setInteger("angleResolution", config.angleResolution);
+    props.setString("export", config.output);
+    std::unique_ptr<Guider> guider(static_cast<Guider *>(TracerObjectFactory::createInstance(type, props)));
+    guider->activate();
+    guider->init(scene);
+
+    size_t tasks = (log.getCount() + TRANSITIONS_PER_TASK - 1) / TRANSITIONS_PER_TASK;
+    for (int epoch = 0; epoch < epochs; epoch++) {
+        guider->beginPass();
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, tasks), [&](const tbb::blocked_range<size_t> &range) {
+            std::unique_ptr<Sampler> sampler(scene->getSampler()->clone());
+            ImageBlock seed(Vector2i(1, 1), nullptr);
+            Intersection origin, dest;
+            for (size_t task = range.begin(); task != range.end(); ++task) {
+                seed.setOffset(Point2i((int)task, epoch));
+                sampler->prepare(seed);
+                size_t end = std::min(log.getCount(), (task + 1) * TRANSITIONS_PER_TASK);
+                for (size_t i = task * TRANSITIONS_PER_TASK; i < end; i++) {
+                    log.get(i, origin, dest);
+                    guider->update(origin, dest, sampler.get());
+                }
+            }
+        });
+        guider->endPass();
+    }
+    guider->done();
+    return guider;
+}
+
+int main(int argc, char **argv) {
+    std::string type = "qtable", alphas = "visits", sceneResolutions = "50", angleResolutions = "8";
+    int epochs = 1;
+    size_t benchSamples = 0;
+    PropertyList baseProps;
+    std::vector<std::string> files;
+    try {
+        for (int i = 1; i < argc; i++) {
+            std::string arg = argv[i];
+            if (arg == "--guider" && i + 1 < argc)
+                type = argv[++i];
+            else if (arg == "--alpha" && i + 1 < argc)
+                alphas = argv[++i];
+            else if (arg == "--sceneResolution" && i + 1 < argc)
+                sceneResolutions = argv[++i];
+            else if (arg == "--angleResolution" && i + 1 < argc)
+                angleResolutions = argv[++i];
+            else if (arg == "--epochs" && i + 1 < argc)
+                epochs = std::stoi(argv[++i]);
+            else if (arg == "--bench" && i + 1 < argc)
+                benchSamples = (size_t)std::stoll(argv[++i]);
+            else if (arg == "--set" && i + 1 < argc)
+                setProperty(baseProps, argv[++i]);
+            else
+                files.push_back(arg);
+        }
+    } catch (const std::exception &e) {
+        cerr << "Fatal error: " << e.what() << endl;
+        return -1;
+    }
+    if (files.size() != 3 || (type != "qtable" && type != "qtable_sphere" && type != "neural") || epochs < 1) {
+        cerr << "Syntax: " << argv[0] << " [--guider qtable|qtable_sphere|neural] [--alpha <a>,...|visits] [--sceneResolution <r>,...]" << endl
+             << "       [--angleResolution <r>,...] [--epochs <n>] [--bench <samples>] [--set <name>=<value> ...]" << endl
+             << "       <scene.xml> <transitions> <output>" << endl;
+        return -1;
+    }
+    if (type == "neural") {
+        /* The network has no learning rate per update nor spatial grid */
+        alphas = "visits";
+        sceneResolutions = "50";
+    }
+
+    try {
+        filesystem::path path(files[0]);
+        getFileResolver()->prepend(path.parent_path());
+        std::unique_ptr<TracerObject> root(loadFromXML(files[0]));
+        if (root->getClassType() != TracerObject::EScene)
+            throw TracerException("%s does not describe a scene", files[0]);
+        const Scene *scene = static_cast<const Scene *>(root.get());
+
+        TransitionLog log(files[1], scene);
+        cout << tfm::format("Loaded %d transitions from %s", log.getCount(), files[1]) << endl;
+
+        std::vector<TrainingConfig> configs;
+        for (const std::string &alpha : splitList(alphas)) {
+            for (const std::string &sceneResolution : splitList(sceneResolutions)) {
+                for (const std::string &angleResolution : splitList(angleResolutions))
+                    configs.push_back({ alpha, std::stoi(sceneResolution), std::stoi(angleResolution), files[2] });
+            }
+        }
+        if (configs.size() > 1) {
+            for (TrainingConfig &config : configs)
+                config.output = outputName(files[2], type, config);
+        }
+
+        Timer timer;
+        std::vector<std::unique_ptr<Guider>> guiders(configs.size());
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, configs.size(), 1), [&](const tbb::blocked_range<size_t> &range) {
+            for (size_t c = range.begin(); c != range.end(); ++c)
+                guiders[c] = train(scene, log, type, baseProps, configs[c], epochs);
+        });
+        cout << tfm::format("Trained %d tables in %s", configs.size(), timer.elapsedString()) << endl;
+
+        /* One guider at a time, so that each benchmark has the machine to itself */
+        if (benchSamples > 0 && log.getCount() > 0) {
+            for (size_t c = 0; c < configs.size(); c++)
+                benchmark(scene, log, guiders[c].get(), benchSamples, configs[c].output);
+        }
+    } catch (const std::exception &e) {
+        cerr << "Fatal error: " << e.what() << endl;
+        return -1;
+    }
+    return 0;
+}
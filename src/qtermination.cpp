@@ -0,0 +1,49 @@
+#include <tracer/qtermination.h>
+#include <tracer/sampler.h>
+
+TRACER_NAMESPACE_BEGIN
+
+QTermination::QTermination(const PropertyList &props) {
+    std::string mode = props.getString("qTermination", "none");
+    if (mode == "none")
+        m_mode = ENone;
+    else if (mode == "biased")
+        m_mode = EBiased;
+    else if (mode == "unbiased")
+        m_mode = EUnbiased;
+    else
+        throw TracerException("QTermination: unknown mode \"%s\"", mode);
+    m_visits = props.getInteger("qTerminationVisits", 64);
+    m_depth = props.getInteger("qTerminationDepth", 1);
+    m_probability = props.getFloat("qTerminationProbability", 0.5f);
+    if (m_visits < 0 || m_depth < 0 || m_probability <= 0.0f || m_probability >= 1.0f)
+        throw TracerException("QTermination: qTerminationVisits and qTerminationDepth must be >= 0, "
+            "qTerminationProbability in (0, 1)");
+}
+
+float QTermination::decide(Guider *guider, const GuiderCell &cell, int depth, Sampler *sampler, Color3f &estimate) const {
+    estimate = Color3f(0.0f);
+    /* Guiders that do not count visits only qualify without a visit threshold */
+    if (m_mode == ENone || depth < m_depth || (cell.visits < 0 ? m_visits > 0 : cell.visits < m_visits))
+        return 1.0f;
+    Color3f reflected;
+    if (!guider->reflected(cell, sampler, reflected))
+        return 1.0f;
+    if (m_mode == EBiased || sampler->next1D() < m_probability) {
+        estimate = reflected;
+        return 0.0f;
+    }
+    /* estimate + (continuation - estimate) / (1 - p) */
+    estimate = reflected * (-m_probability / (1.0f - m_probability));
+    return 1.0f / (1.0f - m_probability);
+}
+
+std::string QTermination::toString() const {
+    if (m_mode == ENone)
+        return "none";
+    return tfm::format("QTermination[mode = %s, visits = %d, depth = %d%s]",
+        m_mode == EBiased ? "biased" : "unbiased", m_visits, m_depth,
+        m_mode == EUnbiased ? tfm::format(", probability = %f", m_probability) : "");
+}
+
+TRACER_NAMESPACE_END
@@ -0,0 +1,39 @@
+#include <tracer/qvalue.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define TRACER_F16C_KERNEL 1
+#endif
+
+TRACER_NAMESPACE_BEGIN
+
+#if defined(TRACER_F16C_KERNEL)
+/* Compiled for F16C on its own and only called after the runtime check, so
+   the rest of the binary still runs on CPUs without the instructions */
+__attribute__((target("avx,f16c")))
+static int decodeHalfF16C(const uint16_t* q, float* dst, int n, float weight) {
+    __m256 w = _mm256_set1_ps(weight);
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 v = _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(q + i)));
+        _mm256_storeu_ps(dst + i, _mm256_add_ps(_mm256_loadu_ps(dst + i), _mm256_mul_ps(w, v)));
+    }
+    return i;
+}
+
+static bool hasF16C() {
+    static const bool supported = __builtin_cpu_supports("avx") && __builtin_cpu_supports("f16c");
+    return supported;
+}
+#endif
+
+void QValueCodec::decodeHalf(const uint16_t* q, float* dst, int n, float weight) {
+    int i = 0;
+#if defined(TRACER_F16C_KERNEL)
+    if (hasF16C())
+        i = decodeHalfF16C(q, dst, n, weight);
+#endif
+    for (; i < n; i++)
+        dst[i] += weight * halfToFloat(q[i]);
+}
+
+TRACER_NAMESPACE_END
@@ -29,6 +29,7 @@ TRACER_NAMESPACE_BEGIN
 Scene::Scene(const PropertyList &props) {
     m_accel = new Accel();
     m_isprogressive = props.getBoolean("progressive", false);
+    m_uselighttree = props.getBoolean("lightTree", true);
 }
 
 Scene::~Scene() {
@@ -58,6 +59,8 @@ void Scene::activate() {
         }
     }
     m_emitterpdf.normalize();
+    if (m_uselighttree)
+        m_lightTree.build(m_meshes);
 
     cout << endl;
     cout << "Configuration: " << toString() << endl;
@@ -78,6 +81,34 @@ const Emitter* Scene::sampleEmitter(const float& sample, float &pdf) const {
 	return sampleEmitter(s, pdf);
 }
 
+const Emitter *Scene::sampleLight(const Point3f &ref, float sample, const Point2f &sample2,
+        Point3f &p, Frame &nFrame, float &pdf) const {
+    if (!m_uselighttree) {
+        float emitter_pdf, surface_pdf;
+        const Emitter *emitter = sampleEmitter(sample, emitter_pdf);
+        if (!emitter)
+            return nullptr;
+        emitter->sample(ref, sample2, p, nFrame, surface_pdf);
+        pdf = emitter_pdf * surface_pdf;
+        return emitter;
+    }
+    uint32_t face;
+    const Mesh *mesh = m_lightTree.sample(ref, sample, face, pdf);
+    if (!mesh)
+        return nullptr;
+    mesh->sampleTriangle(face, sample2, p, nFrame);
+    pdf /= mesh->surfaceArea(face);
+    return mesh->getEmitter();
+}
+
+float Scene::pdfLight(const Point3f &ref, const Intersection &its) const {
+    if (!its.mesh->isEmitter())
+        return 0.0f;
+    if (!m_uselighttree)
+        return its.mesh->getEmitter()->pdf(its.p) / m_emitters.size();
+    return m_lightTree.pdf(ref, its.mesh, its.face) / its.mesh->surfaceArea(its.face);
+}
+
 void Scene::addChild(TracerObject *obj) {
     switch (obj->getClassType()) {
         case EMesh: {
@@ -132,12 +163,14 @@ std::string Scene::toString() const {
         "  integrator = %s,\n"
         "  sampler = %s\n"
         "  camera = %s,\n"
+        "  lights = %s,\n"
         "  meshes = {\n"
         "  %s  }\n"
         "]",
         indent(m_integrator->toString()),
         indent(m_sampler->toString()),
         indent(m_camera->toString()),
+        m_uselighttree ? m_lightTree.toString() : "uniform",
         indent(meshes, 2)
     );
 }
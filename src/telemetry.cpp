@@ -0,0 +1,124 @@
+#include <tracer/telemetry.h>
+#include <fstream>
+#include <sstream>
+
+TRACER_NAMESPACE_BEGIN
+
+static const int PDF_OFFSET = 8;
+
+GuiderTelemetry::GuiderTelemetry(const std::string &filename, float interval)
+    : m_filename(filename), m_interval(interval) {
+    m_csv = filename.size() >= 4 && filename.compare(filename.size() - 4, 4, ".csv") == 0;
+    for (int i = 0; i < HISTOGRAM_BINS; i++)
+        m_pdfHistogram[i] = 0;
+    beginCells();
+}
+
+int GuiderTelemetry::histogramBin(double value, int offset) {
+    if (value <= 0.0)
+        return 0;
+    int bin = (int)std::floor(std::log2(value)) + offset;
+    return std::max(0, std::min(HISTOGRAM_BINS - 1, bin));
+}
+
+void GuiderTelemetry::recordSample(float pdf) {
+    m_samples.fetch_add(1, std::memory_order_relaxed);
+    m_pdfHistogram[histogramBin(pdf, PDF_OFFSET)].fetch_add(1, std::memory_order_relaxed);
+}
+
+void GuiderTelemetry::beginCells() {
+    m_cells = 0;
+    m_qSum = m_qMax = m_entropySum = 0.0;
+    for (int i = 0; i < HISTOGRAM_BINS; i++)
+        m_visitHistogram[i] = 0;
+}
+
+void GuiderTelemetry::addCell(const float *q, int n, int64_t visits) {
+    double sum = 0.0, max = 0.0;
+    for (int i = 0; i < n; i++) {
+        sum += q[i];
+        max = std::max(max, (double)q[i]);
+    }
+    /* Entropy of the Q-values seen as a distribution over the bins, normalized to [0, 1] */
+    double entropy = 0.0;
+    if (sum > 0.0 && n > 1) {
+        for (int i = 0; i < n; i++) {
+            double p = q[i] / sum;
+            if (p > 0.0)
+                entropy -= p * std::log(p);
+        }
+        entropy /= std::log((double)n);
+    }
+    m_cells++;
+    m_qSum += sum / n;
+    m_qMax = std::max(m_qMax, max);
+    m_entropySum += entropy;
+    m_visitHistogram[visits > 0 ? histogramBin((double)visits, 1) : 0]++;
+}
+
+void GuiderTelemetry::record(const std::string &event, int pass, size_t memory) {
+    double seconds = m_sinceRecord.lap() / 1000.0;
+    uint64_t updates = m_updates.exchange(0), samples = m_samples.exchange(0), waitNs = m_waitNs.exchange(0),
+             paths = m_paths.exchange(0), vertices = m_vertices.exchange(0);
+    std::string pdfs, visits;
+    for (int i = 0; i < HISTOGRAM_BINS; i++) {
+        std::string sep = i > 0 ? (m_csv ? " " : ", ") : "";
+        pdfs += sep + std::to_string(m_pdfHistogram[i].exchange(0));
+        visits += sep + std::to_string(m_visitHistogram[i]);
+    }
+    double qMean = m_cells > 0 ? m_qSum / m_cells : 0.0,
+           entropy = m_cells > 0 ? m_entropySum / m_cells : 0.0,
+           rate = seconds > 0.0 ? updates / seconds : 0.0,
+           pathLength = paths > 0 ? (double)vertices / paths : 0.0;
+
+    std::ostringstream out;
+    if (m_csv) {
+        if (m_records.empty())
+            m_records.push_back("event,time,pass,cells,memory,updates,updatesPerSecond,samples,waitMs,paths,verticesPerPath,"
+                "qMean,qMax,entropyMean,visitHistogram,pdfHistogram\n");
+        out << event << "," << m_total.elapsed() / 1000.0 << "," << pass << "," << m_cells << "," << memory << ","
+            << updates << "," << rate << "," << samples << "," << waitNs * 1e-6 << ","
+            << paths << "," << pathLength << ","
+            << qMean << "," << m_qMax << "," << entropy << ",\"" << visits << "\",\"" << pdfs << "\"\n";
+    }
+    else {
+        out << "  {\n"
+            << "    \"event\": \"" << event << "\",\n"
+            << "    \"time\": " << m_total.elapsed() / 1000.0 << ",\n"
+            << "    \"pass\": " << pass << ",\n"
+            << "    \"cells\": " << m_cells << ",\n"
+            << "    \"memory\": " << memory << ",\n"
+            << "    \"updates\": " << updates << ",\n"
+            << "    \"updatesPerSecond\": " << rate << ",\n"
+            << "    \"samples\": " << samples << ",\n"
+            << "    \"waitMs\": " << waitNs * 1e-6 << ",\n"
+            << "    \"paths\": " << paths << ",\n"
+            << "    \"verticesPerPath\": " << pathLength << ",\n"
+            << "    \"qMean\": " << qMean << ",\n"
+            << "    \"qMax\": " << m_qMax << ",\n"
+            << "    \"entropyMean\": " << entropy << ",\n"
+            << "    \"visitHistogram\": [" << visits << "],\n"
+            << "    \"pdfHistogram\": [" << pdfs << "],\n"
+            << "    \"pdfHistogramMin\": " << std::ldexp(1.0, -PDF_OFFSET) << "\n"
+            << "  }";
+    }
+    m_records.push_back(out.str());
+
+    /* Rewrite the whole file so that it is always complete */
+    std::ofstream file(m_filename, std::ios::out | std::ios::trunc);
+    if (!file.is_open())
+        throw TracerException("Cannot open file %s to write", m_filename);
+    if (m_csv) {
+        for (const std::string &r : m_records)
+            file << r;
+    }
+    else {
+        file << "[\n";
+        for (size_t i = 0; i < m_records.size(); i++)
+            file << m_records[i] << (i + 1 < m_records.size() ? ",\n" : "\n");
+        file << "]\n";
+    }
+    beginCells();
+}
+
+TRACER_NAMESPACE_END
@@ -0,0 +1,56 @@
+#include <tracer/thinning.h>
+#include <chrono>
+
+TRACER_NAMESPACE_BEGIN
+
+UpdateThinning::UpdateThinning(const PropertyList &props) {
+    m_visits = props.getInteger("thinVisits", 0);
+    m_minProbability = props.getFloat("thinMinProbability", 0.05f);
+    m_maxRate = props.getFloat("maxUpdateRate", 0.0f);
+    if (m_visits < 0 || m_minProbability <= 0.0f || m_minProbability > 1.0f || m_maxRate < 0.0f)
+        throw TracerException("UpdateThinning: thinVisits and maxUpdateRate must be >= 0, thinMinProbability in (0, 1]");
+}
+
+float UpdateThinning::accept(int64_t visits, float u) {
+    float probability = 1.0f;
+    if (m_visits > 0 && visits > m_visits)
+        probability = std::max(m_minProbability, (float)m_visits / visits);
+    if (u >= probability)
+        return 0.0f;
+
+    if (m_maxRate > 0) {
+        /* One window shared by all threads; only every CLOCK_INTERVAL-th candidate reads the clock */
+        if ((m_windowCount.fetch_add(1, std::memory_order_relaxed) + 1) % CLOCK_INTERVAL == 0)
+            endWindow();
+        /* The same u decides, so the combined probability is that of both tests */
+        probability *= m_rateProbability.load(std::memory_order_relaxed);
+        if (u >= probability)
+            return 0.0f;
+    }
+    return 1.0f / probability;
+}
+
+void UpdateThinning::endWindow() {
+    int64_t now = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+    int64_t start = m_windowStart.load(std::memory_order_relaxed);
+    /* A window also ends early once it has seen a second's worth of updates, so that a burst is capped quickly */
+    if ((now - start < WINDOW_MS && m_windowCount.load(std::memory_order_relaxed) < m_maxRate * WINDOW_MS / 1000)
+        || now == start || !m_windowStart.compare_exchange_strong(start, now))
+        return;
+    int64_t count = m_windowCount.exchange(0, std::memory_order_relaxed);
+    /* The first window only starts the clock */
+    if (start == 0)
+        return;
+    float rate = count * 1000.0f / (now - start);
+    m_rateProbability.store(rate > m_maxRate ? m_maxRate / rate : 1.0f, std::memory_order_relaxed);
+}
+
+std::string UpdateThinning::toString() const {
+    if (!isEnabled())
+        return "none";
+    return tfm::format("UpdateThinning[visits = %d, minProbability = %f, maxRate = %f]",
+        m_visits, m_minProbability, m_maxRate);
+}
+
+TRACER_NAMESPACE_END
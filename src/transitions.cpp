@@ -0,0 +1,119 @@
+#include <tracer/transitions.h>
+#include <tracer/scene.h>
+
+TRACER_NAMESPACE_BEGIN
+
+static const char TRANSITION_MAGIC[8] = { 'R', 'L', 'Q', 'T', 'R', 'A', 'N', 'S' };
+static const uint32_t TRANSITION_VERSION = 2;
+
+/* Records per thread buffered before they are written */
+static const size_t TRANSITION_BUFFER = 4096;
+
+struct TransitionHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t recordBytes;
+    uint32_t meshCount;
+    uint32_t reserved;
+};
+
+static void store(float *dst, const Vector3f &v) {
+    dst[0] = v.x(); dst[1] = v.y(); dst[2] = v.z();
+}
+
+static void rebuild(const float *p, const float *n, const Mesh *mesh, Intersection &its) {
+    its.p = Point3f(p[0], p[1], p[2]);
+    its.shFrame = Frame(Vector3f(n[0], n[1], n[2]));
+    its.geoFrame = its.shFrame;
+    its.mesh = mesh;
+}
+
+TransitionRecorder::TransitionRecorder(const std::string &filename, const Scene *scene)
+    : m_filename(filename), m_file(filename, std::ios::binary | std::ios::out | std::ios::trunc) {
+    if (!m_file.is_open())
+        throw TracerException("Cannot open file %s to write", filename);
+    const std::vector<Mesh *> &meshes = scene->getMeshes();
+    for (size_t i = 0; i < meshes.size(); i++)
+        m_meshes[meshes[i]] = (int32_t)i;
+    TransitionHeader header;
+    memcpy(header.magic, TRANSITION_MAGIC, sizeof(TRANSITION_MAGIC));
+    header.version = TRANSITION_VERSION;
+    header.recordBytes = sizeof(TransitionRecord);
+    header.meshCount = (uint32_t)meshes.size();
+    header.reserved = 0;
+    m_file.write((const char *)&header, sizeof(header));
+}
+
+void TransitionRecorder::record(const Intersection &origin, const Intersection &dest) {
+    TransitionRecord record;
+    store(record.origin, origin.p);
+    store(record.originNormal, origin.shFrame.n);
+    store(record.dest, dest.p);
+    store(record.destNormal, dest.shFrame.n);
+    auto it = m_meshes.find(origin.mesh);
+    record.originMesh = it != m_meshes.end() ? it->second : -1;
+    it = m_meshes.find(dest.mesh);
+    record.destMesh = it != m_meshes.end() ? it->second : -1;
+
+    std::vector<TransitionRecord> &buffer = m_buffers.local();
+    buffer.push_back(record);
+    if (buffer.size() >= TRANSITION_BUFFER)
+        flush(buffer);
+}
+
+void TransitionRecorder::flush(std::vector<TransitionRecord> &buffer) {
+    if (buffer.empty())
+        return;
+    {
+        tbb::mutex::scoped_lock lock(m_mutex);
+        m_file.write((const char *)buffer.data(), buffer.size() * sizeof(TransitionRecord));
+    }
+    m_count += buffer.size();
+    buffer.clear();
+}
+
+void TransitionRecorder::close() {
+    if (!m_file.is_open())
+        return;
+    for (auto &buffer : m_buffers)
+        flush(buffer);
+    m_file.close();
+    if (!m_file)
+        throw TracerException("Error while writing %s", m_filename);
+}
+
+TransitionLog::TransitionLog(const std::string &filename, const Scene *scene) : m_scene(scene) {
+    std::ifstream file(filename, std::ios::binary | std::ios::in);
+    if (!file.is_open())
+        throw TracerException("Cannot open file %s", filename);
+    TransitionHeader header;
+    if (!file.read((char *)&header, sizeof(header)) || memcmp(header.magic, TRANSITION_MAGIC, sizeof(TRANSITION_MAGIC)) != 0)
+        throw TracerException("%s is not a transition log", filename);
+    if (header.version != TRANSITION_VERSION || header.recordBytes != sizeof(TransitionRecord))
+        throw TracerException("%s has unsupported version %d", filename, header.version);
+    if (header.meshCount != scene->getMeshes().size())
+        throw TracerException("%s was recorded in a scene with %d meshes, this one has %d", filename,
+            header.meshCount, scene->getMeshes().size());
+
+    file.seekg(0, std::ios::end);
+    size_t bytes = (size_t)file.tellg() - sizeof(header);
+    file.seekg(sizeof(header));
+    m_records.resize(bytes / sizeof(TransitionRecord));
+    file.read((char *)m_records.data(), m_records.size() * sizeof(TransitionRecord));
+    if (!file)
+        throw TracerException("Error while reading %s", filename);
+    for (const TransitionRecord &record : m_records) {
+        if (record.originMesh < 0 || record.destMesh < 0
+            || record.originMesh >= (int32_t)header.meshCount || record.destMesh >= (int32_t)header.meshCount)
+            throw TracerException("%s refers to an unknown mesh", filename);
+    }
+}
+
+void TransitionLog::get(size_t i, Intersection &origin, Intersection &dest) const {
+    const TransitionRecord &record = m_records[i];
+    const std::vector<Mesh *> &meshes = m_scene->getMeshes();
+    rebuild(record.origin, record.originNormal, meshes[record.originMesh], origin);
+    rebuild(record.dest, record.destNormal, meshes[record.destMesh], dest);
+}
+
+TRACER_NAMESPACE_END
@@ -19,6 +19,7 @@
 #include <tracer/warp.h>
 #include <tracer/bsdf.h>
 #include <tracer/lightprobe.h>
+#include <tracer/equalarea.h>
 #include <nanogui/screen.h>
 #include <nanogui/glutil.h>
 #include <nanogui/label.h>
@@ -58,6 +59,7 @@ using tracer::BSDF;
 using tracer::BSDFQueryRecord;
 using tracer::Color3f;
 using tracer::LightProbe;
+using tracer::EqualAreaMap;
 
 class WarpTest : public Screen {
 public:
@@ -76,9 +78,14 @@ public:
         CosineHemisphere,
         Beckmann,
         MicrofacetBRDF,
-		ImageLightProbe
+		ImageLightProbe,
+        EqualAreaHemisphere,
+        EqualAreaSphere
     };
 
+    /* Bins per side of the equal-area sphere warp */
+    static const int EQUAL_AREA_RESOLUTION = 4;
+
     WarpTest(): Screen(Vector2i(800, 600), "Assignment 3: Sampling and Warping"), m_bRec(Vector3f()), m_light(LightProbe()) {
         initializeGUI();
         m_drawHistogram = false;
@@ -108,6 +115,22 @@ public:
                 return std::make_pair(bRec.wo, value == 0 ? 0.f : m_brdf->eval(bRec)[0]);
              }
 			case ImageLightProbe: result << Warp::squareToLightProbe(sample, m_light), 0; break;
+            case EqualAreaHemisphere: {
+                /* Points the inverse mapping does not send back are dropped, failing the test */
+                result = EqualAreaMap::squareToHemisphere(sample);
+                bool inverse = (EqualAreaMap::hemisphereToSquare(result) - sample).cwiseAbs().maxCoeff() < 1e-3f;
+                return std::make_pair(result, inverse ? 1.f : 0.f);
+            }
+            case EqualAreaSphere: {
+                /* Pick one of the sphere bins with the first coordinate and reuse it within the bin */
+                const int res = EQUAL_AREA_RESOLUTION, n = 2 * res * res;
+                int b = std::min((int) (sample.x() * n), n - 1), i = (b % (n / 2)) / res, j = b % res;
+                Point2f p(sample.x() * n - b, sample.y());
+                result = EqualAreaMap::squareToSphereBin(p, b, res);
+                Point2f square((i + p.x()) / res, (j + p.y()) / res);
+                bool inverse = (EqualAreaMap::hemisphereToSquare(result) - square).cwiseAbs().maxCoeff() < 1e-3f;
+                return std::make_pair(result, inverse ? 1.f : 0.f);
+            }
         }
 
         return std::make_pair(result, 1.f);
@@ -495,6 +518,10 @@ public:
                     return Warp::squareToUniformHemispherePdf(v);
                 else if (warpType == CosineHemisphere)
                     return Warp::squareToCosineHemispherePdf(v);
+                else if (warpType == EqualAreaHemisphere)
+                    return v.z() > 0 ? INV_TWOPI : 0.0;
+                else if (warpType == EqualAreaSphere)
+                    return INV_FOURPI;
                 else if (warpType == Beckmann)
                     return Warp::squareToBeckmannPdf(v, parameterValue);
                 else if (warpType == MicrofacetBRDF) {
@@ -591,7 +618,8 @@ public:
 
         new Label(m_window, "Warping method", "sans-bold");
         m_warpTypeBox = new ComboBox(m_window, { "Square", "Tent", "Disk", "Sphere", "Hemisphere (unif.)",
-                "Hemisphere (cos)", "Beckmann distr.", "Microfacet BRDF", "Light Probe" });
+                "Hemisphere (cos)", "Beckmann distr.", "Microfacet BRDF", "Light Probe",
+                "Hemisphere (eq. area)", "Sphere (eq. area bins)" });
         m_warpTypeBox->setCallback([&](int) { refresh(); });
 
         panel = new Widget(m_window);